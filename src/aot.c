@@ -0,0 +1,414 @@
+//aot.c -
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+#include "aot.h"
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AOT_X86
+#include <cpuid.h>
+#elif defined(__linux__)
+#include <sys/auxv.h>
+#endif
+
+#define AOT_PATH 4096
+
+//Passed to the compiler between the program name and the output arguments
+static const char *const _compilerFlags[] = { "-O2", "-march=native", "-fno-math-errno", "-fPIC", "-shared" };
+#define COMPILER_FLAG_COUNT (sizeof(_compilerFlags) / sizeof(_compilerFlags[0]))
+
+//libm function for each unary operation written as a call
+static const char *const _functions[FORMULA_OP_COUNT] = {
+	[FORMULA_SQRT] = "sqrt",
+	[FORMULA_LOGN] = "log",
+	[FORMULA_LOGD] = "log10",
+	[FORMULA_LOGB] = "log2",
+	[FORMULA_ABS] = "fabs",
+	[FORMULA_SIN] = "sin",
+	[FORMULA_COS] = "cos",
+	[FORMULA_TAN] = "tan",
+	[FORMULA_ASIN] = "asin",
+	[FORMULA_ACOS] = "acos",
+	[FORMULA_ATAN] = "atan",
+	[FORMULA_SINH] = "sinh",
+	[FORMULA_COSH] = "cosh",
+	[FORMULA_TANH] = "tanh",
+	[FORMULA_ASINH] = "asinh",
+	[FORMULA_ACOSH] = "acosh",
+	[FORMULA_ATANH] = "atanh",
+	[FORMULA_CEIL] = "ceil",
+	[FORMULA_FLOOR] = "floor",
+	[FORMULA_ROUND] = "round",
+};
+//Infix operator for each binary operation, the rest are libm calls
+static const char *const _operators[FORMULA_OP_COUNT] = {
+	[FORMULA_ADD] = "+",
+	[FORMULA_SUBTRACT] = "-",
+	[FORMULA_MULTIPLY] = "*",
+	[FORMULA_DIVIDE] = "/",
+};
+
+
+
+static uint64_t Fnv1a(uint64_t hash, const void *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= ((const uint8_t *)data)[i];
+		hash *= 0x100000001B3ul;
+	}
+	return hash;
+}
+static uint64_t Fnv1aString(uint64_t hash, const char *str)
+{
+	//Includes the terminator so concatenations can not collide
+	return Fnv1a(hash, str, strlen(str) + 1);
+}
+
+static const char *GetCompiler()
+{
+	const char *cc = getenv("CC");
+	return cc && *cc ? cc : "cc";
+}
+
+//Hashes what the compiler prints for --version, so upgrades or a different $CC rebuild
+static uint64_t HashCompilerVersion(uint64_t hash, const char *cc)
+{
+	char buffer[256];
+	int fds[2], status;
+	ssize_t size;
+
+	if (pipe(fds)) return hash;
+
+	pid_t pid = fork();
+	if (pid == -1)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return hash;
+	}
+	if (!pid)
+	{
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execlp(cc, cc, "--version", (char *)NULL);
+		_exit(127);
+	}
+
+	close(fds[1]);
+	while ((size = read(fds[0], buffer, sizeof(buffer))) > 0 || (size == -1 && errno == EINTR))
+		if (size > 0) hash = Fnv1a(hash, buffer, size);
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+
+	return hash;
+}
+
+//-march=native builds for the host, so objects from another CPU in a shared cache must not match.
+//Hashes the vendor, brand and feature words but not leaf 1 EBX, which holds the core's APIC ID
+static uint64_t HashCpu(uint64_t hash)
+{
+#ifdef AOT_X86
+	unsigned int regs[4], words[12];
+
+	if (__get_cpuid(0, &regs[0], &regs[1], &regs[2], &regs[3])) hash = Fnv1a(hash, regs, sizeof(regs));
+	if (__get_cpuid(1, &regs[0], &regs[1], &regs[2], &regs[3]))
+	{
+		regs[1] = 0;
+		hash = Fnv1a(hash, regs, sizeof(regs));
+	}
+	if (__get_cpuid_count(7, 0, &regs[0], &regs[1], &regs[2], &regs[3])) hash = Fnv1a(hash, regs, sizeof(regs));
+	if (__get_cpuid(0x80000001, &regs[0], &regs[1], &regs[2], &regs[3])) hash = Fnv1a(hash, regs, sizeof(regs));
+	for (unsigned int i = 0; i < 3; i++)
+		if (__get_cpuid(0x80000002 + i, &words[i * 4], &words[i * 4 + 1], &words[i * 4 + 2], &words[i * 4 + 3]))
+			hash = Fnv1a(hash, &words[i * 4], 4 * sizeof(words[0]));
+#elif defined(__linux__)
+	unsigned long caps[2] = { getauxval(AT_HWCAP), getauxval(AT_HWCAP2) };
+	hash = Fnv1a(hash, caps, sizeof(caps));
+#endif
+
+	return hash;
+}
+
+static pthread_once_t _toolchainOnce = PTHREAD_ONCE_INIT;
+static uint64_t _toolchainHash;
+
+//Compiler, its version and the host CPU only change between runs, so they are hashed once
+static void HashToolchain()
+{
+	const char *cc = GetCompiler();
+	uint64_t hash = 0xCBF29CE484222325ul;
+
+	hash = Fnv1aString(hash, cc);
+	hash = HashCompilerVersion(hash, cc);
+	_toolchainHash = HashCpu(hash);
+}
+
+//Cache key: formula text, generator version, compiler, compiler flags, host CPU and the instruction set in use
+static uint64_t GetCacheKey(const char *source)
+{
+	int version = AOT_FORMAT_VERSION;
+	uint64_t hash = 0xCBF29CE484222325ul;
+
+	pthread_once(&_toolchainOnce, HashToolchain);
+
+	hash = Fnv1a(hash, &version, sizeof(version));
+	hash = Fnv1aString(hash, source);
+	hash = Fnv1a(hash, &_toolchainHash, sizeof(_toolchainHash));
+	for (size_t i = 0; i < COMPILER_FLAG_COUNT; i++) hash = Fnv1aString(hash, _compilerFlags[i]);
+	hash = Fnv1aString(hash, GetFormulaKernels()->name);
+
+	return hash;
+}
+
+static bool MakeDirectory(const char *path)
+{
+	return !mkdir(path, 0755) || errno == EEXIST;
+}
+static bool GetCacheDirectory(char *path)
+{
+	const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+
+	if (xdg && *xdg)
+	{
+		if (snprintf(path, AOT_PATH, "%s/dfv", xdg) >= AOT_PATH) return false;
+		return MakeDirectory(xdg) && MakeDirectory(path);
+	}
+	if (!home || !*home) return false;
+
+	if (snprintf(path, AOT_PATH, "%s/.cache", home) >= AOT_PATH) return false;
+	if (!MakeDirectory(path)) return false;
+	strcat(path, "/dfv");
+	return MakeDirectory(path);
+}
+
+
+
+static void WriteValue(FILE *file, double value)
+{
+	if (isnan(value)) fprintf(file, "NAN");
+	else if (isinf(value)) fprintf(file, value > 0 ? "INFINITY" : "-INFINITY");
+	else fprintf(file, "%a", value);
+}
+static void WriteOperand(FILE *file, const Formula *formula, uint8_t instruction, uint8_t operand)
+{
+	if (instruction < FORMULA_ADD_VAR) WriteValue(file, formula->constants[operand]);
+	else fprintf(file, "r[%d][i]", operand);
+}
+
+//One statement per instruction, buffers become locals and the compiler allocates them
+static bool WriteSource(const char *path, const Formula *formula)
+{
+	const uint8_t *src = formula->code;
+	int srcHead = 0, bufferHead = 0;
+	uint8_t instruction;
+	FILE *file = fopen(path, "w");
+
+	if (!file) return false;
+
+	fprintf(file, "#include <math.h>\n\n");
+	fprintf(file, "void %s(const double *const *r, int count, double *ret)\n{\n", AOT_SYMBOL);
+	fprintf(file, "\tfor (int i = 0; i < count; i++)\n\t{\n");
+	fprintf(file, "\t\tdouble clip = 0.0");
+	for (int i = 0; i < formula->maxDepth; i++) fprintf(file, ", b%d = 0.0", i);
+	fprintf(file, ";\n\n");
+
+	while ((instruction = src[srcHead++]) != FORMULA_RET)
+	{
+		int a = bufferHead, b = bufferHead - 1;
+
+		if (FORMULA_IS_VAR(instruction))
+		{
+			fprintf(file, "\t\tb%d = r[%d][i];\n", a, instruction - FORMULA_VAR_BASE);
+			continue;
+		}
+
+		if (FORMULA_IS_FUSED(instruction))
+		{
+			fprintf(file, "\t\tb%d = ", a);
+			WriteOperand(file, formula, instruction, src[srcHead++]);
+			fprintf(file, ";\n");
+			instruction = FORMULA_FUSED_BASE(instruction);
+		}
+
+		if (_operators[instruction])
+		{
+			fprintf(file, "\t\tb%d = b%d %s b%d;\n", a, b, _operators[instruction], a);
+			continue;
+		}
+		if (_functions[instruction])
+		{
+			fprintf(file, "\t\tb%d = %s(b%d);\n", a, _functions[instruction], a);
+			continue;
+		}
+
+		switch (instruction)
+		{
+			case FORMULA_CONSTANT:
+			case FORMULA_LITERAL:
+				fprintf(file, "\t\tb%d = ", a);
+				WriteOperand(file, formula, FORMULA_ADD_LITERAL, src[srcHead++]);
+				fprintf(file, ";\n");
+				break;
+
+			case FORMULA_CLIP_WRITE:
+				fprintf(file, "\t\tclip = b%d;\n", a);
+				break;
+
+			case FORMULA_CLIP_READ:
+				fprintf(file, "\t\tb%d = clip;\n", a);
+				break;
+
+			case FORMULA_SEEK_LEFT:
+				bufferHead--;
+				break;
+
+			case FORMULA_SEEK_RIGHT:
+				bufferHead++;
+				break;
+
+			case FORMULA_COPY_LEFT:
+				bufferHead--;
+				fprintf(file, "\t\tb%d = b%d;\n", bufferHead, a);
+				break;
+
+			case FORMULA_COPY_RIGHT:
+				bufferHead++;
+				fprintf(file, "\t\tb%d = b%d;\n", bufferHead, a);
+				break;
+
+			case FORMULA_REMAINDER:
+				fprintf(file, "\t\tb%d = fmod(b%d, b%d);\n", a, b, a);
+				break;
+
+			case FORMULA_POW:
+				fprintf(file, "\t\tb%d = pow(b%d, b%d);\n", a, b, a);
+				break;
+
+			case FORMULA_SQUARE:
+				fprintf(file, "\t\tb%d *= b%d;\n", a, a);
+				break;
+
+			case FORMULA_SIGN:
+				fprintf(file, "\t\tb%d = b%d == 0.0 ? 0.0 : (b%d > 0.0 ? 1.0 : -1.0);\n", a, a, a);
+				break;
+
+			case FORMULA_NEGATIVE:
+				fprintf(file, "\t\tb%d = -b%d;\n", a, a);
+				break;
+		}
+	}
+
+	fprintf(file, "\n\t\tret[i] = b%d;\n\t}\n}\n", bufferHead);
+
+	return !fclose(file);
+}
+
+static bool RunCompiler(const char *srcPath, const char *outPath)
+{
+	const char *cc = GetCompiler(), *argv[COMPILER_FLAG_COUNT + 7];
+	int argc = 0, status;
+
+	argv[argc++] = cc;
+	for (size_t i = 0; i < COMPILER_FLAG_COUNT; i++) argv[argc++] = _compilerFlags[i];
+	argv[argc++] = "-o";
+	argv[argc++] = outPath;
+	argv[argc++] = srcPath;
+	argv[argc++] = "-lm";
+	argv[argc] = NULL;
+
+	pid_t pid = fork();
+	if (pid == -1) return false;
+	if (!pid)
+	{
+		execvp(cc, (char *const *)argv);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) == -1) return false;
+	return WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+static bool Load(const char *path, FormulaAot *aot)
+{
+	aot->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!aot->handle) return false;
+
+	aot->run = (AotFunction)dlsym(aot->handle, AOT_SYMBOL);
+	if (!aot->run)
+	{
+		dlclose(aot->handle);
+		aot->handle = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+
+
+bool CompileFormulaAot(const char *source, const Formula *formula, FormulaAot *aot)
+{
+	char dir[AOT_PATH], srcPath[AOT_PATH], outPath[AOT_PATH], tmpPath[AOT_PATH];
+	uint64_t key = GetCacheKey(source);
+
+	aot->run = NULL;
+	aot->handle = NULL;
+	aot->cached = false;
+
+	if (!formula->verified || !GetCacheDirectory(dir)) return false;
+
+	if (snprintf(srcPath, AOT_PATH, "%s/%016lx.%d.c", dir, key, (int)getpid()) >= AOT_PATH ||
+		snprintf(outPath, AOT_PATH, "%s/%016lx.so", dir, key) >= AOT_PATH ||
+		snprintf(tmpPath, AOT_PATH, "%s/%016lx.%d.so", dir, key, (int)getpid()) >= AOT_PATH)
+		return false;
+
+	if (!access(outPath, R_OK) && Load(outPath, aot))
+	{
+		aot->cached = true;
+		return true;
+	}
+
+	//Built under private names and renamed, so concurrent runs never load a partial file
+	bool built = WriteSource(srcPath, formula) && RunCompiler(srcPath, tmpPath);
+	unlink(srcPath);
+	if (!built || rename(tmpPath, outPath))
+	{
+		unlink(tmpPath);
+		return false;
+	}
+
+	return Load(outPath, aot);
+}
+
+bool EvaluateFormulaAot(const FormulaAot *aot, const double *const *registers, int count, double *ret, bool *valid)
+{
+	if (!aot->run)
+	{
+		memset(valid, 0, count * sizeof(bool));
+		return false;
+	}
+
+	aot->run(registers, count, ret);
+	for (int i = 0; i < count; i++) valid[i] = isfinite(ret[i]);
+
+	return true;
+}
+
+void FreeFormulaAot(FormulaAot *aot)
+{
+	if (aot->handle) dlclose(aot->handle);
+	aot->run = NULL;
+	aot->handle = NULL;
+}
@@ -0,0 +1,31 @@
+//aot.h - Formulas built into native shared objects by the system C compiler
+
+#ifndef AOT_H
+#define AOT_H
+
+#include "formulas.h"
+
+//Bump whenever the generated source changes, so stale cache entries are not loaded
+#define AOT_FORMAT_VERSION 1
+#define AOT_SYMBOL "dfv_formula"
+
+typedef void (*AotFunction)(const double *const *registers, int count, double *ret);
+
+typedef struct
+{
+	AotFunction run;
+	void *handle;
+	bool cached; //Loaded from the cache without invoking the compiler
+} FormulaAot;
+
+
+//Loads the shared object for source from the cache, building it first if needed.
+//The cache lives in $XDG_CACHE_HOME/dfv (or ~/.cache/dfv), the compiler is $CC or cc
+bool CompileFormulaAot(const char *source, const Formula *formula, FormulaAot *aot);
+
+//Same contract as EvaluateFormulaBatch
+bool EvaluateFormulaAot(const FormulaAot *aot, const double *const *registers, int count, double *ret, bool *valid);
+
+void FreeFormulaAot(FormulaAot *aot);
+
+#endif
@@ -0,0 +1,106 @@
+//coverage.c -
+
+#include <stdlib.h>
+
+#include "coverage.h"
+#include "raster.h"
+
+
+
+typedef struct
+{
+	Coverage *coverage;
+	uint8_t layer;
+} CoverTarget;
+
+static void Cover(Coverage *coverage, int x, int y, uint8_t layer, uint8_t alpha)
+{
+	if (x < 0 || y < 0 || x >= coverage->width || y >= coverage->height) return;
+
+	//Atomic max, so the result does not depend on which thread got there first
+	uint16_t *cell = &coverage->layers[(size_t)y * coverage->width + x];
+	uint16_t value = alpha << 8 | layer;
+	uint16_t seen = __atomic_load_n(cell, __ATOMIC_RELAXED);
+	while (seen < value && !__atomic_compare_exchange_n(cell, &seen, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void CoverPixel(void *context, int x, int y, uint8_t alpha)
+{
+	CoverTarget *target = context;
+	Cover(target->coverage, x, y, target->layer, alpha);
+}
+
+
+
+bool InitCoverage(Coverage *coverage, int width, int height)
+{
+	coverage->layers = calloc((size_t)width * height, sizeof(uint16_t));
+	coverage->width = width;
+	coverage->height = height;
+
+	return coverage->layers != NULL;
+}
+
+void FreeCoverage(Coverage *coverage)
+{
+	free(coverage->layers);
+	coverage->layers = NULL;
+}
+
+void CoverLine(Coverage *coverage, int startX, int startY, int endX, int endY, uint8_t layer)
+{
+	//Same Bresenham walk as raylib, stepping along the major axis from its lower end
+	int changeX = endX - startX, changeY = endY - startY;
+	int absX = changeX < 0 ? -changeX : changeX, absY = changeY < 0 ? -changeY : changeY;
+	bool alongX = absY < absX;
+	int major = alongX ? absX : absY, minor = alongX ? absY : absX;
+	int startU, startV, endU, stepV;
+	int a = 2 * minor, b = a - 2 * major, p = a - major;
+
+	if ((alongX ? changeX : changeY) > 0)
+	{
+		startU = alongX ? startX : startY;
+		startV = alongX ? startY : startX;
+		endU = alongX ? endX : endY;
+	}
+	else
+	{
+		startU = alongX ? endX : endY;
+		startV = alongX ? endY : endX;
+		endU = alongX ? startX : startY;
+		changeX = -changeX;
+		changeY = -changeY;
+	}
+	stepV = (alongX ? changeY : changeX) < 0 ? -1 : 1;
+
+	for (int u = startU, v = startV; u <= endU; u++)
+	{
+		if (u != startU)
+		{
+			if (p >= 0) { v += stepV; p += b; }
+			else p += a;
+		}
+
+		if (alongX) Cover(coverage, u, v, layer, 255);
+		else Cover(coverage, v, u, layer, 255);
+	}
+}
+
+void CoverSmoothLine(Coverage *coverage, double startX, double startY, double endX, double endY, uint8_t layer)
+{
+	CoverTarget target = { coverage, layer };
+	WalkSmoothLine(startX, startY, endX, endY, coverage->width, coverage->height, CoverPixel, &target);
+}
+
+void CompositeCoverage(const Coverage *coverage, Image *img, const Color *colors)
+{
+	for (int y = 0; y < coverage->height; y++)
+		for (int x = 0; x < coverage->width; x++)
+		{
+			uint16_t value = coverage->layers[(size_t)y * coverage->width + x];
+			uint8_t layer = value & 0xFF, alpha = value >> 8;
+
+			if (alpha == 255) ImageDrawPixel(img, x, y, colors[layer - 1]);
+			else if (alpha) BlendPixel(img, x, y, colors[layer - 1], alpha);
+		}
+}
@@ -0,0 +1,33 @@
+//coverage.h - Pixel layers that several threads can draw lines into at once
+
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "raylib.h"
+
+//Strongest coverage at each pixel in the high byte, the highest layer drawn with it in the low one,
+//0 where nothing was. Later layers paint over earlier ones that cover the pixel as much
+typedef struct
+{
+	uint16_t *layers;
+	int width, height;
+} Coverage;
+
+
+bool InitCoverage(Coverage *coverage, int width, int height);
+void FreeCoverage(Coverage *coverage);
+
+//Marks the pixels ImageDrawLine would set. Safe to call from several threads
+void CoverLine(Coverage *coverage, int startX, int startY, int endX, int endY, uint8_t layer);
+
+//Marks the pixels of an anti-aliased line between sub-pixel endpoints, with how much it covers each.
+//Safe to call from several threads
+void CoverSmoothLine(Coverage *coverage, double startX, double startY, double endX, double endY, uint8_t layer);
+
+//Paints every covered pixel with colors[layer - 1], blended by its coverage
+void CompositeCoverage(const Coverage *coverage, Image *img, const Color *colors);
+
+#endif
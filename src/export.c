@@ -0,0 +1,158 @@
+//export.c -
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "export.h"
+
+//Compressed bytes gathered before they go out as one IDAT chunk
+#define STREAM_CHUNK (1 << 16)
+
+
+
+static void PutUint32(uint8_t *dst, uint32_t value)
+{
+	dst[0] = value >> 24;
+	dst[1] = value >> 16;
+	dst[2] = value >> 8;
+	dst[3] = value;
+}
+
+static bool WriteChunk(FILE *file, const char *type, const uint8_t *data, uint32_t length)
+{
+	uint8_t header[8], footer[4];
+	PutUint32(header, length);
+	memcpy(header + 4, type, 4);
+
+	//The CRC covers the type and the data, not the length
+	uLong crc = crc32(0, header + 4, 4);
+	if (length) crc = crc32(crc, data, length);
+	PutUint32(footer, crc);
+
+	return fwrite(header, sizeof(header), 1, file) == 1 && (!length || fwrite(data, length, 1, file) == 1) &&
+		fwrite(footer, sizeof(footer), 1, file) == 1;
+}
+
+//Compresses all pending input, writing out the chunk buffer whenever it fills and, when finishing, what is left
+static bool Deflate(ImageStream *stream, bool finish)
+{
+	z_stream *deflater = &stream->deflate;
+
+	while (true)
+	{
+		int result = deflate(deflater, finish ? Z_FINISH : Z_NO_FLUSH);
+		if (result == Z_STREAM_ERROR) return false;
+
+		bool done = finish ? result == Z_STREAM_END : !deflater->avail_in;
+		uint32_t length = STREAM_CHUNK - deflater->avail_out;
+		if (!deflater->avail_out || (finish && done && length))
+		{
+			if (!WriteChunk(stream->file, "IDAT", stream->chunk, length)) return false;
+			deflater->next_out = stream->chunk;
+			deflater->avail_out = STREAM_CHUNK;
+		}
+
+		if (done) return true;
+	}
+}
+
+
+
+bool OpenImageStream(ImageStream *stream, const char *path, int width, int height)
+{
+	const char *extension = strrchr(path, '.');
+
+	memset(stream, 0, sizeof(ImageStream));
+	if (extension && !strcasecmp(extension, ".png")) stream->format = STREAM_PNG;
+	else if (extension && !strcasecmp(extension, ".ppm")) stream->format = STREAM_PPM;
+	else return false;
+
+	stream->width = width;
+	stream->height = stream->rowsLeft = height;
+	stream->row = malloc(1 + (size_t)width * 3);
+	stream->file = fopen(path, "wb");
+	if (!stream->row || !stream->file)
+	{
+		CloseImageStream(stream);
+		return false;
+	}
+
+	if (stream->format == STREAM_PPM)
+		return fprintf(stream->file, "P6\n%d %d\n255\n", width, height) > 0;
+
+	//8 bit RGB, not interlaced
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	uint8_t header[13] = { [8] = 8, [9] = 2 };
+	PutUint32(header, width);
+	PutUint32(header + 4, height);
+
+	stream->chunk = malloc(STREAM_CHUNK);
+	if (!stream->chunk || deflateInit(&stream->deflate, Z_DEFAULT_COMPRESSION) != Z_OK)
+	{
+		CloseImageStream(stream);
+		return false;
+	}
+	stream->deflate.next_out = stream->chunk;
+	stream->deflate.avail_out = STREAM_CHUNK;
+
+	return fwrite(signature, sizeof(signature), 1, stream->file) == 1 && WriteChunk(stream->file, "IHDR", header, sizeof(header));
+}
+
+bool WriteImageRows(ImageStream *stream, const Color *pixels, int rowC)
+{
+	if (rowC > stream->rowsLeft)
+		return false;
+
+	size_t rowSize = (size_t)stream->width * 3;
+	for (int i = 0; i < rowC; i++)
+	{
+		const Color *src = pixels + (size_t)i * stream->width;
+
+		if (stream->format == STREAM_PPM)
+		{
+			for (int x = 0; x < stream->width; x++)
+			{
+				stream->row[3 * x] = src[x].r;
+				stream->row[3 * x + 1] = src[x].g;
+				stream->row[3 * x + 2] = src[x].b;
+			}
+			if (fwrite(stream->row, rowSize, 1, stream->file) != 1) return false;
+			continue;
+		}
+
+		//Sub filter, every byte minus the one a pixel to its left. The black background becomes runs of zeros
+		stream->row[0] = 1;
+		for (int x = 0; x < stream->width; x++)
+		{
+			Color left = x ? src[x - 1] : (Color){ 0 };
+			stream->row[1 + 3 * x] = src[x].r - left.r;
+			stream->row[2 + 3 * x] = src[x].g - left.g;
+			stream->row[3 + 3 * x] = src[x].b - left.b;
+		}
+
+		stream->deflate.next_in = stream->row;
+		stream->deflate.avail_in = 1 + rowSize;
+		if (!Deflate(stream, false)) return false;
+	}
+
+	stream->rowsLeft -= rowC;
+	return true;
+}
+
+bool CloseImageStream(ImageStream *stream)
+{
+	bool ok = stream->file && !stream->rowsLeft;
+
+	if (ok && stream->format == STREAM_PNG)
+		ok = Deflate(stream, true) && WriteChunk(stream->file, "IEND", NULL, 0);
+
+	//Safe on a deflater that was never initialized
+	deflateEnd(&stream->deflate);
+	if (stream->file && fclose(stream->file)) ok = false;
+	free(stream->row);
+	free(stream->chunk);
+	memset(stream, 0, sizeof(ImageStream));
+
+	return ok;
+}
@@ -0,0 +1,37 @@
+//export.h - Images written a band of rows at a time, so they never have to fit in memory whole
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <zlib.h>
+
+#include "raylib.h"
+
+#define STREAM_PNG 0
+#define STREAM_PPM 1
+
+//Rows are written top to bottom as RGB, alpha is dropped
+typedef struct
+{
+	FILE *file;
+	int format;
+	int width, height, rowsLeft;
+	uint8_t *row;		//One filtered row, and for PNG the compressed bytes waiting for their chunk
+	uint8_t *chunk;
+	z_stream deflate;
+} ImageStream;
+
+
+//Picks PNG or PPM from the extension of path. Fails for any other extension
+bool OpenImageStream(ImageStream *stream, const char *path, int width, int height);
+
+//Appends rowC rows of stream->width pixels each
+bool WriteImageRows(ImageStream *stream, const Color *pixels, int rowC);
+
+//Finishes the file, fails if it is short of rows or could not be written. Frees the stream either way
+bool CloseImageStream(ImageStream *stream);
+
+#endif
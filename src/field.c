@@ -0,0 +1,144 @@
+//field.c -
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "field.h"
+#include "threads.h"
+
+
+
+//Column i of nodes and, when there is one, column i of cell midpoints
+typedef struct
+{
+	FieldGrid *grid;
+	FieldColumn column;
+	double *ys, *midYs;
+	double *mids;
+	bool ok;
+} FieldFill;
+
+static void FillColumn(void *context, int index)
+{
+	FieldFill *fill = context;
+	FieldGrid *grid = fill->grid;
+	int rowC = grid->rowC;
+	double t = grid->t0 + index * grid->step;
+	double *nodes = grid->nodes + (size_t)index * (rowC + 1);
+	double *mids = fill->mids + (size_t)index * rowC;
+	bool *valid = malloc((rowC + 1) * sizeof(bool));
+
+	if (!valid)
+	{
+		__atomic_store_n(&fill->ok, false, __ATOMIC_RELAXED);
+		return;
+	}
+
+	fill->column(t, fill->ys, rowC + 1, nodes, valid);
+	for (int j = 0; j <= rowC; j++)
+		if (!valid[j]) nodes[j] = NAN;
+
+	if (index < grid->columnC)
+	{
+		fill->column(t + grid->step / 2, fill->midYs, rowC, mids, valid);
+		for (int j = 0; j < rowC; j++)
+			if (!valid[j]) mids[j] = NAN;
+	}
+
+	free(valid);
+}
+
+
+
+bool InitFieldGrid(FieldGrid *grid, double t0, double y0, double step, int columnC, int rowC)
+{
+	grid->nodes = malloc((size_t)(columnC + 1) * (rowC + 1) * sizeof(double));
+	grid->exact = malloc((size_t)columnC * rowC * sizeof(uint8_t));
+	grid->t0 = t0;
+	grid->y0 = y0;
+	grid->step = step;
+	grid->columnC = columnC;
+	grid->rowC = rowC;
+	grid->exactC = columnC * rowC;
+
+	if (!grid->nodes || !grid->exact)
+	{
+		FreeFieldGrid(grid);
+		return false;
+	}
+
+	//Nothing is trusted until filled
+	for (size_t i = 0; i < (size_t)columnC * rowC; i++) grid->exact[i] = 1;
+	return true;
+}
+
+void FreeFieldGrid(FieldGrid *grid)
+{
+	free(grid->nodes);
+	free(grid->exact);
+	grid->nodes = NULL;
+	grid->exact = NULL;
+}
+
+long FillFieldGrid(FieldGrid *grid, FieldColumn column, double tolerance)
+{
+	int columnC = grid->columnC, rowC = grid->rowC;
+	FieldFill fill = {
+		.grid = grid, .column = column,
+		.ys = malloc((rowC + 1) * sizeof(double)), .midYs = malloc(rowC * sizeof(double)),
+		.mids = malloc((size_t)columnC * rowC * sizeof(double)), .ok = true
+	};
+
+	if (fill.ys && fill.midYs && fill.mids)
+	{
+		for (int j = 0; j <= rowC; j++) fill.ys[j] = grid->y0 + j * grid->step;
+		for (int j = 0; j < rowC; j++) fill.midYs[j] = grid->y0 + (j + 0.5) * grid->step;
+
+		RunParallel(columnC + 1, FillColumn, &fill);
+	}
+	else fill.ok = false;
+
+	//The midpoint is where bilinear interpolation is furthest from its corners, so it bounds the error.
+	//Compared as directions, so steep slopes are as loose as the angle they are drawn at
+	grid->exactC = 0;
+	for (int i = 0; i < columnC; i++)
+	{
+		const double *left = grid->nodes + (size_t)i * (rowC + 1), *right = left + rowC + 1;
+		const double *mids = fill.mids + (size_t)i * rowC;
+
+		for (int j = 0; j < rowC; j++)
+		{
+			double interpolated = (left[j] + left[j + 1] + right[j] + right[j + 1]) / 4;
+			//NaN corners or midpoints fail the comparison too
+			bool trusted = fill.ok && fabs(interpolated - mids[j]) <= tolerance * (1 + mids[j] * mids[j]);
+
+			grid->exact[(size_t)i * rowC + j] = !trusted;
+			grid->exactC += !trusted;
+		}
+	}
+
+	free(fill.ys); free(fill.midYs); free(fill.mids);
+
+	return fill.ok ? (long)(columnC + 1) * (rowC + 1) + (long)columnC * rowC : 0;
+}
+
+bool SampleFieldGrid(const FieldGrid *grid, double t, double y, double *ret, double *dret)
+{
+	double u = (t - grid->t0) / grid->step, v = (y - grid->y0) / grid->step;
+
+	//Also rejects NaN
+	if (!(u >= 0 && v >= 0 && u < grid->columnC && v < grid->rowC))
+		return false;
+
+	int i = (int)u, j = (int)v;
+	if (grid->exact[(size_t)i * grid->rowC + j])
+		return false;
+
+	const double *left = grid->nodes + (size_t)i * (grid->rowC + 1) + j, *right = left + grid->rowC + 1;
+	double fu = u - i, fv = v - j;
+	double bottom = left[0] + fu * (right[0] - left[0]), top = left[1] + fu * (right[1] - left[1]);
+
+	*ret = bottom + fv * (top - bottom);
+	if (dret) *dret = (top - bottom) / grid->step;
+	return true;
+}
@@ -0,0 +1,36 @@
+//field.h - Slopes evaluated once on a grid and interpolated in between
+
+#ifndef FIELD_H
+#define FIELD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//Evaluates count slopes that share t, same contract as EvaluateFormulaBatch
+typedef bool (*FieldColumn)(double t, const double *y, int count, double *ret, bool *valid);
+
+//Node (i, j) sits at (t0 + i * step, y0 + j * step), there is one node more than cells each way.
+//Cells interpolation cannot be trusted in are marked exact and never sampled
+typedef struct
+{
+	double *nodes;		//Column major, NaN where the formula is undefined
+	uint8_t *exact;
+	double t0, y0, step;
+	int columnC, rowC;
+	int exactC;
+} FieldGrid;
+
+
+bool InitFieldGrid(FieldGrid *grid, double t0, double y0, double step, int columnC, int rowC);
+void FreeFieldGrid(FieldGrid *grid);
+
+//Evaluates every node and cell midpoint, columns in parallel. A cell is exact when a corner is
+//undefined or the direction at its midpoint is further than about tolerance radians from the
+//interpolated one. Returns points evaluated
+long FillFieldGrid(FieldGrid *grid, FieldColumn column, double tolerance);
+
+//Bilinear slope at (t, y), and its y derivative when dret is not NULL.
+//False outside the grid and in exact cells
+bool SampleFieldGrid(const FieldGrid *grid, double t, double y, double *ret, double *dret);
+
+#endif
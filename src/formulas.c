@@ -1,25 +1,36 @@
 //formulas.c - 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <ctype.h>
 #include <string.h>
 
 #include "formulas.h"
+#include "kernels.h"
 
 
 
-static bool GetFunctionCode(const char *name, uint64_t *store, int srcHead);
+static bool Store(Formula *formula, uint8_t byte, int srcHead);
+static bool StoreConstant(Formula *formula, uint8_t instruction, double value, int srcHead);
+static bool GetFunctionCode(const char *name, uint8_t *store, int srcHead);
+static void EvaluateChunk(const Formula *formula, const double *const *registers, int offset, int n, double *ret, bool *valid);
+static void TangentUnary(uint8_t instruction, const double *a, double *da, int n);
+static void TangentBinary(uint8_t instruction, const double *a, double *da, const double *b, const double *db, int n);
+static void EvaluateChunkDual(const Formula *formula, const double *const *registers, int slot, int offset, int n, double *ret, double *dret, bool *valid);
 
 
 
-bool CompileFormula(const char *src, uint64_t *store)
+bool CompileFormula(const char *src, Formula *formula)
 {
-	double literalNum = 0;
+	double literalNum = 0, constant;
 	char funcName[MAX_FUNCTION_NAME + 1], ch;
-	int srcHead = 0, funcHead = 0, storeHead = 0, decimalCounter = -1;
+	uint8_t op;
+	int srcHead = 0, funcHead = 0, decimalCounter = -1;
 	bool lastWasLiteral = false, lastWasConstant = false, lastWasFunc = false;
 
+	ResetFormula(formula);
+
 	while ((ch = src[srcHead++]))
 	{
 		iter:
@@ -31,16 +42,15 @@ bool CompileFormula(const char *src, uint64_t *store)
 		if (lastWasConstant)
 		{
 			lastWasConstant = false;
-			store[storeHead++] = FORMULA_CONSTANT;
 
 			switch (ch) //constant code
 			{
 				case 'e':
-					((double *)store)[storeHead++] = M_E;
+					constant = M_E;
 					break;
 
 				case 'p':
-					((double *)store)[storeHead++] = M_PI;
+					constant = M_PI;
 					break;
 
 				default:
@@ -48,6 +58,7 @@ bool CompileFormula(const char *src, uint64_t *store)
 					return false;
 			}
 
+			if (!StoreConstant(formula, FORMULA_CONSTANT, constant, srcHead)) return false;
 			continue;
 		}
 	
@@ -71,11 +82,12 @@ bool CompileFormula(const char *src, uint64_t *store)
 			funcHead = 0;
 
 			//Set function code
-			if (!GetFunctionCode(funcName, &store[storeHead++], srcHead))
+			if (!GetFunctionCode(funcName, &op, srcHead))
 			{
 				fprintf(stderr, "Invalid function name '%s' at character %d.\n", funcName, srcHead);
 				return false;
 			}
+			if (!Store(formula, op, srcHead)) return false;
 		}
 	
 		//Literals
@@ -98,8 +110,7 @@ bool CompileFormula(const char *src, uint64_t *store)
 			{
 				if (decimalCounter != -1) while(decimalCounter--) literalNum /= 10.0;
 
-				store[storeHead++] = FORMULA_LITERAL;
-				((double *)store)[storeHead++] = literalNum;
+				if (!StoreConstant(formula, FORMULA_LITERAL, literalNum, srcHead)) return false;
 				lastWasLiteral = false;
 				decimalCounter = -1;
 			}
@@ -109,7 +120,15 @@ bool CompileFormula(const char *src, uint64_t *store)
 		if (isalpha(ch))
 		{
 			if (islower(ch))
-				store[storeHead++] = FORMULA_VAR_BASE + ch - 'a';
+			{
+				int slot = GetFormulaSlot(formula, ch);
+				if (slot == -1)
+				{
+					slot = formula->slotC++;
+					formula->slots[slot] = ch;
+				}
+				if (!Store(formula, FORMULA_VAR_BASE + slot, srcHead)) return false;
+			}
 			else
 			{
 				fprintf(stderr, "Variables must be lower case. Invalid variable '%c' at character %d.\n", ch, srcHead);
@@ -127,144 +146,297 @@ bool CompileFormula(const char *src, uint64_t *store)
 
 			case '_':
 				lastWasConstant = true;
-				break;
+				continue;
 
 			case '=':
 				lastWasFunc = true;
-				break;
+				continue;
 
 			case ',':
-				store[storeHead++] = FORMULA_CLIP_WRITE;
+				op = FORMULA_CLIP_WRITE;
 				break;
 
 			case ';':
-				store[storeHead++] = FORMULA_CLIP_READ;
+				op = FORMULA_CLIP_READ;
 				break;
 
 			case '<':
-				store[storeHead++] = FORMULA_SEEK_LEFT;
+				op = FORMULA_SEEK_LEFT;
 				break;
 
 			case '>':
-				store[storeHead++] = FORMULA_SEEK_RIGHT;
+				op = FORMULA_SEEK_RIGHT;
 				break;
 
 			case '[':
-				store[storeHead++] = FORMULA_COPY_LEFT;
+				op = FORMULA_COPY_LEFT;
 				break;
 
 			case ']':
-				store[storeHead++] = FORMULA_COPY_RIGHT;
+				op = FORMULA_COPY_RIGHT;
 				break;
 
 			case '+':
-				store[storeHead++] = FORMULA_ADD;
+				op = FORMULA_ADD;
 				break;
 
 			case '-':
-				store[storeHead++] = FORMULA_SUBTRACT;
+				op = FORMULA_SUBTRACT;
 				break;
 
 			case '*':
-				store[storeHead++] = FORMULA_MULTIPLY;
+				op = FORMULA_MULTIPLY;
 				break;
 
 			case '/':
-				store[storeHead++] = FORMULA_DIVIDE;
+				op = FORMULA_DIVIDE;
 				break;
 
 			case '%':
-				store[storeHead++] = FORMULA_REMAINDER;
+				op = FORMULA_REMAINDER;
 				break;
 
 			case '^':
-				store[storeHead++] = FORMULA_POW;
+				op = FORMULA_POW;
 				break;
 
 			case '{':
-				store[storeHead++] = FORMULA_SQRT;
+				op = FORMULA_SQRT;
 				break;
 
 			case '}':
-				store[storeHead++] = FORMULA_SQUARE;
+				op = FORMULA_SQUARE;
 				break;
 
 			case '$':
-				store[storeHead++] = FORMULA_LOGN;
+				op = FORMULA_LOGN;
 				break;
 
 			case '#':
-				store[storeHead++] = FORMULA_ABS;
+				op = FORMULA_ABS;
 				break;
 
 			case '(':
-				store[storeHead++] = FORMULA_SIN;
+				op = FORMULA_SIN;
 				break;
 
 			case ')':
-				store[storeHead++] = FORMULA_COS;
+				op = FORMULA_COS;
 				break;
 
 			case '\\':
-				store[storeHead++] = FORMULA_TAN;
+				op = FORMULA_TAN;
 				break;
 
 			case '~':
-				store[storeHead++] = FORMULA_NEGATIVE;
+				op = FORMULA_NEGATIVE;
 				break;
 
+			case '\0': //End of source, see below
+				continue;
+
 			default:
 				printf("Invalid operation: '%c'.\n", ch);
 				return false;
 		}
+
+		if (!Store(formula, op, srcHead)) return false;
 	}
 
 	//Finish up if needed
 	if (lastWasLiteral || lastWasConstant || lastWasFunc)
 	{
-		ch = ' ';
+		//Terminate the pending token with a character that is not skipped as blank
+		ch = '\0';
 		srcHead--;
 
 		goto iter;
 	}
 
 	//Return (like '\0' in strings)
-	store[storeHead] = FORMULA_RET;
+	return Store(formula, FORMULA_RET, srcHead);
+}
+
+void ResetFormula(Formula *formula)
+{
+	formula->codeC = 0;
+	formula->constantC = 0;
+	formula->slotC = 0;
+	formula->maxDepth = 0;
+	formula->verified = false;
+}
+
+void FreeFormula(Formula *formula)
+{
+	free(formula->code);
+	free(formula->constants);
+	formula->code = NULL;
+	formula->constants = NULL;
+	formula->codeCapacity = 0;
+	formula->constantCapacity = 0;
+	ResetFormula(formula);
+}
 
+bool AppendFormula(Formula *formula, uint8_t byte)
+{
+	if (formula->codeC >= MAX_FORMULA) return false;
+
+	if (formula->codeC == formula->codeCapacity)
+	{
+		int capacity = formula->codeCapacity ? formula->codeCapacity * 2 : 64;
+		uint8_t *code = realloc(formula->code, capacity);
+		if (!code) return false;
+		formula->code = code;
+		formula->codeCapacity = capacity;
+	}
+
+	formula->code[formula->codeC++] = byte;
 	return true;
 }
 
-bool EvaluateFormula(const uint64_t *src, FormulaVariable *variables, int variableC, double *ret)
+int AddFormulaConstant(Formula *formula, double value)
 {
-	int srcHead = 0, bufferHead = 0;
-	double buffers[MAX_BUFFERS], clip = 0.0;
-	uint64_t instruction;
+	//Compared bitwise, so -0.0 and NaNs keep their exact encoding
+	for (int i = 0; i < formula->constantC; i++)
+		if (!memcmp(&formula->constants[i], &value, sizeof(value))) return i;
 
-	while ((instruction = src[srcHead++]) != FORMULA_RET)
+	if (formula->constantC >= MAX_CONSTANTS) return -1;
+
+	if (formula->constantC == formula->constantCapacity)
 	{
-		//TODO: Test
-		if (FORMULA_VAR_BASE <= instruction && instruction <= FORMULA_VAR_TOP)
-		{
-			char name = instruction - FORMULA_VAR_BASE + 'a';
+		int capacity = formula->constantCapacity ? formula->constantCapacity * 2 : 8;
+		double *constants = realloc(formula->constants, capacity * sizeof(double));
+		if (!constants) return -1;
+		formula->constants = constants;
+		formula->constantCapacity = capacity;
+	}
 
-			for (int i = 0; i < variableC; i++)
+	formula->constants[formula->constantC] = value;
+	return formula->constantC++;
+}
+
+bool VerifyFormula(Formula *formula)
+{
+	const uint8_t *src = formula->code;
+	int srcHead = 0, bufferHead = 0, maxHead = 0;
+	uint8_t instruction = FORMULA_NOP;
+
+	formula->verified = false;
+
+	while (srcHead < formula->codeC && (instruction = src[srcHead++]) != FORMULA_RET)
+	{
+		if (FORMULA_IS_VAR(instruction))
+		{
+			if (instruction - FORMULA_VAR_BASE >= formula->slotC)
 			{
-				if (variables[i].name == name)
+				fprintf(stderr, "Invalid variable slot at instruction %d.\n", srcHead);
+				return false;
+			}
+			continue;
+		}
+
+		switch (instruction)
+		{
+			case FORMULA_SEEK_LEFT:
+			case FORMULA_COPY_LEFT:
+				if (--bufferHead < 0)
 				{
-					buffers[bufferHead] = variables[i].value;
-					break;
+					fprintf(stderr, "BufferHead underflow at instruction %d.\n", srcHead);
+					return false;
 				}
+				break;
+
+			case FORMULA_SEEK_RIGHT:
+			case FORMULA_COPY_RIGHT:
+				if (++bufferHead >= MAX_BUFFERS)
+				{
+					fprintf(stderr, "BufferHead overflow at instruction %d.\n", srcHead);
+					return false;
+				}
+				break;
+
+			default:
+				if (instruction >= FORMULA_OP_COUNT)
+				{
+					fprintf(stderr, "Invalid instruction %d at index %d.\n", instruction, srcHead - 1);
+					return false;
+				}
+				break;
+		}
+
+		if ((FORMULA_IS_BINARY(instruction) || FORMULA_IS_FUSED(instruction)) && bufferHead < 1)
+		{
+			fprintf(stderr, "BufferHead underflow at instruction %d.\n", srcHead);
+			return false;
+		}
+		if (FORMULA_HAS_OPERAND(instruction))
+		{
+			bool isSlot = FORMULA_IS_FUSED(instruction) && instruction >= FORMULA_ADD_VAR;
+			if (srcHead >= formula->codeC ||
+				src[srcHead] >= (isSlot ? formula->slotC : formula->constantC))
+			{
+				fprintf(stderr, "Invalid operand at instruction %d.\n", srcHead);
+				return false;
 			}
+			srcHead++;
+		}
 
+		if (bufferHead > maxHead) maxHead = bufferHead;
+	}
+
+	if (instruction != FORMULA_RET)
+	{
+		fprintf(stderr, "Formula does not end in a return.\n");
+		return false;
+	}
+
+	formula->maxDepth = maxHead + 1;
+	formula->verified = true;
+	return true;
+}
+
+int GetFormulaSlot(const Formula *formula, char name)
+{
+	for (int i = 0; i < formula->slotC; i++)
+		if (formula->slots[i] == name) return i;
+
+	return -1;
+}
+
+bool EvaluateFormula(const Formula *formula, const double *registers, double *ret)
+{
+	const uint8_t *src = formula->code;
+	const double *constants = formula->constants;
+	int srcHead = 0, bufferHead = 0;
+	double buffers[MAX_BUFFERS], clip = 0.0;
+	uint8_t instruction;
+
+	//Bounds were checked by VerifyFormula
+	if (!formula->verified) return false;
+
+	while ((instruction = src[srcHead++]) != FORMULA_RET)
+	{
+		if (FORMULA_VAR_BASE <= instruction && instruction <= FORMULA_VAR_TOP)
+		{
+			buffers[bufferHead] = registers[instruction - FORMULA_VAR_BASE];
 			continue;
 		}
 
+		//Superinstructions load their operand into A, then run the plain operation
+		if (FORMULA_IS_FUSED(instruction))
+		{
+			buffers[bufferHead] = instruction < FORMULA_ADD_VAR ?
+				constants[src[srcHead]] : registers[src[srcHead]];
+			srcHead++;
+			instruction = FORMULA_FUSED_BASE(instruction);
+		}
+
 		switch (instruction)
 		{
 			case FORMULA_NOP: break;
 			case FORMULA_CONSTANT:
 			case FORMULA_LITERAL:
-				buffers[bufferHead] = ((double *)src)[srcHead++];
+				buffers[bufferHead] = constants[src[srcHead++]];
 				break;
 
 			case FORMULA_CLIP_WRITE:
@@ -276,90 +448,44 @@ bool EvaluateFormula(const uint64_t *src, FormulaVariable *variables, int variab
 				break;
 
 			case FORMULA_SEEK_LEFT:
-				if (--bufferHead < 0)
-				{
-					fprintf(stderr, "BufferHead underflow at instruction %d.\n", srcHead);
-					return false;
-				}
+				bufferHead--;
 				break;
 
 			case FORMULA_SEEK_RIGHT:
-				if (++bufferHead >= MAX_BUFFERS)
-				{
-					fprintf(stderr, "BufferHead overflow at instruction %d.\n", srcHead);
-					return false;
-				}
+				bufferHead++;
 				break;
 
 			case FORMULA_COPY_LEFT:
-				if (--bufferHead < 0)
-				{
-					fprintf(stderr, "BufferHead underflow at instruction %d.\n", srcHead);
-					return false;
-				}
+				bufferHead--;
 				buffers[bufferHead] = buffers[bufferHead + 1];
 				break;
 
 			case FORMULA_COPY_RIGHT:
-				if (++bufferHead < 0)
-				{
-					fprintf(stderr, "BufferHead overflow at instruction %d.\n", srcHead);
-					return false;
-				}
+				bufferHead++;
 				buffers[bufferHead] = buffers[bufferHead - 1];
 				break;
 
 			case FORMULA_ADD:
-				if (bufferHead < 1)
-				{
-					fprintf(stderr, "BufferHead underflow at instruction %d.\n", srcHead);
-					return false;
-				}
 				buffers[bufferHead] = buffers[bufferHead - 1] + buffers[bufferHead];
 				break;
 
 			case FORMULA_SUBTRACT:
-				if (bufferHead < 1)
-				{
-					fprintf(stderr, "BufferHead underflow at instruction %d.\n", srcHead);
-					return false;
-				}
 				buffers[bufferHead] = buffers[bufferHead - 1] - buffers[bufferHead];
 				break;
 
 			case FORMULA_MULTIPLY:
-				if (bufferHead < 1)
-				{
-					fprintf(stderr, "BufferHead underflow at instruction %d.\n", srcHead);
-					return false;
-				}
 				buffers[bufferHead] = buffers[bufferHead - 1] * buffers[bufferHead];
 				break;
 
 			case FORMULA_DIVIDE:
-				if (bufferHead < 1)
-				{
-					fprintf(stderr, "BufferHead underflow at instruction %d.\n", srcHead);
-					return false;
-				}
 				buffers[bufferHead] = buffers[bufferHead - 1] / buffers[bufferHead];
 				break;
 
 			case FORMULA_REMAINDER:
-				if (bufferHead < 1)
-				{
-					fprintf(stderr, "BufferHead underflow at instruction %d.\n", srcHead);
-					return false;
-				}
 				buffers[bufferHead] = fmod(buffers[bufferHead - 1], buffers[bufferHead]);
 				break;
 
 			case FORMULA_POW:
-				if (bufferHead < 1)
-				{
-					fprintf(stderr, "BufferHead underflow at instruction %d.\n", srcHead);
-					return false;
-				}
 				buffers[bufferHead] = pow(buffers[bufferHead - 1], buffers[bufferHead]);
 				break;
 
@@ -457,13 +583,6 @@ bool EvaluateFormula(const uint64_t *src, FormulaVariable *variables, int variab
 				buffers[bufferHead] = -buffers[bufferHead];
 				break;
 
-			case FORMULA_RET://Should never get here
-				fprintf(stderr, "Unexpected return at instruction %d.\n", srcHead);
-				return false;
-
-			default:
-				fprintf(stderr, "Invalid instruction %ld at index %d.\n", src[srcHead], srcHead);
-				return false;
 		}
 	}
 
@@ -475,8 +594,64 @@ bool EvaluateFormula(const uint64_t *src, FormulaVariable *variables, int variab
 	return true;
 }
 
+bool EvaluateFormulaBatch(const Formula *formula, const double *const *registers, int count, double *ret, bool *valid)
+{
+	if (!formula->verified)
+	{
+		memset(valid, 0, count * sizeof(bool));
+		return false;
+	}
+
+	for (int offset = 0; offset < count; offset += FORMULA_BATCH)
+	{
+		int n = count - offset < FORMULA_BATCH ? count - offset : FORMULA_BATCH;
+
+		EvaluateChunk(formula, registers, offset, n, ret + offset, valid + offset);
+	}
+
+	return true;
+}
+
+bool EvaluateFormulaBatchDual(const Formula *formula, const double *const *registers, int slot, int count, double *ret, double *dret, bool *valid)
+{
+	if (!formula->verified)
+	{
+		memset(valid, 0, count * sizeof(bool));
+		return false;
+	}
+
+	for (int offset = 0; offset < count; offset += FORMULA_BATCH)
+	{
+		int n = count - offset < FORMULA_BATCH ? count - offset : FORMULA_BATCH;
+
+		EvaluateChunkDual(formula, registers, slot, offset, n, ret + offset, dret + offset, valid + offset);
+	}
+
+	return true;
+}
+
 
-static bool GetFunctionCode(const char *name, uint64_t *store, int srcHead)
+//Appends to the program being compiled, reporting where it ran out of room
+static bool Store(Formula *formula, uint8_t byte, int srcHead)
+{
+	if (AppendFormula(formula, byte)) return true;
+
+	fprintf(stderr, "Formula too long at character %d. Max allowed size is %d bytes.\n", srcHead, MAX_FORMULA);
+	return false;
+}
+static bool StoreConstant(Formula *formula, uint8_t instruction, double value, int srcHead)
+{
+	int index = AddFormulaConstant(formula, value);
+	if (index == -1)
+	{
+		fprintf(stderr, "Too many distinct constants at character %d. Max allowed is %d.\n", srcHead, MAX_CONSTANTS);
+		return false;
+	}
+
+	return Store(formula, instruction, srcHead) && Store(formula, index, srcHead);
+}
+
+static bool GetFunctionCode(const char *name, uint8_t *store, int srcHead)
 {
 	if (!strcmp(name, "sin"))			*store = FORMULA_SIN;
 	else if (!strcmp(name, "cos"))		*store = FORMULA_COS;
@@ -508,3 +683,249 @@ static bool GetFunctionCode(const char *name, uint64_t *store, int srcHead)
 
 	return true;
 }
+
+static void EvaluateChunk(const Formula *formula, const double *const *registers, int offset, int n, double *ret, bool *valid)
+{
+	const uint8_t *src = formula->code;
+	const double *constants = formula->constants;
+	int srcHead = 0, bufferHead = 0;
+	double buffers[MAX_BUFFERS][FORMULA_BATCH], clip[FORMULA_BATCH] = { 0 };
+	double *a;
+	uint8_t instruction;
+	const FormulaKernels *kernels = GetFormulaKernels();
+
+	while ((instruction = src[srcHead++]) != FORMULA_RET)
+	{
+		a = buffers[bufferHead];
+
+		if (FORMULA_VAR_BASE <= instruction && instruction <= FORMULA_VAR_TOP)
+		{
+			memcpy(a, registers[instruction - FORMULA_VAR_BASE] + offset, n * sizeof(double));
+			continue;
+		}
+
+		if (FORMULA_IS_FUSED(instruction))
+		{
+			if (instruction < FORMULA_ADD_VAR)
+				for (int i = 0; i < n; i++) a[i] = constants[src[srcHead]];
+			else
+				memcpy(a, registers[src[srcHead]] + offset, n * sizeof(double));
+			srcHead++;
+			instruction = FORMULA_FUSED_BASE(instruction);
+		}
+
+		//Math operations run as kernels over the whole chunk
+		if (FORMULA_IS_BINARY(instruction))
+		{
+			kernels->binary[instruction](a, buffers[bufferHead - 1], n);
+			continue;
+		}
+		if (FORMULA_IS_UNARY(instruction))
+		{
+			kernels->unary[instruction](a, n);
+			continue;
+		}
+
+		switch (instruction)
+		{
+			case FORMULA_NOP: break;
+			case FORMULA_CONSTANT:
+			case FORMULA_LITERAL:
+				for (int i = 0; i < n; i++) a[i] = constants[src[srcHead]];
+				srcHead++;
+				break;
+
+			case FORMULA_CLIP_WRITE:
+				memcpy(clip, a, n * sizeof(double));
+				break;
+
+			case FORMULA_CLIP_READ:
+				memcpy(a, clip, n * sizeof(double));
+				break;
+
+			case FORMULA_SEEK_LEFT:
+				bufferHead--;
+				break;
+
+			case FORMULA_SEEK_RIGHT:
+				bufferHead++;
+				break;
+
+			case FORMULA_COPY_LEFT:
+				bufferHead--;
+				memcpy(buffers[bufferHead], a, n * sizeof(double));
+				break;
+
+			case FORMULA_COPY_RIGHT:
+				bufferHead++;
+				memcpy(buffers[bufferHead], a, n * sizeof(double));
+				break;
+		}
+	}
+
+	//Check if nan or +-infinity
+	a = buffers[bufferHead];
+	for (int i = 0; i < n; i++)
+	{
+		valid[i] = isfinite(a[i]);
+		ret[i] = a[i];
+	}
+}
+
+//Tangent rules, applied before the value kernel overwrites the inputs
+static void TangentUnary(uint8_t instruction, const double *a, double *da, int n)
+{
+	switch (instruction)
+	{
+		case FORMULA_SQUARE:	for (int i = 0; i < n; i++) da[i] *= 2 * a[i]; break;
+		case FORMULA_SQRT:		for (int i = 0; i < n; i++) da[i] /= 2 * sqrt(a[i]); break;
+		case FORMULA_LOGN:		for (int i = 0; i < n; i++) da[i] /= a[i]; break;
+		case FORMULA_LOGD:		for (int i = 0; i < n; i++) da[i] /= a[i] * M_LN10; break;
+		case FORMULA_LOGB:		for (int i = 0; i < n; i++) da[i] /= a[i] * M_LN2; break;
+		case FORMULA_ABS:		for (int i = 0; i < n; i++) da[i] *= a[i] == 0.0 ? 0.0 : (a[i] > 0.0 ? 1.0 : -1.0); break;
+		case FORMULA_SIN:		for (int i = 0; i < n; i++) da[i] *= cos(a[i]); break;
+		case FORMULA_COS:		for (int i = 0; i < n; i++) da[i] *= -sin(a[i]); break;
+		case FORMULA_TAN:		for (int i = 0; i < n; i++) da[i] /= cos(a[i]) * cos(a[i]); break;
+		case FORMULA_ASIN:		for (int i = 0; i < n; i++) da[i] /= sqrt(1 - a[i] * a[i]); break;
+		case FORMULA_ACOS:		for (int i = 0; i < n; i++) da[i] /= -sqrt(1 - a[i] * a[i]); break;
+		case FORMULA_ATAN:		for (int i = 0; i < n; i++) da[i] /= 1 + a[i] * a[i]; break;
+		case FORMULA_SINH:		for (int i = 0; i < n; i++) da[i] *= cosh(a[i]); break;
+		case FORMULA_COSH:		for (int i = 0; i < n; i++) da[i] *= sinh(a[i]); break;
+		case FORMULA_TANH:		for (int i = 0; i < n; i++) da[i] *= 1 - tanh(a[i]) * tanh(a[i]); break;
+		case FORMULA_ASINH:		for (int i = 0; i < n; i++) da[i] /= sqrt(a[i] * a[i] + 1); break;
+		case FORMULA_ACOSH:		for (int i = 0; i < n; i++) da[i] /= sqrt(a[i] * a[i] - 1); break;
+		case FORMULA_ATANH:		for (int i = 0; i < n; i++) da[i] /= 1 - a[i] * a[i]; break;
+		case FORMULA_NEGATIVE:	for (int i = 0; i < n; i++) da[i] = -da[i]; break;
+
+		//Piecewise constant
+		case FORMULA_SIGN:
+		case FORMULA_CEIL:
+		case FORMULA_FLOOR:
+		case FORMULA_ROUND:
+			memset(da, 0, n * sizeof(double));
+			break;
+	}
+}
+static void TangentBinary(uint8_t instruction, const double *a, double *da, const double *b, const double *db, int n)
+{
+	switch (instruction)
+	{
+		case FORMULA_ADD:		for (int i = 0; i < n; i++) da[i] = db[i] + da[i]; break;
+		case FORMULA_SUBTRACT:	for (int i = 0; i < n; i++) da[i] = db[i] - da[i]; break;
+		case FORMULA_MULTIPLY:	for (int i = 0; i < n; i++) da[i] = db[i] * a[i] + b[i] * da[i]; break;
+		case FORMULA_DIVIDE:	for (int i = 0; i < n; i++) da[i] = (db[i] * a[i] - b[i] * da[i]) / (a[i] * a[i]); break;
+		case FORMULA_REMAINDER:	for (int i = 0; i < n; i++) da[i] = db[i] - trunc(b[i] / a[i]) * da[i]; break;
+
+		//Each term only when its input varies, so negative bases with constant exponents still work
+		case FORMULA_POW:
+			for (int i = 0; i < n; i++)
+				da[i] = (db[i] != 0.0 ? a[i] * pow(b[i], a[i] - 1) * db[i] : 0.0) +
+					(da[i] != 0.0 ? pow(b[i], a[i]) * log(b[i]) * da[i] : 0.0);
+			break;
+	}
+}
+
+static void EvaluateChunkDual(const Formula *formula, const double *const *registers, int slot, int offset, int n, double *ret, double *dret, bool *valid)
+{
+	const uint8_t *src = formula->code;
+	const double *constants = formula->constants;
+	int srcHead = 0, bufferHead = 0;
+	double buffers[MAX_BUFFERS][FORMULA_BATCH], clip[FORMULA_BATCH] = { 0 };
+	double tangents[MAX_BUFFERS][FORMULA_BATCH], clipTangent[FORMULA_BATCH] = { 0 };
+	double *a, *da;
+	uint8_t instruction;
+	const FormulaKernels *kernels = GetFormulaKernels();
+
+	//Values go through the same kernels as EvaluateChunk, tangents ride along
+	while ((instruction = src[srcHead++]) != FORMULA_RET)
+	{
+		a = buffers[bufferHead];
+		da = tangents[bufferHead];
+
+		if (FORMULA_IS_VAR(instruction))
+		{
+			memcpy(a, registers[instruction - FORMULA_VAR_BASE] + offset, n * sizeof(double));
+			for (int i = 0; i < n; i++) da[i] = instruction - FORMULA_VAR_BASE == slot;
+			continue;
+		}
+
+		if (FORMULA_IS_FUSED(instruction))
+		{
+			if (instruction < FORMULA_ADD_VAR)
+			{
+				for (int i = 0; i < n; i++) a[i] = constants[src[srcHead]];
+				memset(da, 0, n * sizeof(double));
+			}
+			else
+			{
+				memcpy(a, registers[src[srcHead]] + offset, n * sizeof(double));
+				for (int i = 0; i < n; i++) da[i] = src[srcHead] == slot;
+			}
+			srcHead++;
+			instruction = FORMULA_FUSED_BASE(instruction);
+		}
+
+		if (FORMULA_IS_BINARY(instruction))
+		{
+			TangentBinary(instruction, a, da, buffers[bufferHead - 1], tangents[bufferHead - 1], n);
+			kernels->binary[instruction](a, buffers[bufferHead - 1], n);
+			continue;
+		}
+		if (FORMULA_IS_UNARY(instruction))
+		{
+			TangentUnary(instruction, a, da, n);
+			kernels->unary[instruction](a, n);
+			continue;
+		}
+
+		switch (instruction)
+		{
+			case FORMULA_NOP: break;
+			case FORMULA_CONSTANT:
+			case FORMULA_LITERAL:
+				for (int i = 0; i < n; i++) a[i] = constants[src[srcHead]];
+				memset(da, 0, n * sizeof(double));
+				srcHead++;
+				break;
+
+			case FORMULA_CLIP_WRITE:
+				memcpy(clip, a, n * sizeof(double));
+				memcpy(clipTangent, da, n * sizeof(double));
+				break;
+
+			case FORMULA_CLIP_READ:
+				memcpy(a, clip, n * sizeof(double));
+				memcpy(da, clipTangent, n * sizeof(double));
+				break;
+
+			case FORMULA_SEEK_LEFT:
+				bufferHead--;
+				break;
+
+			case FORMULA_SEEK_RIGHT:
+				bufferHead++;
+				break;
+
+			case FORMULA_COPY_LEFT:
+				bufferHead--;
+				memcpy(buffers[bufferHead], a, n * sizeof(double));
+				memcpy(tangents[bufferHead], da, n * sizeof(double));
+				break;
+
+			case FORMULA_COPY_RIGHT:
+				bufferHead++;
+				memcpy(buffers[bufferHead], a, n * sizeof(double));
+				memcpy(tangents[bufferHead], da, n * sizeof(double));
+				break;
+		}
+	}
+
+	a = buffers[bufferHead];
+	da = tangents[bufferHead];
+	for (int i = 0; i < n; i++)
+	{
+		valid[i] = isfinite(a[i]);
+		ret[i] = a[i];
+		dret[i] = da[i];
+	}
+}
@@ -9,6 +9,10 @@
 //Constants
 #define MAX_FUNCTION_NAME 16
 #define MAX_BUFFERS 64
+#define MAX_FORMULA 4096 //Program bytes
+#define MAX_CONSTANTS 256 //Operands are one byte
+#define MAX_SLOTS 26
+#define FORMULA_BATCH 64
 
 //Operations
 #define FORMULA_NOP				0
@@ -49,20 +53,102 @@
 #define FORMULA_FLOOR			35
 #define FORMULA_ROUND			36
 #define FORMULA_NEGATIVE		37
-#define FORMULA_VAR_BASE		0x1000
-#define FORMULA_VAR_TOP			(FORMULA_VAR_BASE + 'z' - 'a')
-#define FORMULA_RET				~0ul
+//Superinstructions emitted by OptimizeFormula: A = B op operand, where the
+//operand is a constant index or a variable slot
+#define FORMULA_ADD_LITERAL		38
+#define FORMULA_SUBTRACT_LITERAL	39
+#define FORMULA_MULTIPLY_LITERAL	40
+#define FORMULA_DIVIDE_LITERAL	41
+#define FORMULA_REMAINDER_LITERAL	42
+#define FORMULA_POW_LITERAL		43
+#define FORMULA_ADD_VAR			44
+#define FORMULA_SUBTRACT_VAR	45
+#define FORMULA_MULTIPLY_VAR	46
+#define FORMULA_DIVIDE_VAR		47
+#define FORMULA_REMAINDER_VAR	48
+#define FORMULA_POW_VAR			49
+#define FORMULA_OP_COUNT		50
+#define FORMULA_VAR_BASE		0x80
+#define FORMULA_VAR_TOP			(FORMULA_VAR_BASE + MAX_SLOTS - 1)
+#define FORMULA_RET				0xFF
 
+#define FORMULA_IS_BINARY(op)	(FORMULA_ADD <= (op) && (op) <= FORMULA_POW)
+#define FORMULA_IS_UNARY(op)	(FORMULA_SQUARE <= (op) && (op) <= FORMULA_NEGATIVE)
+#define FORMULA_IS_FUSED(op)	(FORMULA_ADD_LITERAL <= (op) && (op) <= FORMULA_POW_VAR)
+#define FORMULA_IS_VAR(op)		(FORMULA_VAR_BASE <= (op) && (op) <= FORMULA_VAR_TOP)
+#define FORMULA_HAS_OPERAND(op)	((op) == FORMULA_LITERAL || (op) == FORMULA_CONSTANT || FORMULA_IS_FUSED(op))
+//Binary operation performed by a superinstruction
+#define FORMULA_FUSED_BASE(op)	(FORMULA_ADD + ((op) - FORMULA_ADD_LITERAL) % (FORMULA_POW - FORMULA_ADD + 1))
 
-typedef struct 
+//Interval evaluation results, also how much of an interval is undefined
+#define FORMULA_DEFINED			0
+#define FORMULA_PARTLY_DEFINED	1
+#define FORMULA_UNDEFINED		2
+
+
+//Opcodes are one byte. Literals, constants and superinstructions are followed by a one byte
+//operand, an index into constants or a variable slot. Start zeroed and release with FreeFormula
+typedef struct
+{
+	uint8_t *code;
+	double *constants;
+	int codeC, codeCapacity;
+	int constantC, constantCapacity;
+	char slots[MAX_SLOTS]; //Variable name loaded by each FORMULA_VAR_BASE + slot
+	int slotC;
+	int maxDepth; //Buffers used, set by VerifyFormula
+	bool verified;
+} Formula;
+
+//Bounds of every defined value in a range, which may also hold undefined (NaN) values
+typedef struct
 {
-	char name;
-	double value;
-} FormulaVariable;
+	double lo, hi;		//Possibly infinite, meaningless when all of it is undefined
+	uint8_t undefined;	//FORMULA_DEFINED, FORMULA_PARTLY_DEFINED or FORMULA_UNDEFINED
+} FormulaInterval;
+
+
+bool CompileFormula(const char *src, Formula *formula);
+
+//Empties the program, keeping its memory for reuse
+void ResetFormula(Formula *formula);
+void FreeFormula(Formula *formula);
+
+//Appends one byte to the program. False once it would exceed MAX_FORMULA or memory runs out
+bool AppendFormula(Formula *formula, uint8_t byte);
+
+//Index of value in the constant pool, added if missing. -1 once the pool is full
+int AddFormulaConstant(Formula *formula, double value);
+
+//Checks every instruction and the BufferHead bounds once, so evaluation can skip them.
+//Unverified formulas are never evaluated
+bool VerifyFormula(Formula *formula);
+
+//Folds constants, drops NOPs and redundant seeks and fuses operand loads into
+//superinstructions. Expects a verified formula and leaves it verified
+bool OptimizeFormula(Formula *formula);
+
+//Partial evaluation: replaces the slot with value and folds everything that only depended
+//on it. Slots keep their numbers, so residual takes the same registers as formula.
+//residual must be a different Formula, its memory is reused across calls
+bool SpecializeFormula(const Formula *formula, int slot, double value, Formula *residual);
+
+//Slot the variable is read from, or -1 if the formula does not use it
+int GetFormulaSlot(const Formula *formula, char name);
+
+//registers holds one value per slot
+bool EvaluateFormula(const Formula *formula, const double *registers, double *ret);
 
+//Evaluates count points at once. Each slot points to count values, results go to ret and valid
+bool EvaluateFormulaBatch(const Formula *formula, const double *const *registers, int count, double *ret, bool *valid);
 
-bool CompileFormula(const char *src, uint64_t *store);
+//Same as EvaluateFormulaBatch, also writes the derivative of each result with respect to slot
+//to dret using dual numbers. A slot of -1 gives zero derivatives
+bool EvaluateFormulaBatchDual(const Formula *formula, const double *const *registers, int slot, int count, double *ret, double *dret, bool *valid);
 
-bool EvaluateFormula(const uint64_t *src, FormulaVariable *variables, int variableC, double *ret);
+//Interval arithmetic: registers holds one interval per slot, ret bounds whatever the other evaluation
+//functions give for registers inside them. FORMULA_DEFINED when all of those would be valid,
+//FORMULA_UNDEFINED when none would and FORMULA_PARTLY_DEFINED when it cannot tell
+int EvaluateFormulaInterval(const Formula *formula, const FormulaInterval *registers, FormulaInterval *ret);
 
 #endif
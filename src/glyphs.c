@@ -0,0 +1,85 @@
+//glyphs.c -
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "glyphs.h"
+#include "raster.h"
+
+
+
+bool InitGlyphAtlas(GlyphAtlas *atlas, int binC, int center, GlyphDraw draw, void *context)
+{
+	atlas->sprites = calloc(binC, sizeof(Image));
+	atlas->slopes = malloc((binC > 1 ? binC - 1 : 1) * sizeof(double));
+	atlas->binC = binC;
+	atlas->center = center;
+	if (!atlas->sprites || !atlas->slopes)
+	{
+		FreeGlyphAtlas(atlas);
+		return false;
+	}
+
+	double width = M_PI / binC;
+	for (int i = 0; i < binC; i++)
+	{
+		if (i) atlas->slopes[i - 1] = tan(-M_PI / 2 + i * width);
+
+		atlas->sprites[i] = GenImageColor(2 * center + 1, 2 * center + 1, BLANK);
+		if (!atlas->sprites[i].data)
+		{
+			FreeGlyphAtlas(atlas);
+			return false;
+		}
+		draw(&atlas->sprites[i], center, -M_PI / 2 + (i + 0.5) * width, context);
+	}
+
+	return true;
+}
+
+void FreeGlyphAtlas(GlyphAtlas *atlas)
+{
+	if (atlas->sprites)
+		for (int i = 0; i < atlas->binC; i++) UnloadImage(atlas->sprites[i]);
+
+	free(atlas->sprites);
+	free(atlas->slopes);
+	atlas->sprites = NULL;
+	atlas->slopes = NULL;
+}
+
+const Image *GetGlyph(const GlyphAtlas *atlas, double slope)
+{
+	//First bin whose upper slope is above, tan is increasing over the bins
+	int lo = 0, hi = atlas->binC - 1;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (slope < atlas->slopes[mid]) hi = mid;
+		else lo = mid + 1;
+	}
+
+	return &atlas->sprites[lo];
+}
+
+void StampGlyph(const GlyphAtlas *atlas, const Image *sprite, Image *img, int x, int y, int left, int right)
+{
+	int spriteLeft = x - atlas->center, top = y - atlas->center;
+	if (left < 0) left = 0;
+	if (right > img->width) right = img->width;
+	int first = spriteLeft < left ? left - spriteLeft : 0, last = spriteLeft + sprite->width > right ? right - spriteLeft : sprite->width;
+
+	for (int row = top < 0 ? -top : 0; row < sprite->height && top + row < img->height; row++)
+	{
+		const Color *src = (const Color *)sprite->data + (size_t)row * sprite->width;
+		Color *dst = (Color *)img->data + (size_t)(top + row) * img->width;
+
+		for (int column = first; column < last; column++)
+		{
+			//Most of a sprite is empty, and most of the rest is solid
+			if (!src[column].a) continue;
+			if (src[column].a == 255) dst[spriteLeft + column] = src[column];
+			else BlendPixel(img, spriteLeft + column, top + row, src[column], 255);
+		}
+	}
+}
@@ -0,0 +1,33 @@
+//glyphs.h - Marks drawn once per quantized slope angle, so a grid of them is stamped instead of drawn
+
+#ifndef GLYPHS_H
+#define GLYPHS_H
+
+#include <stdbool.h>
+
+#include "raylib.h"
+
+//Draws the mark for angle into a blank sprite, with its origin at pixel (center, center)
+typedef void (*GlyphDraw)(Image *sprite, int center, double angle, void *context);
+
+//Bin i holds the angles in (-pi/2 + i * pi / binC, -pi/2 + (i + 1) * pi / binC), drawn at the middle one
+typedef struct
+{
+	Image *sprites;
+	double *slopes;		//Slope between bin i and i + 1, binC - 1 of them
+	int binC, center;
+} GlyphAtlas;
+
+
+//Sprites are square, 2 * center + 1 pixels a side
+bool InitGlyphAtlas(GlyphAtlas *atlas, int binC, int center, GlyphDraw draw, void *context);
+void FreeGlyphAtlas(GlyphAtlas *atlas);
+
+//Sprite of the bin the slope falls in, found by bisecting slopes rather than taking the arctangent
+const Image *GetGlyph(const GlyphAtlas *atlas, double slope);
+
+//Blends the sprite over img with its origin on pixel (x, y). Only columns [left, right) of img are written,
+//so threads can stamp into disjoint columns of one image
+void StampGlyph(const GlyphAtlas *atlas, const Image *sprite, Image *img, int x, int y, int left, int right);
+
+#endif
@@ -0,0 +1,375 @@
+//interval.c -
+
+#include <math.h>
+
+#include "formulas.h"
+
+//Relative widening of results that do not come from one correctly rounded operation, so
+//bounds also hold for the vector kernels and compiled code, whose last bits may differ
+#define INTERVAL_SLACK 1e-12
+#define INTERVAL_PI 3.14159265358979323846
+
+
+
+static FormulaInterval Make(double lo, double hi, uint8_t undefined)
+{
+	return (FormulaInterval){ .lo = lo, .hi = hi, .undefined = undefined };
+}
+
+static FormulaInterval Undefined()
+{
+	return Make(NAN, NAN, FORMULA_UNDEFINED);
+}
+
+//Folding can leave NaN in the constant pool
+static FormulaInterval Constant(double value)
+{
+	return isnan(value) ? Undefined() : Make(value, value, FORMULA_DEFINED);
+}
+
+//Stays on its side of zero unless absolute is given, so sign proofs survive widening
+static FormulaInterval Widen(FormulaInterval x, double absolute)
+{
+	x.lo -= fabs(x.lo) * INTERVAL_SLACK + absolute;
+	x.hi += fabs(x.hi) * INTERVAL_SLACK + absolute;
+	return x;
+}
+
+static FormulaInterval Increasing(FormulaInterval x, double (*f)(double))
+{
+	return Widen(Make(f(x.lo), f(x.hi), x.undefined), 0);
+}
+
+static FormulaInterval Decreasing(FormulaInterval x, double (*f)(double))
+{
+	return Widen(Make(f(x.hi), f(x.lo), x.undefined), 0);
+}
+
+//Bounds of four candidate extremes, NaN ones are left out and make the result partly undefined
+static FormulaInterval Corners(double a, double b, double c, double d, uint8_t undefined)
+{
+	double values[4] = { a, b, c, d };
+	FormulaInterval x = Make(INFINITY, -INFINITY, undefined);
+
+	for (int i = 0; i < 4; i++)
+	{
+		if (isnan(values[i]))
+		{
+			x.undefined |= FORMULA_PARTLY_DEFINED;
+			continue;
+		}
+		x.lo = fmin(x.lo, values[i]);
+		x.hi = fmax(x.hi, values[i]);
+	}
+
+	return x;
+}
+
+static bool Contains(FormulaInterval x, double value)
+{
+	return x.lo <= value && value <= x.hi;
+}
+
+//Whether phase + 2k pi falls in [lo, hi] for some k, erring towards yes
+static bool ContainsPhase(double lo, double hi, double phase)
+{
+	double margin = (fabs(lo) + fabs(hi) + 1) * INTERVAL_SLACK;
+	double k = ceil((lo - margin - phase) / (2 * INTERVAL_PI));
+
+	return phase + 2 * INTERVAL_PI * k <= hi + margin;
+}
+
+static FormulaInterval Periodic(FormulaInterval x, double (*f)(double), double maxPhase, double minPhase)
+{
+	if (isinf(x.lo) || isinf(x.hi))
+		return x.lo == x.hi ? Undefined() : Make(-1, 1, FORMULA_PARTLY_DEFINED);
+	if (x.hi - x.lo >= 2 * INTERVAL_PI)
+		return Make(-1, 1, x.undefined);
+
+	double a = f(x.lo), b = f(x.hi);
+	FormulaInterval y = Make(fmin(a, b), fmax(a, b), x.undefined);
+	if (ContainsPhase(x.lo, x.hi, maxPhase)) y.hi = 1;
+	if (ContainsPhase(x.lo, x.hi, minPhase)) y.lo = -1;
+
+	//Range reduction loses absolute precision as arguments grow
+	y = Widen(y, (fabs(x.lo) + fabs(x.hi) + 1) * INTERVAL_SLACK);
+	y.lo = fmax(y.lo, -1);
+	y.hi = fmin(y.hi, 1);
+	return y;
+}
+
+//Clips x to [lo, hi], all of it undefined when nothing is left
+static FormulaInterval Domain(FormulaInterval x, double lo, double hi)
+{
+	if (x.hi < lo || x.lo > hi) return Undefined();
+
+	if (x.lo < lo) { x.lo = lo; x.undefined |= FORMULA_PARTLY_DEFINED; }
+	if (x.hi > hi) { x.hi = hi; x.undefined |= FORMULA_PARTLY_DEFINED; }
+	return x;
+}
+
+static FormulaInterval Pow(FormulaInterval base, FormulaInterval exponent)
+{
+	uint8_t undefined = base.undefined | exponent.undefined;
+	bool integer = exponent.lo == exponent.hi && exponent.lo == floor(exponent.lo) && isfinite(exponent.lo);
+
+	//pow(x, 0) and pow(1, y) are 1 even for NaN
+	if (base.undefined == FORMULA_UNDEFINED || exponent.undefined == FORMULA_UNDEFINED)
+	{
+		if ((exponent.undefined != FORMULA_UNDEFINED && Contains(exponent, 0)) ||
+			(base.undefined != FORMULA_UNDEFINED && Contains(base, 1)))
+			return Make(1, 1, FORMULA_PARTLY_DEFINED);
+		return Undefined();
+	}
+
+	FormulaInterval y;
+
+	//Over non-negative bases the extremes are at the corners, y ln x being bilinear in y and ln x
+	if (base.lo >= 0)
+		y = Corners(pow(base.lo, exponent.lo), pow(base.lo, exponent.hi),
+			pow(base.hi, exponent.lo), pow(base.hi, exponent.hi), undefined);
+
+	//Integer powers are monotone on either side of zero
+	else if (integer)
+	{
+		double n = exponent.lo, a = pow(base.lo, n), b = pow(base.hi, n);
+		bool even = fmod(n, 2) == 0;
+
+		y = Make(fmin(a, b), fmax(a, b), undefined);
+		if (Contains(base, 0) && n > 0 && even) y.lo = 0;
+		if (Contains(base, 0) && n < 0) y = even ? Make(y.lo, INFINITY, undefined) : Make(-INFINITY, INFINITY, undefined);
+	}
+
+	//Negative bases only have values at integer exponents
+	else if (exponent.lo == exponent.hi)
+	{
+		if (base.hi < 0) return Undefined();
+		y = Corners(pow(0, exponent.lo), pow(base.hi, exponent.lo), NAN, NAN, undefined);
+	}
+	else y = Make(-INFINITY, INFINITY, undefined | FORMULA_PARTLY_DEFINED);
+
+	if (undefined)
+	{
+		y.lo = fmin(y.lo, 1);
+		y.hi = fmax(y.hi, 1);
+	}
+	return Widen(y, 0);
+}
+
+static FormulaInterval Remainder(FormulaInterval x, FormulaInterval m)
+{
+	uint8_t undefined = x.undefined | m.undefined;
+	double largest = fmax(fabs(m.lo), fabs(m.hi));
+
+	if (x.undefined == FORMULA_UNDEFINED || m.undefined == FORMULA_UNDEFINED ||
+		(m.lo == 0 && m.hi == 0) || (x.lo == x.hi && isinf(x.lo)))
+		return Undefined();
+	if (Contains(m, 0) || isinf(x.lo) || isinf(x.hi))
+		undefined |= FORMULA_PARTLY_DEFINED;
+
+	//Smaller than every divisor, fmod leaves it as is
+	if (!Contains(m, 0) && fmax(fabs(x.lo), fabs(x.hi)) < fmin(fabs(m.lo), fabs(m.hi)))
+		return Make(x.lo, x.hi, undefined);
+
+	//Keeps the sign of x and stays below the divisor
+	return Make(x.lo >= 0 ? 0 : fmax(x.lo, -largest), x.hi <= 0 ? 0 : fmin(x.hi, largest), undefined);
+}
+
+//right = left op right, as in the interpreter
+static FormulaInterval Binary(uint8_t instruction, FormulaInterval left, FormulaInterval right)
+{
+	uint8_t undefined = left.undefined | right.undefined;
+	FormulaInterval y;
+
+	if (instruction == FORMULA_POW) return Pow(left, right);
+	if (instruction == FORMULA_REMAINDER) return Remainder(left, right);
+	if (left.undefined == FORMULA_UNDEFINED || right.undefined == FORMULA_UNDEFINED) return Undefined();
+
+	//Basic operations are monotone under round to nearest, so exact endpoints bound every result
+	switch (instruction)
+	{
+		case FORMULA_ADD:
+			y = Make(left.lo + right.lo, left.hi + right.hi, undefined);
+			if ((left.lo == -INFINITY && right.hi == INFINITY) || (left.hi == INFINITY && right.lo == -INFINITY))
+				y.undefined |= FORMULA_PARTLY_DEFINED;
+			break;
+
+		case FORMULA_SUBTRACT:
+			y = Make(left.lo - right.hi, left.hi - right.lo, undefined);
+			if ((left.lo == -INFINITY && right.lo == -INFINITY) || (left.hi == INFINITY && right.hi == INFINITY))
+				y.undefined |= FORMULA_PARTLY_DEFINED;
+			break;
+
+		case FORMULA_MULTIPLY:
+			y = Corners(left.lo * right.lo, left.lo * right.hi, left.hi * right.lo, left.hi * right.hi, undefined);
+			//0 * inf inside the box
+			if ((Contains(left, 0) && (isinf(right.lo) || isinf(right.hi))) ||
+				(Contains(right, 0) && (isinf(left.lo) || isinf(left.hi))))
+				y.undefined |= FORMULA_PARTLY_DEFINED;
+			break;
+
+		case FORMULA_DIVIDE:
+			if (Contains(right, 0))
+			{
+				y = Make(-INFINITY, INFINITY, undefined);
+				if (Contains(left, 0)) y.undefined |= FORMULA_PARTLY_DEFINED;
+				break;
+			}
+			y = Corners(left.lo / right.lo, left.lo / right.hi, left.hi / right.lo, left.hi / right.hi, undefined);
+			if ((isinf(left.lo) || isinf(left.hi)) && (isinf(right.lo) || isinf(right.hi)))
+				y.undefined |= FORMULA_PARTLY_DEFINED;
+			break;
+
+		default:
+			return Make(-INFINITY, INFINITY, FORMULA_PARTLY_DEFINED);
+	}
+
+	//Compiled code may contract operations, which moves the last bit
+	return Widen(y, 0);
+}
+
+static FormulaInterval Unary(uint8_t instruction, FormulaInterval x)
+{
+	//NaN is the only thing sign does not pass on
+	if (instruction == FORMULA_SIGN)
+	{
+		if (x.undefined == FORMULA_UNDEFINED) return Make(-1, -1, FORMULA_DEFINED);
+
+		double lo = x.lo > 0 ? 1 : x.lo == 0 ? 0 : -1, hi = x.hi > 0 ? 1 : x.hi == 0 ? 0 : -1;
+		return Make(x.undefined ? -1 : lo, hi, FORMULA_DEFINED);
+	}
+	if (x.undefined == FORMULA_UNDEFINED) return Undefined();
+
+	switch (instruction)
+	{
+		case FORMULA_SQUARE:
+		{
+			double a = x.lo * x.lo, b = x.hi * x.hi;
+			return Widen(Make(Contains(x, 0) ? 0 : fmin(a, b), fmax(a, b), x.undefined), 0);
+		}
+
+		case FORMULA_SQRT:		return Increasing(Domain(x, 0, INFINITY), sqrt);
+		case FORMULA_LOGN:		return Increasing(Domain(x, 0, INFINITY), log);
+		case FORMULA_LOGD:		return Increasing(Domain(x, 0, INFINITY), log10);
+		case FORMULA_LOGB:		return Increasing(Domain(x, 0, INFINITY), log2);
+
+		case FORMULA_ABS:
+			if (x.lo >= 0) return x;
+			if (x.hi <= 0) return Make(-x.hi, -x.lo, x.undefined);
+			return Make(0, fmax(-x.lo, x.hi), x.undefined);
+
+		case FORMULA_SIN:		return Periodic(x, sin, INTERVAL_PI / 2, -INTERVAL_PI / 2);
+		case FORMULA_COS:		return Periodic(x, cos, 0, INTERVAL_PI);
+
+		case FORMULA_TAN:
+			if (isinf(x.lo) || isinf(x.hi))
+				return x.lo == x.hi ? Undefined() : Make(-INFINITY, INFINITY, FORMULA_PARTLY_DEFINED);
+			//Across a pole it takes every value
+			if (x.hi - x.lo >= INTERVAL_PI || ContainsPhase(x.lo, x.hi, INTERVAL_PI / 2) || ContainsPhase(x.lo, x.hi, -INTERVAL_PI / 2))
+				return Make(-INFINITY, INFINITY, x.undefined);
+			return Widen(Make(tan(x.lo), tan(x.hi), x.undefined), (fabs(x.lo) + fabs(x.hi) + 1) * INTERVAL_SLACK);
+
+		case FORMULA_ASIN:		return Increasing(Domain(x, -1, 1), asin);
+		case FORMULA_ACOS:		return Decreasing(Domain(x, -1, 1), acos);
+		case FORMULA_ATAN:		return Increasing(x, atan);
+		case FORMULA_SINH:		return Increasing(x, sinh);
+
+		case FORMULA_COSH:
+		{
+			double a = cosh(x.lo), b = cosh(x.hi);
+			return Widen(Make(Contains(x, 0) ? 1 : fmin(a, b), fmax(a, b), x.undefined), 0);
+		}
+
+		case FORMULA_TANH:		return Increasing(x, tanh);
+		case FORMULA_ASINH:		return Increasing(x, asinh);
+		case FORMULA_ACOSH:		return Increasing(Domain(x, 1, INFINITY), acosh);
+		case FORMULA_ATANH:		return Increasing(Domain(x, -1, 1), atanh);
+
+		//Exact, and monotone
+		case FORMULA_CEIL:		return Make(ceil(x.lo), ceil(x.hi), x.undefined);
+		case FORMULA_FLOOR:		return Make(floor(x.lo), floor(x.hi), x.undefined);
+		case FORMULA_ROUND:		return Make(round(x.lo), round(x.hi), x.undefined);
+		case FORMULA_NEGATIVE:	return Make(-x.hi, -x.lo, x.undefined);
+	}
+
+	return Make(-INFINITY, INFINITY, FORMULA_PARTLY_DEFINED);
+}
+
+
+
+int EvaluateFormulaInterval(const Formula *formula, const FormulaInterval *registers, FormulaInterval *ret)
+{
+	const uint8_t *src = formula->code;
+	const double *constants = formula->constants;
+	int srcHead = 0, bufferHead = 0;
+	FormulaInterval buffers[MAX_BUFFERS], clip = Make(0, 0, FORMULA_DEFINED);
+	uint8_t instruction;
+
+	//Bounds were checked by VerifyFormula
+	if (!formula->verified) return FORMULA_PARTLY_DEFINED;
+
+	//Same walk as EvaluateFormula
+	while ((instruction = src[srcHead++]) != FORMULA_RET)
+	{
+		FormulaInterval *a = &buffers[bufferHead];
+
+		if (FORMULA_IS_VAR(instruction))
+		{
+			*a = registers[instruction - FORMULA_VAR_BASE];
+			continue;
+		}
+
+		if (FORMULA_IS_FUSED(instruction))
+		{
+			*a = instruction < FORMULA_ADD_VAR ? Constant(constants[src[srcHead]]) : registers[src[srcHead]];
+			srcHead++;
+			instruction = FORMULA_FUSED_BASE(instruction);
+		}
+
+		if (FORMULA_IS_BINARY(instruction))
+		{
+			*a = Binary(instruction, buffers[bufferHead - 1], *a);
+		}
+		else if (FORMULA_IS_UNARY(instruction))
+		{
+			*a = Unary(instruction, *a);
+		}
+		else switch (instruction)
+		{
+			case FORMULA_CONSTANT:
+			case FORMULA_LITERAL:
+				*a = Constant(constants[src[srcHead++]]);
+				break;
+
+			case FORMULA_CLIP_WRITE:	clip = *a; break;
+			case FORMULA_CLIP_READ:		*a = clip; break;
+			case FORMULA_SEEK_LEFT:		bufferHead--; break;
+			case FORMULA_SEEK_RIGHT:	bufferHead++; break;
+
+			case FORMULA_COPY_LEFT:
+				bufferHead--;
+				buffers[bufferHead] = buffers[bufferHead + 1];
+				break;
+
+			case FORMULA_COPY_RIGHT:
+				bufferHead++;
+				buffers[bufferHead] = buffers[bufferHead - 1];
+				break;
+		}
+
+		//Leftover NaN bounds, such as inf - inf at the edges
+		if (a->undefined != FORMULA_UNDEFINED)
+		{
+			if (isnan(a->lo)) { a->lo = -INFINITY; a->undefined |= FORMULA_PARTLY_DEFINED; }
+			if (isnan(a->hi)) { a->hi = INFINITY; a->undefined |= FORMULA_PARTLY_DEFINED; }
+		}
+	}
+
+	//Infinite results are as invalid as NaN ones
+	*ret = buffers[bufferHead];
+	if (ret->undefined == FORMULA_UNDEFINED || ret->lo == INFINITY || ret->hi == -INFINITY)
+		return FORMULA_UNDEFINED;
+	if (ret->undefined || isinf(ret->lo) || isinf(ret->hi))
+		return FORMULA_PARTLY_DEFINED;
+	return FORMULA_DEFINED;
+}
@@ -0,0 +1,414 @@
+//jit.c -
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "kernels.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+
+
+#ifdef JIT_X86_64
+
+#define LANE_BYTES (JIT_LANES * sizeof(double))
+
+//Stack frame: one spill slot per buffer, the clipboard and a scratch slot for immediates
+#define FRAME_CLIP (JIT_MAX_DEPTH * LANE_BYTES)
+#define FRAME_SCRATCH (FRAME_CLIP + LANE_BYTES)
+#define FRAME_SIZE (FRAME_SCRATCH + LANE_BYTES)
+
+//Buffer n lives in ymm(2+n), ymm0 and ymm1 are scratch
+#define YMM(buffer) ((buffer) + 2)
+
+//AVX packed double opcodes (VEX.256.66)
+#define MAP_0F			1
+#define MAP_0F38		2
+#define AVX_LOAD		0x10
+#define AVX_STORE		0x11
+#define AVX_MOVAPD		0x28
+#define AVX_SQRT		0x51
+#define AVX_AND			0x54
+#define AVX_XOR			0x57
+#define AVX_ADD			0x58
+#define AVX_MUL			0x59
+#define AVX_SUB			0x5C
+#define AVX_DIV			0x5E
+#define AVX_BROADCAST	0x19 //vbroadcastsd, map 0F38
+
+//General purpose registers used for addressing
+#define REG_RAX 0
+#define REG_RSP 4
+#define REG_R12 12
+
+typedef struct
+{
+	uint8_t *data;
+	size_t size, capacity;
+	bool failed;
+} Assembler;
+
+
+
+static void Byte(Assembler *as, uint8_t byte)
+{
+	if (as->size == as->capacity)
+	{
+		size_t capacity = as->capacity ? as->capacity * 2 : 1024;
+		uint8_t *data = realloc(as->data, capacity);
+		if (!data)
+		{
+			as->failed = true;
+			return;
+		}
+		as->data = data;
+		as->capacity = capacity;
+	}
+	as->data[as->size++] = byte;
+}
+static void Bytes(Assembler *as, const void *bytes, size_t count)
+{
+	for (size_t i = 0; i < count; i++) Byte(as, ((const uint8_t *)bytes)[i]);
+}
+static void Imm32(Assembler *as, int32_t value) { Bytes(as, &value, sizeof(value)); }
+static void Imm64(Assembler *as, uint64_t value) { Bytes(as, &value, sizeof(value)); }
+
+//Three byte VEX prefix for 256 bit, 66 prefixed operations. r14 is the only index register used
+static void Vex(Assembler *as, int map, int reg, int src, int rm, bool index)
+{
+	Byte(as, 0xC4);
+	Byte(as, (reg < 8) << 7 | (!index) << 6 | (rm < 8) << 5 | map);
+	Byte(as, (~src & 15) << 3 | 0x05);
+}
+
+//op ymm(dst), ymm(src), ymm(rm)
+static void AvxRR(Assembler *as, uint8_t op, int dst, int src, int rm)
+{
+	Vex(as, MAP_0F, dst, src, rm, false);
+	Byte(as, op);
+	Byte(as, 0xC0 | (dst & 7) << 3 | (rm & 7));
+}
+//op ymm, [rsp+disp]
+static void AvxStack(Assembler *as, int map, uint8_t op, int ymm, int disp)
+{
+	Vex(as, map, ymm, 0, REG_RSP, false);
+	Byte(as, op);
+	Byte(as, 0x84 | (ymm & 7) << 3);
+	Byte(as, 0x24);
+	Imm32(as, disp);
+}
+//ymm = registers[slot][i], i in r14 (bytes)
+static void LoadVariable(Assembler *as, int ymm, int slot)
+{
+	//mov rax, [rbx+8*slot]
+	Bytes(as, "\x48\x8B\x83", 3);
+	Imm32(as, slot * sizeof(double *));
+	//vmovupd ymm, [rax+r14]
+	Vex(as, MAP_0F, ymm, 0, REG_RAX, true);
+	Byte(as, AVX_LOAD);
+	Byte(as, 0x04 | (ymm & 7) << 3);
+	Byte(as, 0x30);
+}
+//Broadcasts a 64 bit pattern to every lane
+static void LoadImmediate(Assembler *as, int ymm, uint64_t bits)
+{
+	//mov rax, imm64; mov [rsp+scratch], rax
+	Bytes(as, "\x48\xB8", 2);
+	Imm64(as, bits);
+	Bytes(as, "\x48\x89\x84\x24", 4);
+	Imm32(as, FRAME_SCRATCH);
+
+	AvxStack(as, MAP_0F38, AVX_BROADCAST, ymm, FRAME_SCRATCH);
+}
+//Broadcasts an entry of the constant pool, embedded in the code
+static void LoadConstant(Assembler *as, int ymm, double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	LoadImmediate(as, ymm, bits);
+}
+//ret[i] = ymm, ret in r12
+static void StoreResult(Assembler *as, int ymm)
+{
+	//vmovupd [r12+r14], ymm
+	Vex(as, MAP_0F, ymm, 0, REG_R12, true);
+	Byte(as, AVX_STORE);
+	Byte(as, 0x04 | (ymm & 7) << 3);
+	Byte(as, 0x34);
+}
+
+//Calls a kernel on the spill slots. Every ymm is caller saved, so all buffers go through memory
+static void CallKernel(Assembler *as, uintptr_t kernel, bool binary, int bufferHead, int depth)
+{
+	for (int i = 0; i < depth; i++) AvxStack(as, MAP_0F, AVX_STORE, YMM(i), i * LANE_BYTES);
+	//vzeroupper, the kernels may be plain SSE
+	Bytes(as, "\xC5\xF8\x77", 3);
+
+	//lea rdi, [rsp+a]
+	Bytes(as, "\x48\x8D\xBC\x24", 4);
+	Imm32(as, bufferHead * LANE_BYTES);
+	if (binary)
+	{
+		//lea rsi, [rsp+b]; mov edx, lanes
+		Bytes(as, "\x48\x8D\xB4\x24", 4);
+		Imm32(as, (bufferHead - 1) * LANE_BYTES);
+		Byte(as, 0xBA);
+	}
+	else Byte(as, 0xBE); //mov esi, lanes
+	Imm32(as, JIT_LANES);
+	//mov rax, kernel; call rax
+	Bytes(as, "\x48\xB8", 2);
+	Imm64(as, kernel);
+	Bytes(as, "\xFF\xD0", 2);
+
+	for (int i = 0; i < depth; i++) AvxStack(as, MAP_0F, AVX_LOAD, YMM(i), i * LANE_BYTES);
+}
+
+static void EmitBody(Assembler *as, const Formula *formula)
+{
+	const FormulaKernels *kernels = GetFormulaKernels();
+	const uint8_t *src = formula->code;
+	int srcHead = 0, bufferHead = 0, depth = formula->maxDepth;
+	uint8_t instruction;
+
+	//The BufferHead is known at every instruction, so seeks never reach the generated code
+	while ((instruction = src[srcHead++]) != FORMULA_RET)
+	{
+		int a = YMM(bufferHead), b = YMM(bufferHead - 1);
+
+		if (FORMULA_IS_VAR(instruction))
+		{
+			LoadVariable(as, a, instruction - FORMULA_VAR_BASE);
+			continue;
+		}
+
+		if (FORMULA_IS_FUSED(instruction))
+		{
+			if (instruction < FORMULA_ADD_VAR) LoadConstant(as, a, formula->constants[src[srcHead]]);
+			else LoadVariable(as, a, src[srcHead]);
+			srcHead++;
+			instruction = FORMULA_FUSED_BASE(instruction);
+		}
+
+		switch (instruction)
+		{
+			case FORMULA_NOP: break;
+
+			case FORMULA_LITERAL:
+			case FORMULA_CONSTANT:
+				LoadConstant(as, a, formula->constants[src[srcHead++]]);
+				break;
+
+			case FORMULA_CLIP_WRITE:
+				AvxStack(as, MAP_0F, AVX_STORE, a, FRAME_CLIP);
+				break;
+
+			case FORMULA_CLIP_READ:
+				AvxStack(as, MAP_0F, AVX_LOAD, a, FRAME_CLIP);
+				break;
+
+			case FORMULA_SEEK_LEFT:
+				bufferHead--;
+				break;
+
+			case FORMULA_SEEK_RIGHT:
+				bufferHead++;
+				break;
+
+			case FORMULA_COPY_LEFT:
+				AvxRR(as, AVX_MOVAPD, YMM(--bufferHead), 0, a);
+				break;
+
+			case FORMULA_COPY_RIGHT:
+				AvxRR(as, AVX_MOVAPD, YMM(++bufferHead), 0, a);
+				break;
+
+			//a = b op a
+			case FORMULA_ADD:
+				AvxRR(as, AVX_ADD, a, b, a);
+				break;
+
+			case FORMULA_SUBTRACT:
+				AvxRR(as, AVX_SUB, a, b, a);
+				break;
+
+			case FORMULA_MULTIPLY:
+				AvxRR(as, AVX_MUL, a, b, a);
+				break;
+
+			case FORMULA_DIVIDE:
+				AvxRR(as, AVX_DIV, a, b, a);
+				break;
+
+			case FORMULA_SQUARE:
+				AvxRR(as, AVX_MUL, a, a, a);
+				break;
+
+			case FORMULA_SQRT:
+				AvxRR(as, AVX_SQRT, a, 0, a);
+				break;
+
+			case FORMULA_ABS:
+				LoadImmediate(as, 0, 0x7FFFFFFFFFFFFFFFul);
+				AvxRR(as, AVX_AND, a, a, 0);
+				break;
+
+			case FORMULA_NEGATIVE:
+				LoadImmediate(as, 0, 0x8000000000000000ul);
+				AvxRR(as, AVX_XOR, a, a, 0);
+				break;
+
+			default:
+				//Everything else runs the interpreter's kernels
+				if (FORMULA_IS_BINARY(instruction))
+					CallKernel(as, (uintptr_t)kernels->binary[instruction], true, bufferHead, depth);
+				else
+					CallKernel(as, (uintptr_t)kernels->unary[instruction], false, bufferHead, depth);
+				break;
+		}
+	}
+
+	StoreResult(as, YMM(bufferHead));
+}
+
+static bool Assemble(const Formula *formula, Assembler *as)
+{
+	size_t loop;
+	int32_t rel;
+
+	//push rbx, r12-r15; sub rsp, FRAME_SIZE
+	Bytes(as, "\x53\x41\x54\x41\x55\x41\x56\x41\x57", 9);
+	Bytes(as, "\x48\x81\xEC", 3);
+	Imm32(as, FRAME_SIZE);
+	//rbx = registers, r12 = ret, r13 = len, r14 = offset
+	Bytes(as, "\x48\x89\xFB\x49\x89\xF4\x49\x89\xD5\x45\x31\xF6", 12);
+
+	loop = as->size;
+	//The clipboard starts at 0 for every point
+	AvxRR(as, AVX_XOR, 0, 0, 0);
+	AvxStack(as, MAP_0F, AVX_STORE, 0, FRAME_CLIP);
+
+	EmitBody(as, formula);
+
+	//add r14, lane bytes; cmp r14, r13; jb loop
+	Bytes(as, "\x49\x83\xC6", 3);
+	Byte(as, LANE_BYTES);
+	Bytes(as, "\x4D\x39\xEE\x0F\x82", 5);
+	rel = loop - (as->size + 4);
+	Imm32(as, rel);
+
+	//vzeroupper; add rsp, FRAME_SIZE; pop r15-r12, rbx; ret
+	Bytes(as, "\xC5\xF8\x77\x48\x81\xC4", 6);
+	Imm32(as, FRAME_SIZE);
+	Bytes(as, "\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5B\xC3", 10);
+
+	return !as->failed;
+}
+
+
+
+bool CompileFormulaJit(const Formula *formula, FormulaJit *jit)
+{
+	Assembler as = { .data = NULL, .size = 0, .capacity = 0, .failed = false };
+
+	jit->run = NULL;
+	jit->code = NULL;
+	jit->size = 0;
+	jit->slotC = formula->slotC;
+
+	if (!formula->verified || formula->maxDepth > JIT_MAX_DEPTH) return false;
+
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("avx")) return false;
+
+	if (!Assemble(formula, &as))
+	{
+		free(as.data);
+		return false;
+	}
+
+	//Written while writable, then flipped to executable
+	void *code = mmap(NULL, as.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED)
+	{
+		free(as.data);
+		return false;
+	}
+	memcpy(code, as.data, as.size);
+	free(as.data);
+
+	if (mprotect(code, as.size, PROT_READ | PROT_EXEC))
+	{
+		munmap(code, as.size);
+		return false;
+	}
+
+	jit->code = code;
+	jit->size = as.size;
+	jit->run = (JitFunction)code;
+	return true;
+}
+
+void FreeFormulaJit(FormulaJit *jit)
+{
+	if (jit->code) munmap(jit->code, jit->size);
+	jit->run = NULL;
+	jit->code = NULL;
+	jit->size = 0;
+}
+
+#else
+
+bool CompileFormulaJit(const Formula *formula, FormulaJit *jit)
+{
+	jit->run = NULL;
+	jit->code = NULL;
+	jit->size = 0;
+	jit->slotC = formula->slotC;
+	return false;
+}
+
+void FreeFormulaJit(FormulaJit *jit)
+{
+	(void)jit;
+}
+
+#endif
+
+
+
+bool EvaluateFormulaJit(const FormulaJit *jit, const double *const *registers, int count, double *ret, bool *valid)
+{
+	if (!jit->run)
+	{
+		memset(valid, 0, count * sizeof(bool));
+		return false;
+	}
+
+	int full = count - count % JIT_LANES;
+	if (full) jit->run(registers, ret, full * sizeof(double));
+
+	//The last partial block runs through padded copies of its registers
+	if (count != full)
+	{
+		double lanes[MAX_SLOTS][JIT_LANES] = { 0 }, out[JIT_LANES];
+		const double *tail[MAX_SLOTS];
+
+		for (int i = 0; i < jit->slotC; i++)
+		{
+			memcpy(lanes[i], registers[i] + full, (count - full) * sizeof(double));
+			tail[i] = lanes[i];
+		}
+		jit->run(tail, out, sizeof(out));
+		memcpy(ret + full, out, (count - full) * sizeof(double));
+	}
+
+	for (int i = 0; i < count; i++) valid[i] = isfinite(ret[i]);
+
+	return true;
+}
@@ -0,0 +1,34 @@
+//jit.h - Native x86-64 code generation for compiled formulas
+
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+
+#include "formulas.h"
+
+//Buffers live in ymm2-ymm15, formulas using more fall back to the interpreter
+#define JIT_MAX_DEPTH 14
+#define JIT_LANES 4
+
+//Generated code evaluates JIT_LANES points per iteration for len bytes of each register
+typedef void (*JitFunction)(const double *const *registers, double *ret, long len);
+
+typedef struct
+{
+	JitFunction run;
+	void *code;
+	size_t size;
+	int slotC;
+} FormulaJit;
+
+
+//Translates a verified formula. Returns false if the formula or the CPU (AVX) is not supported
+bool CompileFormulaJit(const Formula *formula, FormulaJit *jit);
+
+//Same contract as EvaluateFormulaBatch
+bool EvaluateFormulaJit(const FormulaJit *jit, const double *const *registers, int count, double *ret, bool *valid);
+
+void FreeFormulaJit(FormulaJit *jit);
+
+#endif
@@ -0,0 +1,243 @@
+//kernels.c -
+
+#include <math.h>
+#include <float.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+
+
+//Scalar kernels, also used for operations without a vector version
+static void AddScalar(double *a, const double *b, int n)		{ for (int i = 0; i < n; i++) a[i] = b[i] + a[i]; }
+static void SubtractScalar(double *a, const double *b, int n)	{ for (int i = 0; i < n; i++) a[i] = b[i] - a[i]; }
+static void MultiplyScalar(double *a, const double *b, int n)	{ for (int i = 0; i < n; i++) a[i] = b[i] * a[i]; }
+static void DivideScalar(double *a, const double *b, int n)		{ for (int i = 0; i < n; i++) a[i] = b[i] / a[i]; }
+static void RemainderScalar(double *a, const double *b, int n)	{ for (int i = 0; i < n; i++) a[i] = fmod(b[i], a[i]); }
+static void PowScalar(double *a, const double *b, int n)		{ for (int i = 0; i < n; i++) a[i] = pow(b[i], a[i]); }
+
+static void SquareScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] *= a[i]; }
+static void SqrtScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = sqrt(a[i]); }
+static void LogNScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = log(a[i]); }
+static void LogDScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = log10(a[i]); }
+static void LogBScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = log2(a[i]); }
+static void AbsScalar(double *a, int n)			{ for (int i = 0; i < n; i++) a[i] = fabs(a[i]); }
+static void SinScalar(double *a, int n)			{ for (int i = 0; i < n; i++) a[i] = sin(a[i]); }
+static void CosScalar(double *a, int n)			{ for (int i = 0; i < n; i++) a[i] = cos(a[i]); }
+static void TanScalar(double *a, int n)			{ for (int i = 0; i < n; i++) a[i] = tan(a[i]); }
+static void AsinScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = asin(a[i]); }
+static void AcosScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = acos(a[i]); }
+static void AtanScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = atan(a[i]); }
+static void SinhScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = sinh(a[i]); }
+static void CoshScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = cosh(a[i]); }
+static void TanhScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = tanh(a[i]); }
+static void AsinhScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = asinh(a[i]); }
+static void AcoshScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = acosh(a[i]); }
+static void AtanhScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = atanh(a[i]); }
+static void SignScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = a[i] == 0.0 ? 0.0 : (a[i] > 0.0 ? 1.0 : -1.0); }
+static void CeilScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = ceil(a[i]); }
+static void FloorScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = floor(a[i]); }
+static void RoundScalar(double *a, int n)		{ for (int i = 0; i < n; i++) a[i] = round(a[i]); }
+static void NegativeScalar(double *a, int n)	{ for (int i = 0; i < n; i++) a[i] = -a[i]; }
+
+static const FormulaKernels _scalarKernels = {
+	.name = "scalar",
+	.binary = {
+		[FORMULA_ADD] = AddScalar,
+		[FORMULA_SUBTRACT] = SubtractScalar,
+		[FORMULA_MULTIPLY] = MultiplyScalar,
+		[FORMULA_DIVIDE] = DivideScalar,
+		[FORMULA_REMAINDER] = RemainderScalar,
+		[FORMULA_POW] = PowScalar,
+	},
+	.unary = {
+		[FORMULA_SQUARE] = SquareScalar,
+		[FORMULA_SQRT] = SqrtScalar,
+		[FORMULA_LOGN] = LogNScalar,
+		[FORMULA_LOGD] = LogDScalar,
+		[FORMULA_LOGB] = LogBScalar,
+		[FORMULA_ABS] = AbsScalar,
+		[FORMULA_SIN] = SinScalar,
+		[FORMULA_COS] = CosScalar,
+		[FORMULA_TAN] = TanScalar,
+		[FORMULA_ASIN] = AsinScalar,
+		[FORMULA_ACOS] = AcosScalar,
+		[FORMULA_ATAN] = AtanScalar,
+		[FORMULA_SINH] = SinhScalar,
+		[FORMULA_COSH] = CoshScalar,
+		[FORMULA_TANH] = TanhScalar,
+		[FORMULA_ASINH] = AsinhScalar,
+		[FORMULA_ACOSH] = AcoshScalar,
+		[FORMULA_ATANH] = AtanhScalar,
+		[FORMULA_SIGN] = SignScalar,
+		[FORMULA_CEIL] = CeilScalar,
+		[FORMULA_FLOOR] = FloorScalar,
+		[FORMULA_ROUND] = RoundScalar,
+		[FORMULA_NEGATIVE] = NegativeScalar,
+	},
+};
+
+
+
+#ifdef KERNELS_X86
+
+//Vector math approximations follow the Cephes library
+#define VEC_MAGIC 0x1.8p52 //Adding it puts small whole numbers in the low mantissa bits
+#define EXP_C1 6.93145751953125E-1
+#define EXP_C2 1.42860682030941723212E-6
+#define EXP_MAX 709.782712893384
+#define EXP_MIN -708.0
+#define POW_FAST_MAX 709.0 //exp(x log(y)) outside these is left to libm, which rounds the overflow edge exactly and underflows gradually
+#define POW_FAST_MIN EXP_MIN
+#define LOG_C1 0.693359375
+#define LOG_C2 2.121944400546905827679e-4
+#define SINCOS_DP1 7.85398125648498535156E-1
+#define SINCOS_DP2 3.77489470793079817668E-8
+#define SINCOS_DP3 2.69515142907905952645E-15
+#define SINCOS_MAX 1.0e8
+
+static const double _expP[] = {
+	1.26177193074810590878E-4, 3.02994407707441961300E-2, 9.99999999999999999910E-1 };
+static const double _expQ[] = {
+	3.00198505138664455042E-6, 2.52448340349684104192E-3, 2.27265548208155028766E-1, 2.00000000000000000009E0 };
+static const double _logP[] = {
+	1.01875663804580931796E-4, 4.97494994976747001425E-1, 4.70579119878881725854E0,
+	1.44989225341610930846E1, 1.79368678507819816313E1, 7.70838733755885391666E0 };
+static const double _logQ[] = {
+	1.12873587189167450590E1, 4.52279145837532221105E1, 8.29875266912776603211E1,
+	7.11544750618563894466E1, 2.31251620126765340583E1 };
+static const double _sinP[] = {
+	1.58962301576546568060E-10, -2.50507477628578072866E-8, 2.75573136213857245213E-6,
+	-1.98412698295895385996E-4, 8.33333333332211858878E-3, -1.66666666666666307295E-1 };
+static const double _cosP[] = {
+	-1.13585365213876817300E-11, 2.08757008419747316778E-9, -2.75573141792967388112E-7,
+	2.48015872888517045348E-5, -1.38888888888730564116E-3, 4.16666666666665929218E-2 };
+
+//SSE4.1, 2 lanes
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+
+#define VD __m128d
+#define VI __m128i
+#define VLANES 2
+#define VNAME "SSE4.1"
+#define VSUFFIX(name) name##Sse4
+#define VLOAD _mm_loadu_pd
+#define VSTORE _mm_storeu_pd
+#define VSET _mm_set1_pd
+#define VSETI _mm_set1_epi64x
+#define VADD _mm_add_pd
+#define VSUB _mm_sub_pd
+#define VMUL _mm_mul_pd
+#define VDIV _mm_div_pd
+#define VSQRT _mm_sqrt_pd
+#define VAND _mm_and_pd
+#define VANDNOT _mm_andnot_pd
+#define VOR _mm_or_pd
+#define VXOR _mm_xor_pd
+#define VBLEND _mm_blendv_pd
+#define VLT _mm_cmplt_pd
+#define VGT _mm_cmpgt_pd
+#define VGE _mm_cmpge_pd
+#define VEQ _mm_cmpeq_pd
+#define VNGE _mm_cmpnge_pd
+#define VMASK _mm_movemask_pd
+#define VFLOOR _mm_floor_pd
+#define VCEIL _mm_ceil_pd
+#define VTRUNC(x) _mm_round_pd(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC)
+#define VASI _mm_castpd_si128
+#define VASD _mm_castsi128_pd
+#define VIADD _mm_add_epi64
+#define VISUB _mm_sub_epi64
+#define VIAND _mm_and_si128
+#define VIOR _mm_or_si128
+#define VISRL _mm_srli_epi64
+#define VISLL _mm_slli_epi64
+
+#include "kernels_simd.h"
+
+#pragma GCC pop_options
+
+//AVX2, 4 lanes
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+#define VD __m256d
+#define VI __m256i
+#define VLANES 4
+#define VNAME "AVX2"
+#define VSUFFIX(name) name##Avx2
+#define VLOAD _mm256_loadu_pd
+#define VSTORE _mm256_storeu_pd
+#define VSET _mm256_set1_pd
+#define VSETI _mm256_set1_epi64x
+#define VADD _mm256_add_pd
+#define VSUB _mm256_sub_pd
+#define VMUL _mm256_mul_pd
+#define VDIV _mm256_div_pd
+#define VSQRT _mm256_sqrt_pd
+#define VAND _mm256_and_pd
+#define VANDNOT _mm256_andnot_pd
+#define VOR _mm256_or_pd
+#define VXOR _mm256_xor_pd
+#define VBLEND _mm256_blendv_pd
+#define VLT(a, b) _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define VGT(a, b) _mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#define VGE(a, b) _mm256_cmp_pd(a, b, _CMP_GE_OQ)
+#define VEQ(a, b) _mm256_cmp_pd(a, b, _CMP_EQ_OQ)
+#define VNGE(a, b) _mm256_cmp_pd(a, b, _CMP_NGE_UQ)
+#define VMASK _mm256_movemask_pd
+#define VFLOOR _mm256_floor_pd
+#define VCEIL _mm256_ceil_pd
+#define VTRUNC(x) _mm256_round_pd(x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC)
+#define VASI _mm256_castpd_si256
+#define VASD _mm256_castsi256_pd
+#define VIADD _mm256_add_epi64
+#define VISUB _mm256_sub_epi64
+#define VIAND _mm256_and_si256
+#define VIOR _mm256_or_si256
+#define VISRL _mm256_srli_epi64
+#define VISLL _mm256_slli_epi64
+
+#include "kernels_simd.h"
+
+#pragma GCC pop_options
+
+#endif
+
+
+
+static pthread_once_t _kernelsOnce = PTHREAD_ONCE_INIT;
+static const FormulaKernels *_selected = &_scalarKernels;
+static FormulaKernels _vector;
+
+//Runs once under pthread_once, so threads asking at the same time all see a filled table
+static void SelectKernels()
+{
+#ifdef KERNELS_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		FillKernelsAvx2(&_vector);
+		_selected = &_vector;
+	}
+	else if (__builtin_cpu_supports("sse4.1"))
+	{
+		FillKernelsSse4(&_vector);
+		_selected = &_vector;
+	}
+#endif
+}
+
+const FormulaKernels *GetFormulaKernels()
+{
+	pthread_once(&_kernelsOnce, SelectKernels);
+	return _selected;
+}
@@ -0,0 +1,23 @@
+//kernels.h - Batched math kernels used by the formula interpreter
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include "formulas.h"
+
+//Unary kernels compute a = op(a), binary kernels compute a = b op a
+typedef void (*UnaryKernel)(double *a, int n);
+typedef void (*BinaryKernel)(double *a, const double *b, int n);
+
+typedef struct
+{
+	const char *name;
+	BinaryKernel binary[FORMULA_OP_COUNT];
+	UnaryKernel unary[FORMULA_OP_COUNT];
+} FormulaKernels;
+
+
+//Picks the widest kernel set supported by the running CPU on first call, safe to call from any thread
+const FormulaKernels *GetFormulaKernels();
+
+#endif
@@ -0,0 +1,299 @@
+//kernels_simd.h - Vector kernel bodies, included by kernels.c once per instruction set
+//The includer defines the V* macros for its lane type, they are undefined again at the end
+
+//Full blocks are loaded straight from the buffers, the tail goes through a zeroed lane array
+#define VUNARY(name, expr) \
+	static void VSUFFIX(name)(double *a, int n) \
+	{ \
+		int i = 0; \
+		for (; i + VLANES <= n; i += VLANES) \
+		{ \
+			VD x = VLOAD(a + i); \
+			VSTORE(a + i, (expr)); \
+		} \
+		if (i < n) \
+		{ \
+			double lane[VLANES] = { 0 }; \
+			memcpy(lane, a + i, (n - i) * sizeof(double)); \
+			VD x = VLOAD(lane); \
+			VSTORE(lane, (expr)); \
+			memcpy(a + i, lane, (n - i) * sizeof(double)); \
+		} \
+	}
+
+#define VBINARY(name, expr) \
+	static void VSUFFIX(name)(double *a, const double *b, int n) \
+	{ \
+		int i = 0; \
+		for (; i + VLANES <= n; i += VLANES) \
+		{ \
+			VD x = VLOAD(a + i), y = VLOAD(b + i); \
+			VSTORE(a + i, (expr)); \
+		} \
+		for (; i < n; i++) \
+		{ \
+			VD x = VSET(a[i]), y = VSET(b[i]); \
+			double lane[VLANES]; \
+			VSTORE(lane, (expr)); \
+			a[i] = lane[0]; \
+		} \
+	}
+
+
+
+static inline VD VSUFFIX(Horner)(VD x, const double *coef, int count)
+{
+	VD p = VSET(coef[0]);
+	for (int i = 1; i < count; i++) p = VADD(VMUL(p, x), VSET(coef[i]));
+	return p;
+}
+//Same as Horner with an implicit leading coefficient of 1
+static inline VD VSUFFIX(Horner1)(VD x, const double *coef, int count)
+{
+	VD p = VADD(x, VSET(coef[0]));
+	for (int i = 1; i < count; i++) p = VADD(VMUL(p, x), VSET(coef[i]));
+	return p;
+}
+
+//Integer part of a double holding a whole number, as 64 bit lanes
+static inline VI VSUFFIX(ToInt)(VD x)
+{
+	return VISUB(VASI(VADD(x, VSET(VEC_MAGIC))), VASI(VSET(VEC_MAGIC)));
+}
+static inline VD VSUFFIX(ToDouble)(VI x)
+{
+	return VSUB(VASD(VIADD(x, VASI(VSET(VEC_MAGIC)))), VSET(VEC_MAGIC));
+}
+
+
+//Recomputes lanes whose argument is beyond limit with the libm function
+static inline VD VSUFFIX(Fallback)(VD x, VD r, double limit, double (*fn)(double))
+{
+	if (!VMASK(VGT(VANDNOT(VSET(-0.0), x), VSET(limit)))) return r;
+
+	double in[VLANES], out[VLANES];
+	VSTORE(in, x);
+	VSTORE(out, r);
+	for (int k = 0; k < VLANES; k++)
+		if (fabs(in[k]) > limit) out[k] = fn(in[k]);
+
+	return VLOAD(out);
+}
+
+
+
+static inline VD VSUFFIX(VecExp)(VD x)
+{
+	//x = n ln2 + r, e^r from a Pade approximant and 2^n built in the exponent bits
+	VD n = VFLOOR(VADD(VMUL(x, VSET(M_LOG2E)), VSET(0.5)));
+	VD r = VSUB(VSUB(x, VMUL(n, VSET(EXP_C1))), VMUL(n, VSET(EXP_C2)));
+	VD rr = VMUL(r, r);
+	VD px = VMUL(r, VSUFFIX(Horner)(rr, _expP, 3));
+	r = VDIV(px, VSUB(VSUFFIX(Horner)(rr, _expQ, 4), px));
+	r = VADD(VSET(1.0), VADD(r, r));
+
+	//2^(n-1) * 2 keeps n = 1024 at the overflow edge inside the exponent range
+	VI bits = VISLL(VIADD(VSUFFIX(ToInt)(n), VSETI(1022)), 52);
+	r = VMUL(VMUL(r, VASD(bits)), VSET(2.0));
+
+	r = VBLEND(r, VSET(INFINITY), VGT(x, VSET(EXP_MAX)));
+	return VBLEND(r, VSET(0.0), VLT(x, VSET(EXP_MIN)));
+}
+
+static inline VD VSUFFIX(VecLog)(VD x)
+{
+	//x = m 2^e with m in [sqrt(1/2), sqrt(2)), log(m) from a rational approximation
+	VD subnormal = VLT(x, VSET(DBL_MIN));
+	VI bits = VASI(VBLEND(x, VMUL(x, VSET(0x1p54)), subnormal));
+	VD e = VSUFFIX(ToDouble)(VISRL(bits, 52));
+	VD m = VASD(VIOR(VIAND(bits, VSETI(0x000FFFFFFFFFFFFFll)), VSETI(0x3FE0000000000000ll)));
+	VD small = VLT(m, VSET(M_SQRT1_2));
+	e = VSUB(e, VADD(VSET(1022.0), VAND(small, VSET(1.0))));
+	e = VSUB(e, VAND(subnormal, VSET(54.0)));
+	VD f = VSUB(VADD(m, VAND(small, m)), VSET(1.0));
+
+	VD z = VMUL(f, f);
+	VD y = VMUL(f, VDIV(VMUL(z, VSUFFIX(Horner)(f, _logP, 6)), VSUFFIX(Horner1)(f, _logQ, 5)));
+	y = VSUB(y, VMUL(e, VSET(LOG_C2)));
+	y = VSUB(y, VMUL(z, VSET(0.5)));
+	z = VADD(VADD(f, y), VMUL(e, VSET(LOG_C1)));
+
+	z = VBLEND(z, VSET(-INFINITY), VEQ(x, VSET(0.0)));
+	z = VBLEND(z, VSET(INFINITY), VEQ(x, VSET(INFINITY)));
+	return VBLEND(z, VSET(NAN), VNGE(x, VSET(0.0)));
+}
+
+//|x| = j pi/4 + z with j even and |z| <= pi/4, exact for |x| up to SINCOS_MAX
+static inline VD VSUFFIX(VecReduce)(VD ax, VI *j)
+{
+	VI q = VSUFFIX(ToInt)(VFLOOR(VMUL(ax, VSET(4.0 / M_PI))));
+	q = VIAND(VIADD(q, VSETI(1)), VSETI(~1ll));
+	*j = q;
+
+	VD y = VSUFFIX(ToDouble)(q);
+	return VSUB(VSUB(VSUB(ax, VMUL(y, VSET(SINCOS_DP1))), VMUL(y, VSET(SINCOS_DP2))), VMUL(y, VSET(SINCOS_DP3)));
+}
+
+//sin(j pi/4 + z), bit 1 of j picks the polynomial and bit 2 the sign
+static inline VD VSUFFIX(VecOctant)(VD z, VI j)
+{
+	VD zz = VMUL(z, z);
+	VD s = VADD(z, VMUL(VMUL(z, zz), VSUFFIX(Horner)(zz, _sinP, 6)));
+	VD c = VADD(VSUB(VSET(1.0), VMUL(zz, VSET(0.5))), VMUL(VMUL(zz, zz), VSUFFIX(Horner)(zz, _cosP, 6)));
+
+	VD r = VBLEND(s, c, VASD(VISLL(j, 62)));
+	return VXOR(r, VAND(VASD(VISLL(j, 61)), VSET(-0.0)));
+}
+
+static inline VD VSUFFIX(VecSin)(VD x)
+{
+	VI j;
+	VD z = VSUFFIX(VecReduce)(VANDNOT(VSET(-0.0), x), &j);
+	return VXOR(VSUFFIX(VecOctant)(z, j), VAND(x, VSET(-0.0)));
+}
+
+static inline VD VSUFFIX(VecCos)(VD x)
+{
+	VI j;
+	VD z = VSUFFIX(VecReduce)(VANDNOT(VSET(-0.0), x), &j);
+	return VSUFFIX(VecOctant)(z, VIADD(j, VSETI(2)));
+}
+
+static inline VD VSUFFIX(VecTan)(VD x)
+{
+	VI j;
+	VD z = VSUFFIX(VecReduce)(VANDNOT(VSET(-0.0), x), &j);
+	VD s = VSUFFIX(VecOctant)(z, j), c = VSUFFIX(VecOctant)(z, VIADD(j, VSETI(2)));
+	return VXOR(VDIV(s, c), VAND(x, VSET(-0.0)));
+}
+
+static inline VD VSUFFIX(VecRound)(VD x)
+{
+	//Half way cases go away from zero, like round()
+	VD t = VTRUNC(x);
+	VD away = VGE(VANDNOT(VSET(-0.0), VSUB(x, t)), VSET(0.5));
+	return VADD(t, VAND(away, VOR(VSET(1.0), VAND(x, VSET(-0.0)))));
+}
+
+static inline VD VSUFFIX(VecSign)(VD x)
+{
+	VD r = VBLEND(VSET(-1.0), VSET(1.0), VGT(x, VSET(0.0)));
+	return VBLEND(r, VSET(0.0), VEQ(x, VSET(0.0)));
+}
+
+
+
+VBINARY(AddVector, VADD(y, x))
+VBINARY(SubtractVector, VSUB(y, x))
+VBINARY(MultiplyVector, VMUL(y, x))
+VBINARY(DivideVector, VDIV(y, x))
+
+static void VSUFFIX(PowVector)(double *a, const double *b, int n)
+{
+	int i = 0;
+	for (; i + VLANES <= n; i += VLANES)
+	{
+		VD x = VLOAD(a + i), y = VLOAD(b + i);
+
+		//exp(x log(y)) only holds for finite positive bases and finite exponents
+		int fast = VMASK(VAND(VAND(VGT(y, VSET(0.0)), VLT(y, VSET(INFINITY))),
+			VLT(VANDNOT(VSET(-0.0), x), VSET(INFINITY))));
+
+		if (fast == (1 << VLANES) - 1)
+		{
+			//Results that overflow or turn subnormal have to match libm, so validity is the same on every path
+			VD p = VMUL(x, VSUFFIX(VecLog)(y));
+			if (VMASK(VAND(VLT(p, VSET(POW_FAST_MAX)), VGT(p, VSET(POW_FAST_MIN)))) == (1 << VLANES) - 1)
+			{
+				VSTORE(a + i, VSUFFIX(VecExp)(p));
+				continue;
+			}
+		}
+
+		for (int k = 0; k < VLANES; k++) a[i + k] = pow(b[i + k], a[i + k]);
+	}
+	for (; i < n; i++) a[i] = pow(b[i], a[i]);
+}
+
+VUNARY(SquareVector, VMUL(x, x))
+VUNARY(SqrtVector, VSQRT(x))
+VUNARY(LogNVector, VSUFFIX(VecLog)(x))
+VUNARY(LogDVector, VMUL(VSUFFIX(VecLog)(x), VSET(1.0 / M_LN10)))
+VUNARY(LogBVector, VMUL(VSUFFIX(VecLog)(x), VSET(1.0 / M_LN2)))
+VUNARY(AbsVector, VANDNOT(VSET(-0.0), x))
+VUNARY(SinVector, VSUFFIX(Fallback)(x, VSUFFIX(VecSin)(x), SINCOS_MAX, sin))
+VUNARY(CosVector, VSUFFIX(Fallback)(x, VSUFFIX(VecCos)(x), SINCOS_MAX, cos))
+VUNARY(TanVector, VSUFFIX(Fallback)(x, VSUFFIX(VecTan)(x), SINCOS_MAX, tan))
+VUNARY(SignVector, VSUFFIX(VecSign)(x))
+VUNARY(CeilVector, VCEIL(x))
+VUNARY(FloorVector, VFLOOR(x))
+VUNARY(RoundVector, VSUFFIX(VecRound)(x))
+VUNARY(NegativeVector, VXOR(x, VSET(-0.0)))
+
+static void VSUFFIX(FillKernels)(FormulaKernels *kernels)
+{
+	*kernels = _scalarKernels;
+	kernels->name = VNAME;
+
+	kernels->binary[FORMULA_ADD] = VSUFFIX(AddVector);
+	kernels->binary[FORMULA_SUBTRACT] = VSUFFIX(SubtractVector);
+	kernels->binary[FORMULA_MULTIPLY] = VSUFFIX(MultiplyVector);
+	kernels->binary[FORMULA_DIVIDE] = VSUFFIX(DivideVector);
+	kernels->binary[FORMULA_POW] = VSUFFIX(PowVector);
+
+	kernels->unary[FORMULA_SQUARE] = VSUFFIX(SquareVector);
+	kernels->unary[FORMULA_SQRT] = VSUFFIX(SqrtVector);
+	kernels->unary[FORMULA_LOGN] = VSUFFIX(LogNVector);
+	kernels->unary[FORMULA_LOGD] = VSUFFIX(LogDVector);
+	kernels->unary[FORMULA_LOGB] = VSUFFIX(LogBVector);
+	kernels->unary[FORMULA_ABS] = VSUFFIX(AbsVector);
+	kernels->unary[FORMULA_SIN] = VSUFFIX(SinVector);
+	kernels->unary[FORMULA_COS] = VSUFFIX(CosVector);
+	kernels->unary[FORMULA_TAN] = VSUFFIX(TanVector);
+	kernels->unary[FORMULA_SIGN] = VSUFFIX(SignVector);
+	kernels->unary[FORMULA_CEIL] = VSUFFIX(CeilVector);
+	kernels->unary[FORMULA_FLOOR] = VSUFFIX(FloorVector);
+	kernels->unary[FORMULA_ROUND] = VSUFFIX(RoundVector);
+	kernels->unary[FORMULA_NEGATIVE] = VSUFFIX(NegativeVector);
+}
+
+
+
+#undef VUNARY
+#undef VBINARY
+#undef VNAME
+#undef VD
+#undef VI
+#undef VLANES
+#undef VSUFFIX
+#undef VLOAD
+#undef VSTORE
+#undef VSET
+#undef VSETI
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VDIV
+#undef VSQRT
+#undef VAND
+#undef VANDNOT
+#undef VOR
+#undef VXOR
+#undef VBLEND
+#undef VLT
+#undef VGT
+#undef VGE
+#undef VEQ
+#undef VNGE
+#undef VMASK
+#undef VFLOOR
+#undef VCEIL
+#undef VTRUNC
+#undef VASI
+#undef VASD
+#undef VIADD
+#undef VISUB
+#undef VIAND
+#undef VIOR
+#undef VISRL
+#undef VISLL
@@ -8,12 +8,29 @@
 #include <math.h>
 #include <errno.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <poll.h>
 
 #include "raylib.h"
 
 #include "formulas.h"
+#include "kernels.h"
+#include "jit.h"
+#include "aot.h"
+#include "threads.h"
+#include "coverage.h"
+#include "raster.h"
+#include "field.h"
+#include "occupancy.h"
+#include "region.h"
+#include "export.h"
+#include "polyline.h"
+#include "glyphs.h"
+#include "server.h"
+#include "tilecache.h"
 
-//TODO: Verify formula before computing
 //TODO: More visualization settings via command line
 //TODO: MAX filter when scaling down
 //FIXME: Slanted texture display when unknown condition
@@ -22,20 +39,46 @@
 #define DEFAULT_FORMULA "y>t+>y>t-[/"
 #define DEFAULT_PX_WIDTH 512
 #define DEFAULT_SAMPLE_POW 0
+#define DEFAULT_ANTIALIAS false
 #define DEFAULT_DRAW_FLAGS DRAW_VECTORS | DRAW_LEFT_EDGE_LINES | DRAW_RIGHT_EDGE_LINES
 #define DEFAULT_DSP_RANGE 1.0
 #define DEFAULT_PRINT_PERF false
+#define DEFAULT_ENGINE ENGINE_INTERP
+#define DEFAULT_INTEGRATOR INTEGRATOR_EULER
+#define DEFAULT_LAYOUT LAYOUT_EDGES
+#define DEFAULT_TOLERANCE 1e-4
+#define DEFAULT_GRID_CELLS 0
+#define DEFAULT_CULLING true
+#define DEFAULT_HEADLESS false
+#define DEFAULT_BUDGET 0.0
 
 //Formula settings
-#define MAX_FORMULA 4096
 #define MAX_FORMULA_SRC MAX_FORMULA * MAX_FUNCTION_NAME
 
+//Evaluation engines
+#define ENGINE_INTERP 0
+#define ENGINE_JIT 1
+#define ENGINE_AOT 2
+
+//Line integrators
+#define INTEGRATOR_EULER 0
+#define INTEGRATOR_RK4 1
+#define INTEGRATOR_RK45 2
+#define INTEGRATOR_STIFF 3
+
+//Line layouts
+#define LAYOUT_EDGES 0
+#define LAYOUT_EVEN 1
+
 //Vector settings
 #define DRAW_VECTORS 0b1
 #define VECTOR_STEP 0.05
 #define VECTOR_LENGTH 0.02
 #define UNDEF_RADIUS 2.0
 #define FLAT_MARGIN 0.01
+#define VECTOR_TILES_PER_THREAD 4
+#define VECTOR_GLYPH_BINS 256 //Slope angles vectors are drawn at, when they are stamped from sprites
+#define VECTOR_GLYPH_MAX 48 //Largest sprite, from its origin to its edge. Longer vectors are drawn one by one
 
 //Line settings
 #define DRAW_CENTRAL_LINES 0b10
@@ -45,34 +88,352 @@
 #define LINE_STEP 0.001
 #define LINE_RANGE_EXTEND 20
 #define MAX_DERIV 40
+#define MAX_SWEEPS 4
+#define LINE_BUNDLE FORMULA_BATCH
+#define LINE_RK4_STRIDE 16 //Euler steps covered by one RK4 step
+#define LINE_MAX_SEGMENT 8.0 //Longest visible RK45 step, in pixels
+#define LINE_MAX_STEP 256 //Longest RK45 step, in Euler steps
+#define LINE_MIN_STEP_DIV 1024 //Adaptive steps give up below LINE_STEP / LINE_MIN_STEP_DIV
+#define LINE_NEWTON_ITERATIONS 6 //Per implicit step, steps that have not converged are retried shorter
+#define LINE_SIMPLIFY 0.25 //Pixels a drawn curve may stray from its integrated points
+#define LINE_RUN_POINTS 4096 //Longer runs of visible steps are simplified and drawn in pieces
+
+//Slope grid settings
+#define GRID_MIN_CELLS 8
+#define GRID_MAX_CELLS 512 //Across the display, the grid also covers the LINE_RANGE_EXTEND above and below it
+
+//Region culling settings
+#define REGION_DEPTH 6 //Roots are split into 1 << REGION_DEPTH leaves a side
+
+//Evenly spaced line settings, lengths in display ranges
+#define EVEN_SEPARATION 0.035
+#define EVEN_TEST_RATIO 0.5 //Lines stop once this fraction of the separation away from others
+#define EVEN_STEP 0.002 //Arc length of one Euler step
+#define EVEN_SEED_STRIDE 8 //Points between the seeds every line offers on each side
+#define EVEN_MAX_POINTS (1 << 20) //Per direction, in case a curve winds forever
 
 //Export settings
 #define MAX_PATH 4096
+#define MAX_PX_WIDTH 4096
+#define MIN_DSP_RANGE 0.001
+#define MAX_DSP_RANGE 1000.0
+#define MANIFEST_LINE (MAX_PATH + MAX_FORMULA_SRC + 64) //Path, width, range, draw flags and formula, with room to spare
+#define JOB_ERROR 256
+
+//Daemon
+#define FORMULA_CACHE 16 //Formulas kept compiled besides the one in use
+#define DAEMON_CLIENTS 64 //Connections open at once, more wait in the listen backlog
+
+//Budget
+#define QUALITY_LEVELS 8
+#define MIN_BUDGET 1.0
+#define MAX_BUDGET 60000.0
+#define BUDGET_COST_WEIGHT 0.5 //Share of the last render in the learned costs, the rest is what earlier ones measured
+#define BUDGET_TOLERANCE_ORDER 5.0 //Adaptive steps grow with the tolerance to the power 1 / this
+#define BUDGET_PROBE_WIDTH 256 //Pixels a side of the render that measures costs before the first pick
+
+//View
+#define VIEW_TILE 256 //Output pixels a side of a cached tile
+#define VIEW_CACHE 384 //Tiles kept across every zoom level, more than a 4096px window shows
+#define VIEW_ZOOM_STEP M_SQRT2 //Range shrinks by this per wheel notch
+#define VIEW_FALLBACK_LEVELS 4 //Levels looked through either way for rescaled tiles while sharp ones render
+#define VIEW_MAX_TILES ((MAX_PX_WIDTH / VIEW_TILE + 2) * (MAX_PX_WIDTH / VIEW_TILE + 2)) //Visible at once on the widest window
+#define VIEW_DRAFT_VECTOR_STEP 2 //Draft tiles space vectors this many times further apart
+#define VIEW_DRAFT_LINE_SPACING 4 //Draft lines are seeded this many times further apart
+#define VIEW_SETTLE_MS 200.0 //Lines are traced again once the view has been still this long, moving sooner would only cancel them
+#define VIEW_FPS 60
+#define VIEW_VECTOR_SPACING 4.0 //Fewest output pixels between vectors, zoomed out tiles drop every other one until they are
+#define EXPORT_MAX_WIDTH (1 << 18)
+#define EXPORT_TILE_MEMORY (256 << 20) //Bytes a tile may take, tiles are the most output pixels that fit
+#define EXPORT_PIXEL_BYTES (sizeof(Color) + sizeof(uint16_t) + 8 * sizeof(float)) //A super sampled pixel, its line coverage and the blur's two copies
+#define EXPORT_MIN_TILE 64 //Output pixels a side, even when that takes more memory, so margins and setup stay small next to a tile
+#define EXPORT_MARGIN 2 //Output pixels drawn around super sampled tiles, so blurring and scaling see past their edges
 
 
 
 //Settings
-uint64_t _compiledFormula[MAX_FORMULA];
+Formula _formula;
+int _tSlot, _ySlot;
+int _engine;
+int _engineChoice;	//As asked for, _engine falls back to the interpreter for formulas the choice cannot run
+char _formulaSource[MAX_FORMULA_SRC + 1];	//What _formula was compiled from, empty if it failed
+int _integrator;
+int _layout;
+double _tolerance;
+int _gridCells;
+bool _culling;
+FormulaJit _jit;
+FormulaAot _aot;
 unsigned char _drawFlags;
 int _pxWidth;
 int _samplePow, _sampleMult;
+bool _antialias;
 double _dspRange;
 bool printPerf;
 char _exportPath[MAX_PATH + 1];
+int _exportWidth;	//0 exports the image shown, super sampled
+bool _headless;
+char _manifestPath[MAX_PATH + 1];	//"-" reads jobs from stdin
+char _daemonPath[MAX_PATH + 1];	//Socket requests are served on
+double _budget;	//Milliseconds a headless render should fit in, 0 draws at the quality the options ask for
 
 //Other globals
-Texture _renderedTxt;
+double _viewT, _viewV;	//World point at the display center, formulas see display coordinates shifted by it
+bool _worldGrid;	//Vectors sit on the world grid across the whole image rather than the display, so view tiles line up
+bool _draft;	//Quick first pass of the view, with sparser vectors and lines
+double _vectorSpread = 1, _lineSpread = 1, _stepSpread = 1;	//Multiples of the vector step, line spacing and line step, above 1 when a budget coarsens them
+int _quality;	//Budgeted level the last render was drawn at
+double _qualitySpent;	//Milliseconds it took
+bool _cancelRender;	//Set by the window once the view moved on, work for the old one stops early. Accessed atomically
+Image _canvas;	//Kept between headless jobs, and only reallocated when a job needs more than it holds
+size_t _canvasCapacity;	//Pixels _canvas can hold, smaller canvases use the front of it
+volatile sig_atomic_t _stopDaemon;
+int _canvasWidth;			//Super sampled width of the whole drawing
+int _canvasLeft, _canvasTop;	//Where the image being drawn sits on the canvas
+FieldGrid _grid;	//Only filled while lines are drawn with -g
+RegionMap _regions;	//Only built while drawing, unless culling is off
+GlyphAtlas _arrows, _flatArrow, _undefinedMark;	//Only built while drawing vectors short enough for sprites
+
+//Columns [i * tileColumns, (i + 1) * tileColumns) are drawn into images[i], placed at lefts[i]
+typedef struct
+{
+	double *ts, *ys;
+	int columnC, rowC, tileColumns;
+	Image *images;
+	int *lefts;
+	int width, height;
+	Image *image;	//Stamped tiles write into it directly, each into its own columns
+} VectorTiles;
+
+//One family of streamlines: seeds every spacing in [bottom, top], integrated from start to end
+typedef struct
+{
+	double bottom, top, spacing;
+	double start, end, step;
+	Color color;
+} LineSweep;
+
+//Sweep i is split into bundles [firstBundle[i], firstBundle[i + 1]) and drawn as layer i + 1
+typedef struct
+{
+	const LineSweep *sweeps;
+	int sweepC;
+	double *seeds[MAX_SWEEPS];
+	int seedC[MAX_SWEEPS];
+	int firstBundle[MAX_SWEEPS + 1];
+	Coverage coverage;
+	long evaluations;	//Points evaluated by every bundle, for -p
+	double goneAbove[MAX_SWEEPS], goneBelow[MAX_SWEEPS];	//Lines off that side of the display past this t never come back
+} LinePlot;
+
+//Visible line segments in display units, kept instead of drawn while lines are traced for a tiled export
+typedef struct
+{
+	double *points;	//fromT, fromV, toT, toV for each segment
+	uint8_t *layers;
+	int segmentC, segmentCapacity;
+	bool failed;	//Some segment could not be kept
+} SegmentList;
+
+//One list per thread, so tracing needs no locks
+typedef struct
+{
+	SegmentList *lists;
+	int listC;
+	Color colors[MAX_SWEEPS];
+} SegmentLog;
+
+//Growable list of points, used for curves and for queued seeds
+typedef struct
+{
+	double *ts, *ys;
+	int pointC, pointCapacity;
+} PointList;
+
+SegmentLog _lineLog;	//Only kept while a tiled export traces its lines
+
+//A compiled formula with everything evaluating it needs, swapped in and out of the globals as a whole
+typedef struct
+{
+	char source[MAX_FORMULA_SRC + 1];	//Empty for an unused entry
+	Formula formula;
+	FormulaJit jit;
+	FormulaAot aot;
+	int engine, tSlot, ySlot;
+	long lastUse;
+} LoadedFormula;
+
+//One render asked for by a manifest line or a daemon request, pointing into the line it was parsed from
+typedef struct
+{
+	char *path, *source;
+	int width, drawFlags;
+	double range;
+} RenderJob;
+
+//What the window shows, and the lines last traced for it
+typedef struct
+{
+	double range;	//At level 0, levels shrink it by VIEW_ZOOM_STEP each
+	double t, v;	//World point at the window center
+	int level;
+	float wheel;	//Wheel movement short of a whole notch
+	double lastMove;
+	int sampleMult;	//Full tiles are rendered with, drafts are not super sampled
+	TileCache tiles;
+	Texture lines;	//Traced around linesT, linesV at linesLevel, over transparency
+	double linesT, linesV;
+	int linesLevel;
+	int linesPass;	//Passes traced for the current view, 1 once the draft is in and 2 once it is complete
+} ViewState;
+
+//Tiles of one level, nearest the center first, or the lines of the view
+typedef struct
+{
+	bool lines, draft;
+	int level;
+	double range, t, v;
+	struct { int x, y; } tiles[VIEW_MAX_TILES];
+	int tileC;
+} ViewJob;
+
+//A finished tile or lines image, waiting for the window to upload it
+typedef struct
+{
+	Image image;
+	bool lines, draft;
+	int level, x, y;
+	double t, v;
+} ViewResult;
+
+//Thread the window hands its jobs to, one at a time. The job is only written while it is idle,
+//results are appended under lock as they finish, so the window shows them the next frame
+typedef struct
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	bool started, stopping, busy;
+	ViewJob job;
+	ViewResult results[VIEW_MAX_TILES];
+	int resultC;
+} ViewRenderer;
+
+//What one budgeted quality level draws with
+typedef struct
+{
+	double vectorSpread, lineSpread, stepSpread, tolerance;
+	int samplePow;
+} Quality;
+
+//Vectors, lines, everything else and the export, in milliseconds, in units of work, or in milliseconds per unit of work
+typedef struct
+{
+	double vectors, lines, other, output;
+} RenderCosts;
+
+LoadedFormula _formulaCache[FORMULA_CACHE];	//Least recently used entries make room for new formulas
+long _formulaUses;
+ViewRenderer _renderer = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+RenderCosts _renderCosts;	//Learned from earlier budgeted renders, to predict the next
+bool _renderCostsKnown;
+
+//Cheapest first, level 5 draws what the default options do
+const Quality _qualities[QUALITY_LEVELS] = {
+	{ 8, 8, 4, 1e-2, 0 },
+	{ 4, 4, 2, 1e-2, 0 },
+	{ 3, 3, 1, 1e-3, 0 },
+	{ 2, 2, 1, 1e-3, 0 },
+	{ 1.5, 1.5, 1, 1e-4, 0 },
+	{ 1, 1, 1, 1e-4, 0 },
+	{ 1, 1, 1, 1e-5, 1 },
+	{ 1, 1, 1, 1e-6, 2 },
+};
 
 
 
 int ParseArgs(int argc, char *argv[]);
 void WriteUsageMessage();
+int LoadFormula(const char *source);
+bool UseFormula(const char *source);
+void SwapFormula(LoadedFormula *entry);
+void FreeFormulaCache();
+int RunManifest(const char *path);
+int RunDaemon(const char *path);
+void StopDaemon(int signal);
+bool ServeLine(Connection *connection);
+bool ParseJob(char *line, bool hasFlags, RenderJob *job, char *error);
+bool RunJob(const RenderJob *job, char *error);
 bool GetDerivative(double t, double y, double *ret);
-void GenerateTexture();
+bool GetDerivativeBatch(const double *t, const double *y, int count, double *ret, bool *valid);
+bool GetDerivativeColumn(double t, const double *y, int count, double *ret, bool *valid);
+bool GetDerivativeDual(const double *t, const double *y, int count, double *ret, double *dret, bool *valid);
+bool EvaluateDerivativeBatch(const double *t, const double *y, int count, double *ret, bool *valid);
+bool EvaluateDerivativeColumn(double t, const double *y, int count, double *ret, bool *valid);
+int GetLineDerivatives(const double *t, double columnT, const double *y, int count, double *ret, double *dret, bool *valid);
+int GetDerivativeInterval(double tLo, double tHi, double yLo, double yHi, FormulaInterval *ret);
+double GetTimeMs();
+double TToSubPx(double spc);
+double VToSubPx(double spc);
+void ExportDisplay();
+void RunWindow();
+bool UpdateView(ViewState *view);
+bool CollectViewResults(ViewState *view);
+void PlanViewJob(ViewState *view);
+int FindViewTiles(ViewState *view, bool drafts, ViewJob *job);
+bool StartViewRenderer();
+void StopViewRenderer();
+void SubmitViewJob(const ViewJob *job);
+void *RunViewRenderer(void *arg);
+void RunViewJob(const ViewJob *job);
+int RenderViewTiles(const ViewJob *job);
+bool TraceViewLines(const ViewJob *job);
+void PostViewResult(ViewResult result);
+bool IsRenderCancelled();
+void DrawView(ViewState *view);
+void DrawViewLevel(ViewState *view, int level);
+double GetViewRange(const ViewState *view, int level);
+double GetTileEdge(const ViewState *view, int level, int index);
+bool GenerateHeadless();
+double DrawCanvas(Image *img, RenderCosts *spent);
+void PickQuality(double budget);
+void SetQuality(int level);
+void CalibrateRenderCosts();
+void LearnRenderCosts(const RenderCosts *spent);
+RenderCosts GetRenderWork(int level);
+void ResolveSamples(Image *img, int width, int height);
+bool ExportTiles();
+Image DrawExportTile(int left, int top, int columnC, int rowC, const SegmentList *segments);
+bool TraceLines();
+void ReplayLines(Image *img, const SegmentList *segments);
+bool IsSegmentVisible(const double *points, int width, int height);
+bool AppendSegment(SegmentList *list, double fromT, double fromV, double toT, double toV, uint8_t layer);
+void MapRegions();
+void BuildGlyphs();
+void FreeGlyphs();
+void DrawArrowGlyph(Image *sprite, int center, double angle, void *context);
+void DrawUndefinedGlyph(Image *sprite, int center, double angle, void *context);
 void DrawAxis(Image *img);
 void DrawVectors(Image *img);
+void DrawVectorTile(void *context, int index);
+void StampVectorTile(VectorTiles *tiles, int first, int last);
+void EvaluateVectorColumn(const VectorTiles *tiles, double t, double *vs, bool *valid, double *keptYs, int *rows);
 void DrawLines(Image *img);
-void PlotResult(Image *img, double bottom, double top, double spacing, double left, double right, double step, Color color);
+long PlotResult(Image *img, const LineSweep *sweeps, int sweepC);
+void PlotBundle(void *context, int index);
+long PlotEuler(LinePlot *plot, int sweep, double *curV, PointList *runs, int alive);
+long PlotRk4(LinePlot *plot, int sweep, double *curV, PointList *runs, int alive);
+long PlotRk45(LinePlot *plot, int sweep, double *curV, PointList *runs, int alive);
+long PlotStiff(LinePlot *plot, int sweep, double *curV, PointList *runs, int alive);
+void PlotSegment(LinePlot *plot, int sweep, PointList *run, double fromT, double fromV, double toT, double toV);
+void FlushRun(LinePlot *plot, int sweep, PointList *run);
+void DrawSegment(LinePlot *plot, int sweep, double fromT, double fromV, double toT, double toV);
+void CoverSegment(Coverage *coverage, double fromT, double fromV, double toT, double toV, uint8_t layer);
+void GetLineCulling(const LineSweep *lines, double *above, double *below);
+bool IsLineGone(const LinePlot *plot, int sweep, double t, double y);
+long PlotEvenly(Image *img);
+long TraceEven(const Occupancy *occupancy, double t, double y, double direction, PointList *curve);
+bool AppendPoint(PointList *list, double t, double y);
 
 
 
@@ -83,26 +444,20 @@ int main(int argc, char *argv[])
 	if (ret) return ret;
 
 	SetTraceLogLevel(LOG_NONE);
-	InitWindow(_pxWidth, _pxWidth, "Direction Field viewer");
-	SetTargetFPS(5);
-
-	BeginDrawing();
-	DrawText("Generating...", 10, 10, 20, WHITE);
-	EndDrawing();
-
-	GenerateTexture();
-
-	Vector2 zero = { .x = 0.0, .y = 0.0 };
-
-	while (!WindowShouldClose())
-	{
-		ClearBackground(BLACK);
-		BeginDrawing();
-		DrawTextureEx(_renderedTxt, zero, 0.0, 1.0, WHITE);
-		EndDrawing();
-	}
 
-	CloseWindow();
+	//Headless runs never touch the window or the GPU, images are drawn and exported on the CPU
+	if (strlen(_daemonPath)) ret = RunDaemon(_daemonPath);
+	else if (strlen(_manifestPath)) ret = RunManifest(_manifestPath);
+	else if (_headless) ret = GenerateHeadless() ? 0 : 1;
+	else RunWindow();
+
+	UnloadImage(_canvas);
+	FreeFormulaCache();
+	FreeFormulaJit(&_jit);
+	FreeFormulaAot(&_aot);
+	FreeFormula(&_formula);
+	FreeThreads();
+	return ret;
 }
 
 int ParseArgs(int argc, char *argv[])
@@ -115,10 +470,22 @@ int ParseArgs(int argc, char *argv[])
 	_drawFlags = DEFAULT_DRAW_FLAGS;
 	_pxWidth = DEFAULT_PX_WIDTH;
 	_samplePow = DEFAULT_SAMPLE_POW;
+	_antialias = DEFAULT_ANTIALIAS;
 	_dspRange = DEFAULT_DSP_RANGE;
 	printPerf = DEFAULT_PRINT_PERF;
+	_engineChoice = DEFAULT_ENGINE;
+	_integrator = DEFAULT_INTEGRATOR;
+	_layout = DEFAULT_LAYOUT;
+	_tolerance = DEFAULT_TOLERANCE;
+	_gridCells = DEFAULT_GRID_CELLS;
+	_culling = DEFAULT_CULLING;
 	strcpy(source, DEFAULT_FORMULA);
 	strcpy(_exportPath, "");
+	_exportWidth = 0;
+	_headless = DEFAULT_HEADLESS;
+	strcpy(_manifestPath, "");
+	strcpy(_daemonPath, "");
+	_budget = DEFAULT_BUDGET;
 
 	static struct option long_options[] = {
 		{"help",		no_argument,		NULL, 'h'},
@@ -128,10 +495,23 @@ int ParseArgs(int argc, char *argv[])
 		{"range",		required_argument,	NULL, 'r'},
 		{"performance",	no_argument,		NULL, 'p'},
 		{"sampling",	required_argument,	NULL, 's'},
+		{"antialias",	no_argument,		NULL, 'a'},
 		{"export",		required_argument,	NULL, 'e'},
+		{"export-width",required_argument,	NULL, 'x'},
+		{"engine",		required_argument,	NULL, 'E'},
+		{"integrator",	required_argument,	NULL, 'i'},
+		{"tolerance",	required_argument,	NULL, 't'},
+		{"grid",		required_argument,	NULL, 'g'},
+		{"layout",		required_argument,	NULL, 'l'},
+		{"no-culling",	no_argument,		NULL, 'C'},
+		{"headless",	no_argument,		NULL, 'H'},
+		{"manifest",	required_argument,	NULL, 'm'},
+		{"daemon",		required_argument,	NULL, 'D'},
+		{"budget",		required_argument,	NULL, 'B'},
+		{0},
 	};
 
-	while ((opt = getopt_long(argc, argv, "hf:d:w:s:r:pe:", long_options, &optId)) != -1)
+	while ((opt = getopt_long(argc, argv, "hf:d:w:s:ar:pe:x:E:i:t:g:l:CHm:D:B:", long_options, &optId)) != -1)
 	{
 		switch(opt)
 		{
@@ -162,9 +542,9 @@ int ParseArgs(int argc, char *argv[])
 
 			case 'w':
 				int pxWidth = strtol(optarg, NULL, 10);
-				if (errno || pxWidth < 1 || pxWidth > 4096)
+				if (errno || pxWidth < 1 || pxWidth > MAX_PX_WIDTH)
 				{
-					fprintf(stderr, "Invalid width '%s'. Must be an integer between 1 and 4096 inclusive.\n", optarg);
+					fprintf(stderr, "Invalid width '%s'. Must be an integer between 1 and %d inclusive.\n", optarg, MAX_PX_WIDTH);
 					return -1;
 				}
 				
@@ -182,11 +562,15 @@ int ParseArgs(int argc, char *argv[])
 				_samplePow = samplePow;
 				break;
 
+			case 'a':
+				_antialias = true;
+				break;
+
 			case 'r':
 				double dspRange = strtod(optarg, NULL);
-				if (errno || dspRange < 0.001 || dspRange > 1000)
+				if (errno || dspRange < MIN_DSP_RANGE || dspRange > MAX_DSP_RANGE)
 				{
-					fprintf(stderr, "Invalid display range '%s'. Must be an number between 0.001 and 1000 inclusive.\n", optarg);
+					fprintf(stderr, "Invalid display range '%s'. Must be an number between %g and %g inclusive.\n", optarg, MIN_DSP_RANGE, MAX_DSP_RANGE);
 					return -1;
 				}
 
@@ -206,6 +590,111 @@ int ParseArgs(int argc, char *argv[])
 				strcpy(_exportPath, optarg);
 				break;
 
+			case 'x':
+				int exportWidth = strtol(optarg, NULL, 10);
+				if (errno || exportWidth < 1 || exportWidth > EXPORT_MAX_WIDTH)
+				{
+					fprintf(stderr, "Invalid export width '%s'. Must be an integer between 1 and %d inclusive.\n", optarg, EXPORT_MAX_WIDTH);
+					return -1;
+				}
+
+				_exportWidth = exportWidth;
+				break;
+
+			case 'E':
+				if (!strcmp(optarg, "interp")) _engineChoice = ENGINE_INTERP;
+				else if (!strcmp(optarg, "jit")) _engineChoice = ENGINE_JIT;
+				else if (!strcmp(optarg, "aot")) _engineChoice = ENGINE_AOT;
+				else
+				{
+					fprintf(stderr, "Invalid engine '%s'. Must be one of interp, jit or aot.\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'i':
+				if (!strcmp(optarg, "euler")) _integrator = INTEGRATOR_EULER;
+				else if (!strcmp(optarg, "rk4")) _integrator = INTEGRATOR_RK4;
+				else if (!strcmp(optarg, "rk45")) _integrator = INTEGRATOR_RK45;
+				else if (!strcmp(optarg, "stiff")) _integrator = INTEGRATOR_STIFF;
+				else
+				{
+					fprintf(stderr, "Invalid integrator '%s'. Must be one of euler, rk4, rk45 or stiff.\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 't':
+				double tolerance = strtod(optarg, NULL);
+				if (errno || tolerance < 1e-12 || tolerance > 1)
+				{
+					fprintf(stderr, "Invalid tolerance '%s'. Must be a number between 1e-12 and 1 inclusive.\n", optarg);
+					return -1;
+				}
+
+				_tolerance = tolerance;
+				break;
+
+			case 'g':
+				int gridCells = strtol(optarg, NULL, 10);
+				if (errno || (gridCells && (gridCells < GRID_MIN_CELLS || gridCells > GRID_MAX_CELLS)))
+				{
+					fprintf(stderr, "Invalid grid size '%s'. Must be 0 (off) or an integer between %d and %d inclusive.\n", optarg, GRID_MIN_CELLS, GRID_MAX_CELLS);
+					return -1;
+				}
+
+				_gridCells = gridCells;
+				break;
+
+			case 'l':
+				if (!strcmp(optarg, "edges")) _layout = LAYOUT_EDGES;
+				else if (!strcmp(optarg, "even")) _layout = LAYOUT_EVEN;
+				else
+				{
+					fprintf(stderr, "Invalid layout '%s'. Must be one of edges or even.\n", optarg);
+					return -1;
+				}
+				break;
+
+			case 'C':
+				_culling = false;
+				break;
+
+			case 'H':
+				_headless = true;
+				break;
+
+			case 'm':
+				if (strlen(optarg) > MAX_PATH)
+				{
+					fprintf(stderr, "Manifest path is too long. Max allowed length is %d.\n", MAX_PATH);
+					return -1;
+				}
+				strcpy(_manifestPath, optarg);
+				_headless = true;
+				break;
+
+			case 'D':
+				if (strlen(optarg) > MAX_PATH)
+				{
+					fprintf(stderr, "Socket path is too long. Max allowed length is %d.\n", MAX_PATH);
+					return -1;
+				}
+				strcpy(_daemonPath, optarg);
+				_headless = true;
+				break;
+
+			case 'B':
+				double budget = strtod(optarg, NULL);
+				if (errno || budget < MIN_BUDGET || budget > MAX_BUDGET)
+				{
+					fprintf(stderr, "Invalid budget '%s'. Must be a number of milliseconds between %g and %g inclusive.\n", optarg, MIN_BUDGET, MAX_BUDGET);
+					return -1;
+				}
+
+				_budget = budget;
+				break;
+
 			case '?':
 				//getopt_long already wrote error message
 				WriteUsageMessage();
@@ -213,22 +702,49 @@ int ParseArgs(int argc, char *argv[])
 		}
 	}
 
+	//Anti-aliased drawing is already smooth at the native resolution
+	if (_antialias) _samplePow = 0;
 	_sampleMult = 1 << _samplePow;
-	if (!CompileFormula(source, _compiledFormula))
+	_canvasWidth = _pxWidth * _sampleMult;
+	_canvasLeft = _canvasTop = 0;
+	if (_budget && !_headless)
 	{
-		fprintf(stderr, "Formula compilation failed.\n");	
-		return 2;
+		fprintf(stderr, "A budget only applies to headless renders, the window already draws coarse passes first.\n");
+		return -1;
+	}
+	if (_budget && _exportWidth)
+	{
+		fprintf(stderr, "A budget cannot be kept by tiled exports.\n");
+		return -1;
 	}
+	if (strlen(_manifestPath) || strlen(_daemonPath))
+	{
+		if (strlen(_manifestPath) && strlen(_daemonPath))
+		{
+			fprintf(stderr, "A manifest cannot be run by the daemon, send its lines as requests instead.\n");
+			return -1;
+		}
+		if (strlen(_exportPath))
+		{
+			fprintf(stderr, "Manifest jobs and daemon requests name their own export paths.\n");
+			return -1;
+		}
 
-	/*for (int i = 0; i < MAX_FORMULA; i++)
+		//Every job loads its own formula
+		return 0;
+	}
+	if (_exportWidth && !strlen(_exportPath))
+	{
+		fprintf(stderr, "An export width needs an export path.\n");
+		return -1;
+	}
+	if (_headless && !strlen(_exportPath))
 	{
-		if (_compiledFormula[i] == FORMULA_RET) break;
-		if (_compiledFormula[i] > 0x10000) printf("Formula[%d]: %lf\n", i, ((double*)_compiledFormula)[i]);
-		else if (_compiledFormula[i] > 0x1000) printf("Formula[%d]: %c\n", i, _compiledFormula[i] - FORMULA_VAR_BASE + 'a');
-		else printf("Formula[%d]: %ld\n", i, _compiledFormula[i]);
-	}*/
+		fprintf(stderr, "Headless mode needs an export path or a manifest.\n");
+		return -1;
+	}
 
-	return 0;
+	return LoadFormula(source);
 }
 
 void WriteUsageMessage()
@@ -237,155 +753,2302 @@ void WriteUsageMessage()
 		"\t-h, --help\n\t\tShows usage message.\n"
 		"\t-f, --formula <formula>\n\t\tSpecifies the formula to be used during derivative calculation.\n"
 		"\t-d, --draw <mode>\n\t\tSpecifies what draw mode to use. Calculate by adding the requested flags: 1=vectors, 2=central, 4=left, 8=right\n"
-		"\t-w, --width <width>\n\t\tSpecifies what the window width should be. The window is aways square. Must be between 1 and 4096 inclusive.\n"
-		"\t-r, --range <range>\n\t\tSpecifies what number range to use when drawing. Interval will be [-range,range]. Must be between 0.001 and 1000.\n"
+		"\t-w, --width <width>\n\t\tSpecifies what the window width should be. The window is aways square. Must be between 1 and %d inclusive.\n"
+		"\t-r, --range <range>\n\t\tSpecifies what number range to use when drawing. Interval will be [-range,range]. Must be between %g and %g.\n"
 		"\t-p, --performance\n\t\tEnables printing of performance metrics.\n"
 		"\t-s, --sampling <mult>\n\t\tSpecifies what sampling power to use when rendering. Must be between 0 and 8 inclusive.\n"
-		"\t-e, --export <path>\n\t\tSpecifies that the resuting image is to be exported to the given path.\n");
+		"\t-a, --antialias\n\t\tDraws anti-aliased lines and circles straight at the window width instead of super sampling. Overrides the sampling power.\n"
+		"\t-e, --export <path>\n\t\tSpecifies that the resuting image is to be exported to the given path.\n"
+		"\t-x, --export-width <width>\n\t\tExports at this width instead, drawing one tile at a time and streaming rows to a .png or .ppm path. Must be between 1 and %d inclusive.\n"
+		"\t-E, --engine <engine>\n\t\tSpecifies how formulas are evaluated: interp (default), jit or aot (native, cached build).\n"
+		"\t-i, --integrator <integrator>\n\t\tSpecifies how solution curves are integrated: euler (default), rk4, rk45 (adaptive step) or stiff (adaptive implicit step).\n"
+		"\t-t, --tolerance <tol>\n\t\tSpecifies the error allowed per rk45 or stiff step, in units of y, and per direction read from the grid, in radians. Must be between 1e-12 and 1 inclusive.\n"
+		"\t-g, --grid <cells>\n\t\tSpecifies how many cells across the display a cached slope grid for solution curves has. 0 (default) evaluates every point exactly.\n"
+		"\t-l, --layout <layout>\n\t\tSpecifies where solution curves start: edges (default) seeds them along the sweeps the draw flags pick, even spaces them evenly over the display whenever any line flag is set, integrating with euler.\n"
+		"\t-C, --no-culling\n\t\tEvaluates areas interval arithmetic proves undefined, and keeps integrating lines it proves never come back on screen.\n"
+		"\t-H, --headless\n\t\tRenders and exports without opening a window or a GPU context. Needs an export path.\n"
+		"\t-m, --manifest <path>\n\t\tRuns headless jobs from a file, or stdin for -, one per line as '<export path> <width> <range> <formula>'. Blank lines and lines starting with # are skipped, every other option applies to all jobs.\n"
+		"\t-D, --daemon <socket>\n\t\tServes headless renders on a Unix domain socket until SIGINT, SIGTERM or a 'quit' request, keeping threads, compiled formulas and the canvas warm.\n"
+		"\t\tRequests are lines of '<export path> <width> <range> <draw flags> <formula>', answered with 'ok' or 'error <message>'.\n"
+		"\t\tAn export path of - answers 'ok <width> <height> <bytes>' followed by the canvas as RGBA rows instead.\n"
+		"\t-B, --budget <ms>\n\t\tFits every headless render into this many milliseconds, picking the vector and line spacing, line step, tolerance and sampling power from what earlier renders took instead of -s and -t. Frames keep the -w size at any sampling power. The first render measures a small probe render first.\n"
+		"\t\tReports the quality level reached, from 0 to %d, and the time taken. Daemon replies append 'quality <level> <ms>'. Must be between %g and %g inclusive.\n"
+		"\nWindow:\n\tDrag to pan, scroll to zoom around the cursor and press Home to go back to the starting view.\n",
+		MAX_PX_WIDTH, MIN_DSP_RANGE, MAX_DSP_RANGE, EXPORT_MAX_WIDTH, QUALITY_LEVELS - 1, MIN_BUDGET, MAX_BUDGET);
 }
+int LoadFormula(const char *source)
+{
+	//Anything compiled for the last formula goes first, its buffers are reused
+	FreeFormulaJit(&_jit);
+	FreeFormulaAot(&_aot);
+	strcpy(_formulaSource, "");
+	_engine = _engineChoice;
+
+	if (!CompileFormula(source, &_formula))
+	{
+		fprintf(stderr, "Formula compilation failed.\n");
+		return 2;
+	}
+	if (!VerifyFormula(&_formula))
+	{
+		fprintf(stderr, "Formula verification failed.\n");
+		return 2;
+	}
 
+	//Rejected before anything is built for it, daemon clients send arbitrary formulas
+	for (int i = 0; i < _formula.slotC; i++)
+	{
+		if (_formula.slots[i] != 't' && _formula.slots[i] != 'y')
+		{
+			fprintf(stderr, "Unknown variable '%c'. Only t and y can be used.\n", _formula.slots[i]);
+			return 2;
+		}
+	}
 
+	if (!OptimizeFormula(&_formula))
+		fprintf(stderr, "Formula could not be optimized, running it as written.\n");
+	if (printPerf) printf("Formula uses %d buffers.\n", _formula.maxDepth);
+	if (_engine == ENGINE_JIT && !CompileFormulaJit(&_formula, &_jit))
+	{
+		fprintf(stderr, "Formula could not be JIT compiled, using the interpreter.\n");
+		_engine = ENGINE_INTERP;
+	}
+	if (_engine == ENGINE_AOT)
+	{
+		if (!CompileFormulaAot(source, &_formula, &_aot))
+		{
+			fprintf(stderr, "Formula could not be built natively, using the interpreter.\n");
+			_engine = ENGINE_INTERP;
+		}
+		else if (printPerf) printf("Native formula %s.\n", _aot.cached ? "loaded from cache" : "built");
+	}
 
-bool GetDerivative(double t, double y, double *ret)
-{
-	FormulaVariable vars[2] = {
-		{ .name = 't', .value = t }, 
-		{ .name = 'y', .value = y }};
+	_tSlot = GetFormulaSlot(&_formula, 't');
+	_ySlot = GetFormulaSlot(&_formula, 'y');
 
-	return EvaluateFormula(_compiledFormula, vars, 2, ret);
-}
+	/*for (int i = 0; i < _formula.codeC; i++)
+	{
+		if (FORMULA_IS_VAR(_formula.code[i])) printf("Formula[%d]: %c\n", i, _formula.slots[_formula.code[i] - FORMULA_VAR_BASE]);
+		else printf("Formula[%d]: %d\n", i, _formula.code[i]);
+	}
+	for (int i = 0; i < _formula.constantC; i++) printf("Constant[%d]: %lf\n", i, _formula.constants[i]);*/
 
+	strcpy(_formulaSource, source);
+	return 0;
+}
+bool UseFormula(const char *source)
+{
+	if (*_formulaSource && !strcmp(source, _formulaSource)) return true;
 
+	//A cached formula is swapped in, otherwise the least recently used entry makes room and lends its buffers
+	int slot = -1, oldest = 0;
+	for (int i = 0; i < FORMULA_CACHE; i++)
+	{
+		if (*_formulaCache[i].source && !strcmp(source, _formulaCache[i].source)) slot = i;
+		if (_formulaCache[i].lastUse < _formulaCache[oldest].lastUse) oldest = i;
+	}
 
-int TToPx(double spc)
+	if (slot != -1)
+	{
+		SwapFormula(&_formulaCache[slot]);
+		return true;
+	}
+	SwapFormula(&_formulaCache[oldest]);
+	return !LoadFormula(source);
+}
+void SwapFormula(LoadedFormula *entry)
 {
-	return (int)round((_pxWidth * _sampleMult / 2) + spc * (_pxWidth * _sampleMult / _dspRange) * 0.5);
+	LoadedFormula active = {
+		.formula = _formula, .jit = _jit, .aot = _aot,
+		.engine = _engine, .tSlot = _tSlot, .ySlot = _ySlot,
+		.lastUse = *_formulaSource ? ++_formulaUses : 0
+	};
+	strcpy(active.source, _formulaSource);
+
+	_formula = entry->formula;
+	_jit = entry->jit;
+	_aot = entry->aot;
+	_engine = entry->engine;
+	_tSlot = entry->tSlot;
+	_ySlot = entry->ySlot;
+	strcpy(_formulaSource, entry->source);
+	*entry = active;
 }
-int VToPx(double spc)
+void FreeFormulaCache()
 {
-	return (int)round((_pxWidth * _sampleMult / 2) - spc * (_pxWidth * _sampleMult / _dspRange) * 0.5);
+	for (int i = 0; i < FORMULA_CACHE; i++)
+	{
+		FreeFormulaJit(&_formulaCache[i].jit);
+		FreeFormulaAot(&_formulaCache[i].aot);
+		FreeFormula(&_formulaCache[i].formula);
+	}
 }
+int RunManifest(const char *path)
+{
+	FILE *file = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!file)
+	{
+		fprintf(stderr, "Failed to open manifest '%s'.\n", path);
+		return -1;
+	}
+
+	//Jobs run one after another, each spread over every thread, so formulas and the canvas carry over between them
+	char line[MANIFEST_LINE + 1];
+	int lineNum = 0, jobC = 0, failC = 0;
+	double start = GetTimeMs();
+	while (fgets(line, sizeof(line), file))
+	{
+		lineNum++;
+		size_t length = strlen(line);
+		if (length == MANIFEST_LINE && line[length - 1] != '\n')
+		{
+			fprintf(stderr, "Manifest line %d is too long. Max allowed length is %d.\n", lineNum, MANIFEST_LINE);
+			failC++;
+			int ch;
+			while ((ch = fgetc(file)) != EOF && ch != '\n');
+			continue;
+		}
 
+		char *first = line + strspn(line, " \t\r\n");
+		if (!*first || *first == '#') continue;
+		first[strcspn(first, "\r\n")] = '\0';
 
+		RenderJob job;
+		char error[JOB_ERROR];
+		double jobStart = GetTimeMs();
+		jobC++;
+		if (!ParseJob(first, false, &job, error) || !RunJob(&job, error))
+		{
+			fprintf(stderr, "Manifest line %d: %s.\n", lineNum, error);
+			failC++;
+		}
+		else if (printPerf) printf("Job on line %d exported to '%s' in %.2fms.\n", lineNum, job.path, GetTimeMs() - jobStart);
+	}
 
-void GenerateTexture()
+	if (file != stdin) fclose(file);
+	if (printPerf) printf("Manifest time elapsed: %.2fms, %d jobs, %d failed.\n", GetTimeMs() - start, jobC, failC);
+	return failC ? 1 : 0;
+}
+int RunDaemon(const char *path)
 {
-	Image renderedImg = GenImageColor(_pxWidth * _sampleMult, _pxWidth * _sampleMult, BLACK);
+	int server = OpenServer(path);
+	if (server < 0)
+	{
+		fprintf(stderr, "Failed to listen on '%s'.\n", path);
+		return -1;
+	}
+
+	//Without SA_RESTART, so a blocked poll returns and the socket is removed on the way out
+	struct sigaction action = { .sa_handler = StopDaemon };
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	//The pool is started before the first request rather than by it
+	printf("Listening on '%s' with %d threads.\n", path, GetThreadCount());
+	fflush(stdout);
+
+	//Requests still run one at a time, each already runs on every thread, but whichever client has a whole line
+	//is served next, so an idle connection never holds up the rest
+	static Connection connections[DAEMON_CLIENTS];
+	struct pollfd fds[DAEMON_CLIENTS + 1];
+	int clientC = 0, ret = 0;
+	while (!_stopDaemon)
+	{
+		//Lines already received are served without waiting on the sockets
+		bool pending = false;
+		fds[0] = (struct pollfd){ .fd = server, .events = clientC < DAEMON_CLIENTS ? POLLIN : 0 };
+		for (int i = 0; i < clientC; i++)
+		{
+			fds[i + 1] = (struct pollfd){ .fd = connections[i].fd, .events = POLLIN };
+			pending |= HasBytes(&connections[i]);
+		}
 
-	clock_t start = clock(), diff;
-	DrawAxis(&renderedImg);
-	DrawVectors(&renderedImg);
-	DrawLines(&renderedImg);
-	diff = clock() - start;
+		if (poll(fds, clientC + 1, pending ? 0 : -1) < 0)
+		{
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Failed to wait for requests: %s.\n", strerror(errno));
+			ret = 1;
+			break;
+		}
 
-	if (strlen(_exportPath)) ExportImage(renderedImg, _exportPath);
+		//One request per client a round, so a client streaming requests can not starve the others
+		int kept = 0;
+		for (int i = 0; i < clientC; i++)
+		{
+			Connection *connection = &connections[i];
+			bool open = true;
 
-	//Scale back down if super sampled
-	if (_samplePow)
-	{
-		//Apply some corrections
-		ImageColorBrightness(&renderedImg, +64);
-		ImageBlurGaussian(&renderedImg, _samplePow);
-		ImageResize(&renderedImg, _pxWidth, _pxWidth);
-		ImageColorContrast(&renderedImg, 30);
+			if (!_stopDaemon && !HasBytes(connection) && fds[i + 1].revents) open = ReceiveBytes(connection);
+			if (!_stopDaemon && open && HasBytes(connection)) open = ServeLine(connection);
+
+			if (!open) CloseConnection(connection);
+			else connections[kept++] = *connection;
+		}
+		clientC = kept;
+
+		if (_stopDaemon || !(fds[0].revents & POLLIN)) continue;
+		if (AcceptConnection(server, &connections[clientC], MANIFEST_LINE + 1)) clientC++;
+		else if (errno != EINTR && errno != ECONNABORTED && errno != ENOMEM)
+		{
+			fprintf(stderr, "Failed to accept a connection: %s.\n", strerror(errno));
+			ret = 1;
+			break;
+		}
 	}
-	
-	_renderedTxt = LoadTextureFromImage(renderedImg);
-	UnloadImage(renderedImg);
 
-	if (printPerf) printf("Total time elapsed: %.2fms.\n", diff * 1000.0 / CLOCKS_PER_SEC);
+	for (int i = 0; i < clientC; i++) CloseConnection(&connections[i]);
+	CloseServer(server, path);
+	return ret;
 }
-void DrawAxis(Image *img)
+void StopDaemon(int signal)
 {
-	ImageDrawLine(img, _pxWidth * _sampleMult / 2, 0, _pxWidth * _sampleMult / 2, _pxWidth * _sampleMult, GRAY);
-	ImageDrawLine(img, 0, _pxWidth * _sampleMult / 2, _pxWidth * _sampleMult, _pxWidth * _sampleMult / 2, GRAY);
+	(void)signal;
+	_stopDaemon = 1;
 }
-void DrawVectors(Image *img)
+bool ServeLine(Connection *connection)
 {
-	if (!(_drawFlags & DRAW_VECTORS))
-		return;
+	//Only part of the line may have arrived so far
+	int length = TakeLine(connection);
+	if (length == -1) return true;
 
-	clock_t start = clock(), diff;
+	char reply[JOB_ERROR + 64], error[JOB_ERROR];
+	RenderJob job;
 
-	for (double t = -_dspRange; t <= _dspRange; t += VECTOR_STEP)
+	if (length == -2)
 	{
-		for (double y = -_dspRange; y <= _dspRange; y += VECTOR_STEP)
-		{
-			double a, x, v = 0;
-			bool valid = GetDerivative(t, y, &v);
-			a = atan(v);
-			x = cos(a) * VECTOR_LENGTH;
-			v = sin(a) * VECTOR_LENGTH;
+		snprintf(error, JOB_ERROR, "request is too long, max allowed length is %d", MANIFEST_LINE);
+		snprintf(reply, sizeof(reply), "error %s\n", error);
+		return WriteBytes(connection, reply, strlen(reply));
+	}
 
-			int cornerX = TToPx(t-x/2);
-			int cornerY = VToPx(y-v/2);
-			int tipX = TToPx(t+x);
-			int tipY = VToPx(y+v);
+	char *first = connection->line + strspn(connection->line, " \t");
+	if (!*first) return true;
+	if (!strcmp(first, "quit"))
+	{
+		_stopDaemon = 1;
+		WriteBytes(connection, "ok\n", 3);
+		return false;
+	}
 
-			if (valid)
-			{
-				v *= VECTOR_LENGTH; x *= VECTOR_LENGTH;
-				ImageDrawLine(img, cornerX, cornerY, tipX, tipY, fabs(a) < FLAT_MARGIN ? RED : GREEN);
-			}
-			else
-			{
-				ImageDrawCircle(img, cornerX, cornerY, UNDEF_RADIUS, RED);
-			}
-		}
+	double start = GetTimeMs();
+	bool ok = ParseJob(first, true, &job, error);
+
+	//The canvas goes back over the socket instead of to a file
+	bool returned = ok && !strcmp(job.path, "-");
+	if (returned && _exportWidth)
+	{
+		snprintf(error, JOB_ERROR, "tiled exports need an export path");
+		ok = false;
+	}
+	if (returned) job.path = "";
+	ok = ok && RunJob(&job, error);
+
+	if (!ok)
+	{
+		snprintf(reply, sizeof(reply), "error %s\n", error);
+		return WriteBytes(connection, reply, strlen(reply));
 	}
 
-	diff = clock() - start;
-	if (printPerf) printf("Vectors time elapsed: %.2fms.\n", diff * 1000.0 / CLOCKS_PER_SEC);
+	//Budgeted renders say what they reached after everything else
+	char reached[64] = "";
+	if (_budget) snprintf(reached, sizeof(reached), " quality %d %.2f", _quality, _qualitySpent);
+
+	if (returned)
+	{
+		size_t size = (size_t)_canvas.width * _canvas.height * sizeof(Color);
+		snprintf(reply, sizeof(reply), "ok %d %d %zu%s\n", _canvas.width, _canvas.height, size, reached);
+		if (!WriteBytes(connection, reply, strlen(reply)) || !WriteBytes(connection, _canvas.data, size)) return false;
+	}
+	else
+	{
+		snprintf(reply, sizeof(reply), "ok%s\n", reached);
+		if (!WriteBytes(connection, reply, strlen(reply))) return false;
+	}
+	if (printPerf) printf("Request done in %.2fms.\n", GetTimeMs() - start);
+	return true;
 }
-void DrawLines(Image *img)
+bool ParseJob(char *line, bool hasFlags, RenderJob *job, char *error)
 {
-	clock_t start = clock(), diff;
+	//Fields are split on whitespace, the formula is the rest of the line and may have spaces in it
+	char *fields[4], *end;
+	int fieldC = hasFlags ? 4 : 3;
+	for (int i = 0; i < fieldC; i++)
+	{
+		line += strspn(line, " \t");
+		fields[i] = line;
+		line += strcspn(line, " \t");
+		if (!*line)
+		{
+			snprintf(error, JOB_ERROR, "expected '<export path> <width> <range> %s<formula>'", hasFlags ? "<draw flags> " : "");
+			return false;
+		}
+		*line++ = '\0';
+	}
+	job->path = fields[0];
+	job->source = line + strspn(line, " \t");
+	for (size_t length = strlen(job->source); length && isspace((unsigned char)job->source[length - 1]); length--)
+		job->source[length - 1] = '\0';
+
+	if (strlen(job->path) > MAX_PATH)
+	{
+		snprintf(error, JOB_ERROR, "export path is too long, max allowed length is %d", MAX_PATH);
+		return false;
+	}
+
+	job->width = strtol(fields[1], &end, 10);
+	if (*end || job->width < 1 || job->width > MAX_PX_WIDTH)
+	{
+		snprintf(error, JOB_ERROR, "invalid width '%.32s', must be an integer between 1 and %d inclusive", fields[1], MAX_PX_WIDTH);
+		return false;
+	}
+
+	job->range = strtod(fields[2], &end);
+	if (*end || !(job->range >= MIN_DSP_RANGE && job->range <= MAX_DSP_RANGE))
+	{
+		snprintf(error, JOB_ERROR, "invalid range '%.32s', must be a number between %g and %g inclusive", fields[2], MIN_DSP_RANGE, MAX_DSP_RANGE);
+		return false;
+	}
+
+	job->drawFlags = hasFlags ? strtol(fields[3], &end, 10) : _drawFlags;
+	if (hasFlags && (*end || job->drawFlags < 0 || job->drawFlags > 15))
+	{
+		snprintf(error, JOB_ERROR, "invalid draw flags '%.32s', must be an integer between 0 and 15 inclusive", fields[3]);
+		return false;
+	}
 
-	if (_drawFlags & DRAW_CENTRAL_LINES)
+	if (!*job->source || strlen(job->source) > MAX_FORMULA)
+	{
+		snprintf(error, JOB_ERROR, "formula must be between 1 and %d characters long", MAX_FORMULA);
+		return false;
+	}
+	return true;
+}
+bool RunJob(const RenderJob *job, char *error)
+{
+	//Only a formula that is not cached is compiled again
+	if (!UseFormula(job->source))
 	{
-		PlotResult(img, -_dspRange - LINE_RANGE_EXTEND, _dspRange + LINE_RANGE_EXTEND, LINE_SPACING,
-			LINE_STEP, _dspRange + LINE_STEP, LINE_STEP, SKYBLUE);
-		PlotResult(img, -_dspRange - LINE_RANGE_EXTEND, _dspRange + LINE_RANGE_EXTEND, LINE_SPACING,
-			0, -_dspRange - LINE_STEP, LINE_STEP, SKYBLUE);
+		snprintf(error, JOB_ERROR, "formula '%.64s' could not be loaded", job->source);
+		return false;
 	}
-	if (_drawFlags & DRAW_RIGHT_EDGE_LINES)
-		PlotResult(img, -_dspRange - LINE_RANGE_EXTEND, _dspRange + LINE_RANGE_EXTEND, LINE_SPACING,
-			_dspRange + LINE_STEP, 0, LINE_STEP, ORANGE);
-	if (_drawFlags & DRAW_LEFT_EDGE_LINES)
-		PlotResult(img, -_dspRange - LINE_RANGE_EXTEND, _dspRange + LINE_RANGE_EXTEND, LINE_SPACING,
-			-_dspRange - LINE_STEP, 0, LINE_STEP, VIOLET);
 
-	diff = clock() - start;
-	if (printPerf) printf("Lines time elapsed: %.2fms.\n", diff * 1000.0 / CLOCKS_PER_SEC);
+	strcpy(_exportPath, job->path);
+	_drawFlags = job->drawFlags;
+	_pxWidth = job->width;
+	_dspRange = job->range;
+	_canvasWidth = _pxWidth * _sampleMult;
+	_canvasLeft = _canvasTop = 0;
+
+	if (!GenerateHeadless())
+	{
+		snprintf(error, JOB_ERROR, "rendering '%.64s' failed", job->path);
+		return false;
+	}
+	return true;
 }
 
 
 
-void PlotResult(Image *img, double bottom, double top, double spacing, double start, double end, double step, Color color)
+bool GetDerivative(double t, double y, double *ret)
+{
+	double registers[MAX_SLOTS];
+	if (_tSlot != -1) registers[_tSlot] = t + _viewT;
+	if (_ySlot != -1) registers[_ySlot] = y + _viewV;
+
+	return EvaluateFormula(&_formula, registers, ret);
+}
+bool GetDerivativeBatch(const double *t, const double *y, int count, double *ret, bool *valid)
 {
-	bool leftToRight = start < end;
-	double s = step * (leftToRight ? 1 : -1) / _sampleMult;
+	if (!_viewT && !_viewV) return EvaluateDerivativeBatch(t, y, count, ret, valid);
 
-	for (double y = bottom; y <= top; y += spacing)
+	//Panned displays are evaluated around the view, a batch at a time
+	double shiftedT[FORMULA_BATCH], shiftedY[FORMULA_BATCH];
+	bool ok = true;
+	for (int i = 0; i < count; i += FORMULA_BATCH)
 	{
-		double curV = y;
+		int n = count - i < FORMULA_BATCH ? count - i : FORMULA_BATCH;
+		for (int j = 0; j < n; j++)
+		{
+			if (t) shiftedT[j] = t[i + j] + _viewT;
+			shiftedY[j] = y[i + j] + _viewV;
+		}
+		ok &= EvaluateDerivativeBatch(t ? shiftedT : NULL, shiftedY, n, ret + i, valid + i);
+	}
+	return ok;
+}
+bool GetDerivativeColumn(double t, const double *y, int count, double *ret, bool *valid)
+{
+	if (_tSlot == -1) return GetDerivativeBatch(NULL, y, count, ret, valid);
+	if (!_viewV) return EvaluateDerivativeColumn(t + _viewT, y, count, ret, valid);
 
-		for (double t = start; leftToRight ? t <= end : t >= end; t += s)
+	//Panned displays shift y a batch at a time
+	double shifted[FORMULA_BATCH];
+	bool ok = true;
+	for (int i = 0; i < count; i += FORMULA_BATCH)
+	{
+		int n = count - i < FORMULA_BATCH ? count - i : FORMULA_BATCH;
+		for (int j = 0; j < n; j++) shifted[j] = y[i + j] + _viewV;
+		ok &= EvaluateDerivativeColumn(t + _viewT, shifted, n, ret + i, valid + i);
+	}
+	return ok;
+}
+bool GetDerivativeDual(const double *t, const double *y, int count, double *ret, double *dret, bool *valid)
+{
+	//Count is at most LINE_BUNDLE
+	double shiftedT[LINE_BUNDLE], shiftedY[LINE_BUNDLE];
+	if (_viewT || _viewV)
+	{
+		for (int i = 0; i < count; i++)
 		{
-			double nextV = 0;
-			if (!GetDerivative(t - s, curV, &nextV))
-				break;
+			shiftedT[i] = t[i] + _viewT;
+			shiftedY[i] = y[i] + _viewV;
+		}
+		t = shiftedT;
+		y = shiftedY;
+	}
 
-			//derivative limiter
-			if (fabs(nextV) > MAX_DERIV)
-					break;	
-			nextV = nextV * s + curV;
-			
-			if (fabs(curV) <= _dspRange && fabs(nextV) <= _dspRange)
-				ImageDrawLine(img, TToPx(t - s), VToPx(curV),
-					TToPx(t), VToPx(nextV), color);
+	const double *registers[MAX_SLOTS];
+	if (_tSlot != -1) registers[_tSlot] = t;
+	if (_ySlot != -1) registers[_ySlot] = y;
 
-			curV = nextV;
-		}
+	//Only the interpreter carries derivatives, whatever the engine
+	return EvaluateFormulaBatchDual(&_formula, registers, _ySlot, count, ret, dret, valid);
+}
+bool EvaluateDerivativeBatch(const double *t, const double *y, int count, double *ret, bool *valid)
+{
+	const double *registers[MAX_SLOTS];
+	if (_tSlot != -1) registers[_tSlot] = t;
+	if (_ySlot != -1) registers[_ySlot] = y;
+
+	if (_engine == ENGINE_JIT) return EvaluateFormulaJit(&_jit, registers, count, ret, valid);
+	if (_engine == ENGINE_AOT) return EvaluateFormulaAot(&_aot, registers, count, ret, valid);
+	return EvaluateFormulaBatch(&_formula, registers, count, ret, valid);
+}
+bool EvaluateDerivativeColumn(double t, const double *y, int count, double *ret, bool *valid)
+{
+	//Every point shares t, so bind it and let the t-only parts fold away.
+	//Compiled code would have to be rebuilt for every t, so it keeps t as a register
+	if (_engine == ENGINE_INTERP)
+	{
+		static _Thread_local Formula residual; //Per thread, its memory is reused across columns
+		const double *registers[MAX_SLOTS];
+		if (_ySlot != -1) registers[_ySlot] = y;
+
+		if (SpecializeFormula(&_formula, _tSlot, t, &residual))
+			return EvaluateFormulaBatch(&residual, registers, count, ret, valid);
+	}
+
+	//Otherwise t is fed as a register
+	double ts[FORMULA_BATCH];
+	bool ok = true;
+	for (int i = 0; i < FORMULA_BATCH; i++) ts[i] = t;
+	for (int i = 0; i < count; i += FORMULA_BATCH)
+	{
+		int n = count - i < FORMULA_BATCH ? count - i : FORMULA_BATCH;
+		ok &= EvaluateDerivativeBatch(ts, y + i, n, ret + i, valid + i);
 	}
+	return ok;
+}
+int GetLineDerivatives(const double *t, double columnT, const double *y, int count, double *ret, double *dret, bool *valid)
+{
+	//Per point t, or columnT shared by all when t is NULL. Derivatives in y when dret is not NULL.
+	//Returns how many points were evaluated exactly, count is at most LINE_BUNDLE
+	double missT[LINE_BUNDLE], missY[LINE_BUNDLE], missRet[LINE_BUNDLE], missDret[LINE_BUNDLE];
+	bool missValid[LINE_BUNDLE];
+	int misses[LINE_BUNDLE], missC = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (_grid.nodes && SampleFieldGrid(&_grid, t ? t[i] : columnT, y[i], &ret[i], dret ? &dret[i] : NULL))
+		{
+			valid[i] = true;
+			continue;
+		}
+
+		misses[missC] = i;
+		missT[missC] = t ? t[i] : columnT;
+		missY[missC++] = y[i];
+	}
+
+	//Whatever the grid could not serve is evaluated in one go
+	if (!missC) return 0;
+	if (dret) GetDerivativeDual(missT, missY, missC, missRet, missDret, missValid);
+	else if (t) GetDerivativeBatch(missT, missY, missC, missRet, missValid);
+	else GetDerivativeColumn(columnT, missY, missC, missRet, missValid);
+
+	for (int i = 0; i < missC; i++)
+	{
+		ret[misses[i]] = missRet[i];
+		if (dret) dret[misses[i]] = missDret[i];
+		valid[misses[i]] = missValid[i];
+	}
+	return missC;
+}
+int GetDerivativeInterval(double tLo, double tHi, double yLo, double yHi, FormulaInterval *ret)
+{
+	FormulaInterval registers[MAX_SLOTS];
+	if (_tSlot != -1) registers[_tSlot] = (FormulaInterval){ .lo = tLo + _viewT, .hi = tHi + _viewT, .undefined = FORMULA_DEFINED };
+	if (_ySlot != -1) registers[_ySlot] = (FormulaInterval){ .lo = yLo + _viewV, .hi = yHi + _viewV, .undefined = FORMULA_DEFINED };
+
+	return EvaluateFormulaInterval(&_formula, registers, ret);
+}
+
+
+
+double GetTimeMs()
+{
+	//Wall time, clock() would add up every thread
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+
+
+int TToPx(double spc)
+{
+	return (int)round(TToSubPx(spc));
+}
+int VToPx(double spc)
+{
+	return (int)round(VToSubPx(spc));
+}
+double TToSubPx(double spc)
+{
+	return (_canvasWidth / 2) + spc * (_canvasWidth / _dspRange) * 0.5 - _canvasLeft;
+}
+double VToSubPx(double spc)
+{
+	return (_canvasWidth / 2) - spc * (_canvasWidth / _dspRange) * 0.5 - _canvasTop;
+}
+
+
+
+void ExportDisplay()
+{
+	if (_exportWidth)
+	{
+		ExportTiles();
+		return;
+	}
+
+	Image renderedImg = GenImageColor(_canvasWidth, _canvasWidth, BLACK);
+	double diff = DrawCanvas(&renderedImg, NULL);
+	ExportImage(renderedImg, _exportPath);
+	UnloadImage(renderedImg);
+
+	if (printPerf) printf("Total time elapsed: %.2fms.\n", diff);
+}
+void RunWindow()
+{
+	InitWindow(_pxWidth, _pxWidth, "Direction Field viewer");
+	SetTargetFPS(VIEW_FPS);
+
+	//Exports show the starting display, as without a window
+	if (strlen(_exportPath))
+	{
+		BeginDrawing();
+		DrawText("Generating...", 10, 10, 20, WHITE);
+		EndDrawing();
+		ExportDisplay();
+	}
+
+	ViewState view = { .range = _dspRange, .sampleMult = _sampleMult };
+	if (!InitTileCache(&view.tiles, VIEW_CACHE))
+		fprintf(stderr, "Failed to allocate the tile cache, tiles are rendered every frame.\n");
+	if (!StartViewRenderer())
+		fprintf(stderr, "Failed to start the render thread, the window waits for every job.\n");
+
+	while (!WindowShouldClose())
+	{
+		if (UpdateView(&view))
+		{
+			view.linesPass = 0;
+			__atomic_store_n(&_cancelRender, true, __ATOMIC_RELAXED);
+		}
+
+		//Whatever finished is shown right away, the next job goes out once the last one is done
+		if (CollectViewResults(&view)) PlanViewJob(&view);
+
+		BeginDrawing();
+		ClearBackground(BLACK);
+		DrawView(&view);
+		EndDrawing();
+	}
+
+	StopViewRenderer();
+	FreeTileCache(&view.tiles);
+	if (view.lines.id) UnloadTexture(view.lines);
+	CloseWindow();
+}
+bool UpdateView(ViewState *view)
+{
+	double scale = _pxWidth * 0.5 / GetViewRange(view, view->level); //Window pixels per unit
+	bool moved = false;
+
+	if (IsKeyPressed(KEY_HOME))
+	{
+		view->t = view->v = 0;
+		view->level = 0;
+		moved = true;
+	}
+
+	//Dragging moves the plane along with the cursor
+	Vector2 delta = GetMouseDelta();
+	if (IsMouseButtonDown(MOUSE_BUTTON_LEFT) && (delta.x || delta.y))
+	{
+		view->t -= delta.x / scale;
+		view->v += delta.y / scale;
+		moved = true;
+	}
+
+	//Zooming keeps the point under the cursor in place, within the ranges -r allows
+	view->wheel += GetMouseWheelMove();
+	int level = view->level + (int)view->wheel;
+	view->wheel -= (int)view->wheel;
+	while (level > view->level && GetViewRange(view, level) < MIN_DSP_RANGE) level--;
+	while (level < view->level && GetViewRange(view, level) > MAX_DSP_RANGE) level++;
+	if (level != view->level)
+	{
+		Vector2 mouse = GetMousePosition();
+		double offsetX = mouse.x - _pxWidth / 2.0, offsetY = mouse.y - _pxWidth / 2.0;
+		double t = view->t + offsetX / scale, v = view->v - offsetY / scale;
+
+		view->level = level;
+		scale = _pxWidth * 0.5 / GetViewRange(view, level);
+		view->t = t - offsetX / scale;
+		view->v = v + offsetY / scale;
+		moved = true;
+	}
+
+	if (moved) view->lastMove = GetTimeMs();
+	return moved;
+}
+bool CollectViewResults(ViewState *view)
+{
+	//Uploads are quick next to rendering, so the render thread rarely waits on the lock for them
+	pthread_mutex_lock(&_renderer.lock);
+	for (int i = 0; i < _renderer.resultC; i++)
+	{
+		ViewResult *result = &_renderer.results[i];
+		Texture texture = LoadTextureFromImage(result->image);
+		UnloadImage(result->image);
+
+		//Tiles belong to the world, so they are kept even if the view moved on while they rendered
+		if (!result->lines)
+		{
+			StoreTile(&view->tiles, result->level, result->x, result->y, texture, result->draft);
+			continue;
+		}
+
+		if (view->lines.id) UnloadTexture(view->lines);
+		view->lines = texture;
+		view->linesT = result->t;
+		view->linesV = result->v;
+		view->linesLevel = result->level;
+		if (result->t == view->t && result->v == view->v && result->level == view->level)
+			view->linesPass = result->draft ? 1 : 2;
+	}
+	_renderer.resultC = 0;
+	bool idle = !_renderer.busy;
+	pthread_mutex_unlock(&_renderer.lock);
+
+	return idle;
+}
+void PlanViewJob(ViewState *view)
+{
+	static ViewJob job;
+	bool lines = (_drawFlags & (DRAW_CENTRAL_LINES | DRAW_LEFT_EDGE_LINES | DRAW_RIGHT_EDGE_LINES))
+		&& GetTimeMs() - view->lastMove >= VIEW_SETTLE_MS;
+
+	job.level = view->level;
+	job.range = GetViewRange(view, view->level);
+	job.t = view->t;
+	job.v = view->v;
+
+	//Drafts of the tiles and then of the lines come before any refinement, lines wait until the view rests
+	bool tiles = FindViewTiles(view, false, &job);
+	job.draft = tiles || (lines && view->linesPass == 0);
+	if (!job.draft) tiles = FindViewTiles(view, true, &job);
+	job.lines = !tiles;
+	if (job.lines && !(lines && view->linesPass < 2))
+		return;
+
+	SubmitViewJob(&job);
+}
+int FindViewTiles(ViewState *view, bool drafts, ViewJob *job)
+{
+	double range = GetViewRange(view, view->level);
+	double first = GetTileEdge(view, view->level, 0), size = GetTileEdge(view, view->level, 1) - first;
+	double distances[VIEW_MAX_TILES];
+
+	//Missing tiles of the current level, or those only drafted, nearest the center first
+	job->tileC = 0;
+	int left = (int)floor((view->t - range - first) / size), right = (int)ceil((view->t + range - first) / size) - 1;
+	int top = (int)floor((-view->v - range - first) / size), bottom = (int)ceil((-view->v + range - first) / size) - 1;
+	for (int y = top; y <= bottom; y++)
+		for (int x = left; x <= right; x++)
+		{
+			const CachedTile *tile = FindTile(&view->tiles, view->level, x, y);
+			if (drafts ? !tile || !tile->draft : tile != NULL) continue;
+
+			double dx = first + (x + 0.5) * size - view->t, dy = -(first + (y + 0.5) * size) - view->v;
+			int i = job->tileC++;
+			for (; i > 0 && distances[i - 1] > dx * dx + dy * dy; i--)
+			{
+				distances[i] = distances[i - 1];
+				job->tiles[i] = job->tiles[i - 1];
+			}
+			distances[i] = dx * dx + dy * dy;
+			job->tiles[i].x = x;
+			job->tiles[i].y = y;
+		}
+
+	return job->tileC;
+}
+bool StartViewRenderer()
+{
+	_renderer.started = !pthread_create(&_renderer.thread, NULL, RunViewRenderer, NULL);
+	return _renderer.started;
+}
+void StopViewRenderer()
+{
+	pthread_mutex_lock(&_renderer.lock);
+	_renderer.stopping = true;
+	__atomic_store_n(&_cancelRender, true, __ATOMIC_RELAXED);
+	pthread_cond_signal(&_renderer.wake);
+	pthread_mutex_unlock(&_renderer.lock);
+
+	if (_renderer.started) pthread_join(_renderer.thread, NULL);
+	for (int i = 0; i < _renderer.resultC; i++) UnloadImage(_renderer.results[i].image);
+
+	_renderer.started = _renderer.stopping = _renderer.busy = false;
+	_renderer.resultC = 0;
+	__atomic_store_n(&_cancelRender, false, __ATOMIC_RELAXED);
+}
+void SubmitViewJob(const ViewJob *job)
+{
+	pthread_mutex_lock(&_renderer.lock);
+	_renderer.job = *job;
+	_renderer.busy = true;
+	__atomic_store_n(&_cancelRender, false, __ATOMIC_RELAXED);
+	pthread_cond_signal(&_renderer.wake);
+	pthread_mutex_unlock(&_renderer.lock);
+
+	//Without a render thread the window renders the job itself
+	if (!_renderer.started)
+	{
+		RunViewJob(&_renderer.job);
+		_renderer.busy = false;
+	}
+}
+void *RunViewRenderer(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&_renderer.lock);
+	while (true)
+	{
+		while (!_renderer.stopping && !_renderer.busy) pthread_cond_wait(&_renderer.wake, &_renderer.lock);
+		if (_renderer.stopping) break;
+		pthread_mutex_unlock(&_renderer.lock);
+
+		RunViewJob(&_renderer.job);
+
+		pthread_mutex_lock(&_renderer.lock);
+		_renderer.busy = false;
+	}
+	pthread_mutex_unlock(&_renderer.lock);
+
+	return NULL;
+}
+void RunViewJob(const ViewJob *job)
+{
+	double start = GetTimeMs();
+	int samplePow = _samplePow, sampleMult = _sampleMult;
+	double dspRange = _dspRange;
+	bool perf = printPerf;
+
+	//Drafts only stand in until the full pass lands, so they are not super sampled either
+	printPerf = false;
+	_draft = job->draft;
+	if (_draft)
+	{
+		_samplePow = 0;
+		_sampleMult = 1;
+	}
+	_dspRange = job->range;
+	_canvasWidth = _pxWidth * _sampleMult;
+
+	int renderedC = job->lines ? TraceViewLines(job) : RenderViewTiles(job);
+
+	_draft = false;
+	_samplePow = samplePow;
+	_sampleMult = sampleMult;
+	_dspRange = dspRange;
+	_canvasWidth = _pxWidth * _sampleMult;
+	printPerf = perf;
+
+	if (printPerf) printf("View %s %s time elapsed: %.2fms, %d of %d rendered.\n", job->draft ? "draft" : "full",
+		job->lines ? "lines" : "tiles", GetTimeMs() - start, renderedC, job->lines ? 1 : job->tileC);
+}
+int RenderViewTiles(const ViewJob *job)
+{
+	//Tiles are windows into the canvas of their level, centered on the world origin, with vectors past its display
+	_worldGrid = true;
+	MapRegions();
+	BuildGlyphs();
+
+	int renderedC = 0;
+	for (; renderedC < job->tileC && !IsRenderCancelled(); renderedC++)
+	{
+		int x = job->tiles[renderedC].x, y = job->tiles[renderedC].y;
+		Image tile = DrawExportTile(_pxWidth / 2 + x * VIEW_TILE, _pxWidth / 2 + y * VIEW_TILE, VIEW_TILE, VIEW_TILE, NULL);
+		if (!tile.data) break;
+
+		PostViewResult((ViewResult){ .image = tile, .draft = job->draft, .level = job->level, .x = x, .y = y });
+	}
+
+	FreeRegionMap(&_regions);
+	FreeGlyphs();
+	_worldGrid = false;
+	_canvasLeft = _canvasTop = 0;
+	return renderedC;
+}
+bool TraceViewLines(const ViewJob *job)
+{
+	//Lines are seeded around the display, so the view becomes the display and formulas are shifted to it
+	_viewT = job->t;
+	_viewV = job->v;
+	Image img = GenImageColor(_canvasWidth, _canvasWidth, BLANK);
+	bool traced = img.data != NULL;
+	if (traced)
+	{
+		MapRegions();
+		DrawLines(&img);
+		FreeRegionMap(&_regions);
+		ResolveSamples(&img, _pxWidth, _pxWidth);
+
+		//Lines cut short by a cancel would pass for the whole view
+		traced = !IsRenderCancelled();
+		if (traced) PostViewResult((ViewResult){ .image = img, .lines = true, .draft = job->draft, .level = job->level, .t = job->t, .v = job->v });
+		else UnloadImage(img);
+	}
+	else fprintf(stderr, "Failed to allocate view lines.\n");
+
+	_viewT = _viewV = 0;
+	return traced;
+}
+void PostViewResult(ViewResult result)
+{
+	pthread_mutex_lock(&_renderer.lock);
+	if (_renderer.resultC < VIEW_MAX_TILES) _renderer.results[_renderer.resultC++] = result;
+	else UnloadImage(result.image);
+	pthread_mutex_unlock(&_renderer.lock);
+}
+bool IsRenderCancelled()
+{
+	return __atomic_load_n(&_cancelRender, __ATOMIC_RELAXED);
+}
+void DrawView(ViewState *view)
+{
+	//Other levels stand in, rescaled, wherever the current one has not rendered yet. Nearer levels go on top
+	for (int distance = VIEW_FALLBACK_LEVELS; distance > 0; distance--)
+	{
+		DrawViewLevel(view, view->level - distance);
+		DrawViewLevel(view, view->level + distance);
+	}
+	DrawViewLevel(view, view->level);
+
+	if (!view->lines.id)
+		return;
+
+	double scale = _pxWidth * 0.5 / GetViewRange(view, view->level), range = GetViewRange(view, view->linesLevel);
+	Rectangle source = { 0, 0, view->lines.width, view->lines.height };
+	Rectangle dest = {
+		_pxWidth / 2.0 + (view->linesT - range - view->t) * scale, _pxWidth / 2.0 - (view->linesV + range - view->v) * scale,
+		2 * range * scale, 2 * range * scale
+	};
+	DrawTexturePro(view->lines, source, dest, (Vector2){ 0, 0 }, 0, WHITE);
+}
+void DrawViewLevel(ViewState *view, int level)
+{
+	double range = GetViewRange(view, view->level), scale = _pxWidth * 0.5 / range;
+	if (GetViewRange(view, level) < MIN_DSP_RANGE || GetViewRange(view, level) > MAX_DSP_RANGE)
+		return;
+
+	double first = GetTileEdge(view, level, 0), size = GetTileEdge(view, level, 1) - first;
+	int left = (int)floor((view->t - range - first) / size), right = (int)ceil((view->t + range - first) / size) - 1;
+	int top = (int)floor((-view->v - range - first) / size), bottom = (int)ceil((-view->v + range - first) / size) - 1;
+
+	for (int y = top; y <= bottom; y++)
+		for (int x = left; x <= right; x++)
+		{
+			const CachedTile *tile = FindTile(&view->tiles, level, x, y);
+			if (!tile) continue;
+
+			//Rounded edges, so neighbouring tiles neither overlap nor leave gaps
+			float fromX = roundf(_pxWidth / 2.0 + (first + x * size - view->t) * scale);
+			float fromY = roundf(_pxWidth / 2.0 + (first + y * size + view->v) * scale);
+			float toX = roundf(_pxWidth / 2.0 + (first + (x + 1) * size - view->t) * scale);
+			float toY = roundf(_pxWidth / 2.0 + (first + (y + 1) * size + view->v) * scale);
+			Rectangle source = { 0, 0, tile->texture.width, tile->texture.height };
+			DrawTexturePro(tile->texture, source, (Rectangle){ fromX, fromY, toX - fromX, toY - fromY }, (Vector2){ 0, 0 }, 0, WHITE);
+		}
+}
+double GetViewRange(const ViewState *view, int level)
+{
+	return view->range * pow(VIEW_ZOOM_STEP, -level);
+}
+double GetTileEdge(const ViewState *view, int level, int index)
+{
+	//Where column index starts on the canvas of the level, in world units, as DrawExportTile places it. Rows mirror it
+	int canvasWidth = _pxWidth * view->sampleMult;
+	double scale = canvasWidth * 0.5 / GetViewRange(view, level);
+	return ((double)(_pxWidth / 2 + index * VIEW_TILE) * view->sampleMult - canvasWidth / 2) / scale;
+}
+bool GenerateHeadless()
+{
+	//Tiled exports draw their own tiles
+	if (_exportWidth)
+		return ExportTiles();
+
+	double start = GetTimeMs();
+	RenderCosts spent;
+	if (_budget)
+	{
+		if (!_renderCostsKnown) CalibrateRenderCosts();
+		PickQuality(_budget - (GetTimeMs() - start));
+	}
+	double renderStart = GetTimeMs();
+
+	//Nothing is shown, so the canvas is exported as drawn, the same as the window would export it
+	size_t pixelC = (size_t)_canvasWidth * _canvasWidth;
+	if (pixelC <= _canvasCapacity)
+	{
+		_canvas.width = _canvas.height = _canvasWidth;
+		ImageClearBackground(&_canvas, BLACK);
+	}
+	else
+	{
+		UnloadImage(_canvas);
+		_canvas = GenImageColor(_canvasWidth, _canvasWidth, BLACK);
+		_canvasCapacity = _canvas.data ? pixelC : 0;
+		if (!_canvas.data)
+		{
+			fprintf(stderr, "Failed to allocate a %dpx canvas.\n", _canvasWidth);
+			return false;
+		}
+	}
+
+	double diff = DrawCanvas(&_canvas, &spent);
+	if (printPerf) printf("Total time elapsed: %.2fms.\n", diff);
+
+	//Budgeted frames come out at the size asked for whichever sampling power their level drew at
+	if (_budget && _samplePow)
+	{
+		ResolveSamples(&_canvas, _pxWidth, _pxWidth);
+		_canvasCapacity = _canvas.data ? (size_t)_canvas.width * _canvas.height : 0;
+	}
+
+	//Daemon requests may take the canvas itself instead
+	double exportStart = GetTimeMs();
+	bool exported = !strlen(_exportPath) || ExportImage(_canvas, _exportPath);
+	if (!exported) fprintf(stderr, "Failed to export '%s'.\n", _exportPath);
+
+	//Clearing and resolving the canvas grow with its pixels like the rest, exporting with the output's
+	if (_budget)
+	{
+		double end = GetTimeMs();
+		_qualitySpent = end - start;
+		spent.other = exportStart - renderStart - spent.vectors - spent.lines;
+		spent.output = strlen(_exportPath) ? end - exportStart : 0;
+		LearnRenderCosts(&spent);
+
+		const Quality *quality = &_qualities[_quality];
+		printf("Quality %d of %d in %.2fms of a %.2fms budget: vectors and lines %gx and %gx apart, line steps %gx as long, tolerance %g, sampling power %d.\n",
+			_quality, QUALITY_LEVELS - 1, _qualitySpent, _budget, quality->vectorSpread, quality->lineSpread, quality->stepSpread, _tolerance, _samplePow);
+	}
+	return exported;
+}
+double DrawCanvas(Image *img, RenderCosts *spent)
+{
+	if (printPerf) printf("Using %s formula kernels%s.\n", GetFormulaKernels()->name,
+		_engine == ENGINE_JIT ? " with JIT" : _engine == ENGINE_AOT ? " with native code" : "");
+
+	double start = GetTimeMs();
+	MapRegions();
+	BuildGlyphs();
+	DrawAxis(img);
+	double vectorStart = GetTimeMs();
+	DrawVectors(img);
+	double lineStart = GetTimeMs();
+	DrawLines(img);
+	double lineEnd = GetTimeMs();
+	FreeRegionMap(&_regions);
+	FreeGlyphs();
+
+	double diff = GetTimeMs() - start;
+	if (spent) *spent = (RenderCosts){ lineStart - vectorStart, lineEnd - lineStart, diff - (lineEnd - vectorStart), 0 };
+	return diff;
+}
+void PickQuality(double budget)
+{
+	//The cheapest level is drawn even when nothing fits
+	int level = 0;
+	for (int i = 1; _renderCostsKnown && i < QUALITY_LEVELS; i++)
+	{
+		RenderCosts work = GetRenderWork(i);
+		double predicted = work.vectors * _renderCosts.vectors + work.lines * _renderCosts.lines
+			+ work.other * _renderCosts.other + work.output * _renderCosts.output;
+		if (predicted > budget) break;
+		level = i;
+	}
+	SetQuality(level);
+}
+void CalibrateRenderCosts()
+{
+	//Vectors and lines are spaced in display units, so a small canvas does the same work for them as a full one
+	//and only the per pixel part shrinks. Its export goes to a file of its own under $TMPDIR, in the format of the real one
+	int pxWidth = _pxWidth, probeFile = -1;
+	bool perf = printPerf;
+	char probePath[MAX_PATH + 1];
+	RenderCosts spent;
+
+	const char *extension = strrchr(_exportPath, '.'), *tmp = getenv("TMPDIR");
+	if (!extension || strchr(extension, '/')) extension = "";
+	if (!tmp || !*tmp) tmp = "/tmp";
+	if (strlen(_exportPath) && snprintf(probePath, sizeof(probePath), "%s/dfv-probe-XXXXXX%s", tmp, extension) < (int)sizeof(probePath))
+		probeFile = mkstemps(probePath, strlen(extension));
+
+	_pxWidth = pxWidth < BUDGET_PROBE_WIDTH ? pxWidth : BUDGET_PROBE_WIDTH;
+	printPerf = false;
+	SetQuality(0);
+
+	double start = GetTimeMs();
+	Image probe = GenImageColor(_canvasWidth, _canvasWidth, BLACK);
+	if (probe.data)
+	{
+		DrawCanvas(&probe, &spent);
+		double exportStart = GetTimeMs();
+		if (probeFile != -1) ExportImage(probe, probePath);
+		spent.other = exportStart - start - spent.vectors - spent.lines;
+		spent.output = probeFile != -1 ? GetTimeMs() - exportStart : 0;
+		LearnRenderCosts(&spent);
+		UnloadImage(probe);
+	}
+
+	//Only ever removes the file mkstemps made for it
+	if (probeFile != -1)
+	{
+		close(probeFile);
+		unlink(probePath);
+	}
+
+	printPerf = perf;
+	_pxWidth = pxWidth;
+}
+void SetQuality(int level)
+{
+	const Quality *quality = &_qualities[level];
+	_quality = level;
+	_vectorSpread = quality->vectorSpread;
+	_lineSpread = quality->lineSpread;
+	_stepSpread = quality->stepSpread;
+	_tolerance = quality->tolerance;
+	_samplePow = _antialias ? 0 : quality->samplePow;
+	_sampleMult = 1 << _samplePow;
+	_canvasWidth = _pxWidth * _sampleMult;
+}
+void LearnRenderCosts(const RenderCosts *spent)
+{
+	//Parts that did no work this time keep what was learned of them before
+	RenderCosts work = GetRenderWork(_quality), unit = _renderCosts;
+	if (work.vectors) unit.vectors = spent->vectors / work.vectors;
+	if (work.lines) unit.lines = spent->lines / work.lines;
+	unit.other = spent->other / work.other;
+	if (spent->output) unit.output = spent->output / work.output;
+
+	if (_renderCostsKnown)
+	{
+		unit.vectors = _renderCosts.vectors + (unit.vectors - _renderCosts.vectors) * BUDGET_COST_WEIGHT;
+		unit.lines = _renderCosts.lines + (unit.lines - _renderCosts.lines) * BUDGET_COST_WEIGHT;
+		unit.other = _renderCosts.other + (unit.other - _renderCosts.other) * BUDGET_COST_WEIGHT;
+		unit.output = _renderCosts.output + (unit.output - _renderCosts.output) * BUDGET_COST_WEIGHT;
+	}
+	_renderCosts = unit;
+	_renderCostsKnown = true;
+}
+RenderCosts GetRenderWork(int level)
+{
+	const Quality *quality = &_qualities[level];
+	int sampleMult = 1 << (_antialias ? 0 : quality->samplePow);
+	bool lines = _drawFlags & (DRAW_CENTRAL_LINES | DRAW_LEFT_EDGE_LINES | DRAW_RIGHT_EDGE_LINES);
+	int sweepC = !lines ? 0 : _layout == LAYOUT_EVEN ? 1 : (_drawFlags & DRAW_CENTRAL_LINES ? 2 : 0)
+		+ (_drawFlags & DRAW_LEFT_EDGE_LINES ? 1 : 0) + (_drawFlags & DRAW_RIGHT_EDGE_LINES ? 1 : 0);
+
+	//Vectors fill the display, lines cross it in steps that shrink with the sampling, or with the tolerance when adaptive
+	bool adaptive = _integrator == INTEGRATOR_RK45 || _integrator == INTEGRATOR_STIFF;
+	double vectorsAcross = 2 * _dspRange / (VECTOR_STEP * quality->vectorSpread) + 1;
+	double stepC = adaptive ? 2 * _dspRange / LINE_STEP * pow(DEFAULT_TOLERANCE / quality->tolerance, 1 / BUDGET_TOLERANCE_ORDER)
+		: 2 * _dspRange / (LINE_STEP * quality->stepSpread) * sampleMult;
+
+	RenderCosts work;
+	work.vectors = _drawFlags & DRAW_VECTORS ? vectorsAcross * vectorsAcross : 0;
+	work.lines = sweepC * 2 * _dspRange / (LINE_SPACING * quality->lineSpread) * stepC;
+	work.other = (double)_pxWidth * sampleMult * _pxWidth * sampleMult;
+	work.output = (double)_pxWidth * _pxWidth;
+	return work;
+}
+void ResolveSamples(Image *img, int width, int height)
+{
+	//Scale back down if super sampled
+	if (!_samplePow)
+		return;
+
+	//Apply some corrections
+	ImageColorBrightness(img, +64);
+	ImageBlurGaussian(img, _samplePow);
+	ImageResize(img, width, height);
+	ImageColorContrast(img, 30);
+}
+bool ExportTiles()
+{
+	double start = GetTimeMs();
+	int width = _exportWidth, margin = _samplePow ? EXPORT_MARGIN : 0;
+	int tileSize = (int)sqrt((double)EXPORT_TILE_MEMORY / EXPORT_PIXEL_BYTES) / _sampleMult - 2 * margin;
+	size_t bandRows = EXPORT_TILE_MEMORY / ((size_t)width * sizeof(Color)); //The band of finished rows is bounded the same way
+	if ((size_t)tileSize > bandRows) tileSize = bandRows;
+	if (tileSize < EXPORT_MIN_TILE) tileSize = EXPORT_MIN_TILE;
+
+	//PNG rows go out in order, so one band of tiles is kept at the output resolution
+	ImageStream stream;
+	if (!OpenImageStream(&stream, _exportPath, width, width))
+	{
+		fprintf(stderr, "Failed to open '%s' for export. Tiled exports are written as .png or .ppm.\n", _exportPath);
+		return false;
+	}
+	Color *band = malloc((size_t)width * tileSize * sizeof(Color));
+	SegmentList segments = { 0 };
+
+	//Tiles are windows into one canvas as wide as the export. Lines are traced once and replayed into every tile
+	_canvasWidth = width * _sampleMult;
+	MapRegions();
+	BuildGlyphs();
+	bool ok = band && TraceLines();
+	bool perf = printPerf;
+	int tileC = 0;
+	printPerf = false; //Every tile would print its own timings
+
+	for (int top = 0; ok && top < width; top += tileSize)
+	{
+		int rowC = width - top < tileSize ? width - top : tileSize;
+
+		//Segments in reach of the band, so tiles only look through those
+		_canvasLeft = 0;
+		_canvasTop = (top - margin) * _sampleMult;
+		segments.segmentC = 0;
+		for (int i = 0; i < _lineLog.listC; i++)
+		{
+			const SegmentList *list = &_lineLog.lists[i];
+			for (int j = 0; j < list->segmentC; j++)
+			{
+				const double *points = list->points + 4 * (size_t)j;
+				if (IsSegmentVisible(points, _canvasWidth, (rowC + 2 * margin) * _sampleMult))
+					AppendSegment(&segments, points[0], points[1], points[2], points[3], list->layers[j]);
+			}
+		}
+		ok &= !segments.failed;
+
+		for (int left = 0; ok && left < width; left += tileSize)
+		{
+			int columnC = width - left < tileSize ? width - left : tileSize;
+			Image tile = DrawExportTile(left, top, columnC, rowC, &segments);
+			if (!tile.data)
+			{
+				ok = false;
+				break;
+			}
+
+			for (int y = 0; y < rowC; y++)
+				memcpy(band + (size_t)y * width + left, (Color *)tile.data + (size_t)y * columnC, columnC * sizeof(Color));
+			UnloadImage(tile);
+			tileC++;
+		}
+
+		ok = ok && WriteImageRows(&stream, band, rowC);
+	}
+
+	printPerf = perf;
+	ok &= CloseImageStream(&stream);
+	_canvasWidth = _pxWidth * _sampleMult;
+	_canvasLeft = _canvasTop = 0;
+	FreeRegionMap(&_regions);
+	FreeGlyphs();
+	for (int i = 0; i < _lineLog.listC; i++)
+	{
+		free(_lineLog.lists[i].points);
+		free(_lineLog.lists[i].layers);
+	}
+	free(_lineLog.lists);
+	_lineLog.lists = NULL;
+	_lineLog.listC = 0;
+	free(segments.points); free(segments.layers);
+	free(band);
+
+	if (!ok) fprintf(stderr, "Failed to export '%s'.\n", _exportPath);
+	else if (printPerf) printf("Export time elapsed: %.2fms, %d tiles of up to %dpx.\n", GetTimeMs() - start, tileC, tileSize);
+	return ok;
+}
+Image DrawExportTile(int left, int top, int columnC, int rowC, const SegmentList *segments)
+{
+	int margin = _samplePow ? EXPORT_MARGIN : 0;
+	Image img = GenImageColor((columnC + 2 * margin) * _sampleMult, (rowC + 2 * margin) * _sampleMult, BLACK);
+	if (!img.data)
+	{
+		fprintf(stderr, "Failed to allocate export tile.\n");
+		return img;
+	}
+
+	_canvasLeft = (left - margin) * _sampleMult;
+	_canvasTop = (top - margin) * _sampleMult;
+	DrawAxis(&img);
+	DrawVectors(&img);
+	if (segments && segments->segmentC) ReplayLines(&img, segments);
+
+	ResolveSamples(&img, columnC + 2 * margin, rowC + 2 * margin);
+	if (margin) ImageCrop(&img, (Rectangle){ margin, margin, columnC, rowC });
+	return img;
+}
+bool TraceLines()
+{
+	_lineLog.listC = GetThreadCount();
+	_lineLog.lists = calloc(_lineLog.listC, sizeof(SegmentList));
+	if (!_lineLog.lists)
+	{
+		_lineLog.listC = 0;
+		return false;
+	}
+
+	//Nothing is drawn while the log is there, segments are kept instead
+	DrawLines(NULL);
+
+	for (int i = 0; i < _lineLog.listC; i++)
+		if (_lineLog.lists[i].failed) return false;
+	return true;
+}
+void ReplayLines(Image *img, const SegmentList *segments)
+{
+	Coverage coverage;
+	if (!InitCoverage(&coverage, img->width, img->height))
+	{
+		fprintf(stderr, "Failed to allocate line buffers.\n");
+		return;
+	}
+
+	for (int i = 0; i < segments->segmentC; i++)
+	{
+		const double *points = segments->points + 4 * (size_t)i;
+		if (IsSegmentVisible(points, img->width, img->height))
+			CoverSegment(&coverage, points[0], points[1], points[2], points[3], segments->layers[i]);
+	}
+
+	CompositeCoverage(&coverage, img, _lineLog.colors);
+	FreeCoverage(&coverage);
+}
+bool IsSegmentVisible(const double *points, int width, int height)
+{
+	double fromX = TToSubPx(points[0]), fromY = VToSubPx(points[1]);
+	double toX = TToSubPx(points[2]), toY = VToSubPx(points[3]);
+
+	//Lines never touch a pixel further than one past their ends
+	return fmax(fromX, toX) >= -1 && fmin(fromX, toX) <= width && fmax(fromY, toY) >= -1 && fmin(fromY, toY) <= height;
+}
+bool AppendSegment(SegmentList *list, double fromT, double fromV, double toT, double toV, uint8_t layer)
+{
+	if (list->segmentC == list->segmentCapacity)
+	{
+		int capacity = list->segmentCapacity ? list->segmentCapacity * 2 : 1024;
+		double *points = realloc(list->points, (size_t)capacity * 4 * sizeof(double));
+		if (points) list->points = points;
+		uint8_t *layers = realloc(list->layers, capacity * sizeof(uint8_t));
+		if (layers) list->layers = layers;
+
+		if (!points || !layers)
+		{
+			list->failed = true;
+			return false;
+		}
+		list->segmentCapacity = capacity;
+	}
+
+	double *points = list->points + 4 * (size_t)list->segmentC;
+	points[0] = fromT;
+	points[1] = fromV;
+	points[2] = toT;
+	points[3] = toV;
+	list->layers[list->segmentC++] = layer;
+	return true;
+}
+void MapRegions()
+{
+	if (!_culling)
+		return;
+
+	double start = GetTimeMs();
+	int leaves = 1 << REGION_DEPTH;
+
+	//Square roots reaching a leaf past the display on each side, stacked over the band lines are seeded in
+	double leaf = 2 * _dspRange / (leaves - 2), root = leaf * leaves;
+	int rootRows = 1;
+	if (_drawFlags & (DRAW_CENTRAL_LINES | DRAW_LEFT_EDGE_LINES | DRAW_RIGHT_EDGE_LINES))
+		rootRows += 2 * (int)ceil((_dspRange + LINE_RANGE_EXTEND - root / 2) / root);
+
+	if (!InitRegionMap(&_regions, -root / 2, -root * rootRows / 2, root, 1, rootRows, REGION_DEPTH))
+	{
+		fprintf(stderr, "Failed to allocate region map, drawing without culling.\n");
+		return;
+	}
+	BuildRegionMap(&_regions, GetDerivativeInterval);
+
+	if (printPerf)
+	{
+		int undefinedC = 0;
+		for (int i = 0; i < _regions.columnC * _regions.rowC; i++) undefinedC += _regions.classes[i] == FORMULA_UNDEFINED;
+		printf("Regions time elapsed: %.2fms, %ld boxes bounded, %d of %d leaves undefined.\n",
+			GetTimeMs() - start, _regions.boxC, undefinedC, _regions.columnC * _regions.rowC);
+	}
+}
+void BuildGlyphs()
+{
+	//Sprites have to hold the whole vector and the undefined circle, which sits half a vector left
+	double length = VECTOR_LENGTH * _canvasWidth / _dspRange * 0.5;
+	int center = (int)ceil(length + UNDEF_RADIUS) + 1;
+	if (!(_drawFlags & DRAW_VECTORS) || center > VECTOR_GLYPH_MAX)
+		return;
+
+	Color green = GREEN, red = RED;
+	bool ok = InitGlyphAtlas(&_arrows, VECTOR_GLYPH_BINS, center, DrawArrowGlyph, &green);
+	ok = ok && InitGlyphAtlas(&_flatArrow, 1, center, DrawArrowGlyph, &red);
+	ok = ok && InitGlyphAtlas(&_undefinedMark, 1, center, DrawUndefinedGlyph, NULL);
+	if (!ok)
+	{
+		fprintf(stderr, "Failed to allocate vector sprites, drawing vectors one by one.\n");
+		FreeGlyphs();
+	}
+}
+void FreeGlyphs()
+{
+	FreeGlyphAtlas(&_arrows);
+	FreeGlyphAtlas(&_flatArrow);
+	FreeGlyphAtlas(&_undefinedMark);
+}
+void DrawArrowGlyph(Image *sprite, int center, double angle, void *context)
+{
+	//Same shape DrawVectorTile draws, from half a vector behind the point to a whole one ahead of it
+	double length = VECTOR_LENGTH * _canvasWidth / _dspRange * 0.5;
+	double x = cos(angle) * length, y = sin(angle) * length;
+	Color color = *(Color *)context;
+
+	if (_antialias) DrawSmoothLine(sprite, center - x / 2, center + y / 2, center + x, center - y, color);
+	else ImageDrawLine(sprite, (int)round(center - x / 2), (int)round(center + y / 2), (int)round(center + x), (int)round(center - y), color);
+}
+void DrawUndefinedGlyph(Image *sprite, int center, double angle, void *context)
+{
+	(void)angle; (void)context;
+	double length = VECTOR_LENGTH * _canvasWidth / _dspRange * 0.5;
+
+	if (_antialias) DrawSmoothDisc(sprite, center - length / 2, center, UNDEF_RADIUS, RED);
+	else ImageDrawCircle(sprite, (int)round(center - length / 2), center, UNDEF_RADIUS, RED);
+}
+void DrawAxis(Image *img)
+{
+	int center = _canvasWidth / 2;
+	ImageDrawLine(img, center - _canvasLeft, 0, center - _canvasLeft, img->height, GRAY);
+	ImageDrawLine(img, 0, center - _canvasTop, img->width, center - _canvasTop, GRAY);
+}
+void DrawVectors(Image *img)
+{
+	if (!(_drawFlags & DRAW_VECTORS))
+		return;
+
+	double start = GetTimeMs();
+
+	//Every column shares the same y samples. View tiles take theirs from the world grid, across the image and as far past it as vectors reach
+	double firstT = -_dspRange, lastT = _dspRange, firstY = -_dspRange, lastY = _dspRange, step = VECTOR_STEP * _vectorSpread;
+	if (_worldGrid)
+	{
+		double scale = _canvasWidth * 0.5 / _dspRange, reach = VECTOR_LENGTH + (UNDEF_RADIUS + 1) / scale;
+		double left = (_canvasLeft - _canvasWidth / 2) / scale, top = (_canvasWidth / 2 - _canvasTop) / scale;
+		while (step * scale < VIEW_VECTOR_SPACING * _sampleMult) step *= 2;
+		if (_draft) step *= VIEW_DRAFT_VECTOR_STEP;
+
+		firstT = ceil((left + _viewT - reach) / step) * step - _viewT;
+		lastT = left + img->width / scale + reach;
+		firstY = ceil((top - img->height / scale + _viewV - reach) / step) * step - _viewV;
+		lastY = top + reach;
+	}
+
+	//Export tiles keep the display's samples, but only those across the tile and as far past it as vectors reach
+	double lowT = -INFINITY, highT = INFINITY, lowY = -INFINITY, highY = INFINITY;
+	if (!_worldGrid)
+	{
+		double scale = _canvasWidth * 0.5 / _dspRange, reach = VECTOR_LENGTH + (UNDEF_RADIUS + 1) / scale;
+		double left = (_canvasLeft - _canvasWidth / 2) / scale, top = (_canvasWidth / 2 - _canvasTop) / scale;
+		lowT = left - reach;
+		highT = left + img->width / scale + reach;
+		lowY = top - img->height / scale - reach;
+		highY = top + reach;
+	}
+
+	int rowC = 0, columnC = 0;
+	for (double y = firstY; y <= lastY; y += step) rowC += y >= lowY && y <= highY;
+	for (double t = firstT; t <= lastT; t += step) columnC += t >= lowT && t <= highT;
+	if (!rowC || !columnC)
+		return;
+
+	//A few tiles per thread, so uneven columns still balance out
+	int tileColumns = (columnC + GetThreadCount() * VECTOR_TILES_PER_THREAD - 1) / (GetThreadCount() * VECTOR_TILES_PER_THREAD);
+	int tileC = (columnC + tileColumns - 1) / tileColumns;
+
+	VectorTiles tiles = {
+		.ts = malloc(columnC * sizeof(double)), .ys = malloc(rowC * sizeof(double)),
+		.columnC = columnC, .rowC = rowC, .tileColumns = tileColumns,
+		.images = malloc(tileC * sizeof(Image)), .lefts = malloc(tileC * sizeof(int)),
+		.width = img->width, .height = img->height, .image = img
+	};
+	if (!tiles.ts || !tiles.ys || !tiles.images || !tiles.lefts)
+	{
+		fprintf(stderr, "Failed to allocate vector buffers.\n");
+		free(tiles.ts); free(tiles.ys); free(tiles.images); free(tiles.lefts);
+		return;
+	}
+
+	int i = 0;
+	for (double y = firstY; y <= lastY; y += step)
+		if (y >= lowY && y <= highY) tiles.ys[i++] = y;
+	i = 0;
+	for (double t = firstT; t <= lastT; t += step)
+		if (t >= lowT && t <= highT) tiles.ts[i++] = t;
+
+	RunParallel(tileC, DrawVectorTile, &tiles);
+
+	//Tiles are strips of whole columns, so stacking them left to right matches drawing in one pass
+	for (i = 0; i < tileC; i++)
+	{
+		Image tile = tiles.images[i];
+		if (!tile.data) continue;
+
+		ImageDraw(img, tile, (Rectangle){ 0, 0, tile.width, tile.height },
+			(Rectangle){ tiles.lefts[i], 0, tile.width, tile.height }, WHITE);
+		UnloadImage(tile);
+	}
+
+	free(tiles.ts); free(tiles.ys); free(tiles.images); free(tiles.lefts);
+
+	if (printPerf) printf("Vectors time elapsed: %.2fms.\n", GetTimeMs() - start);
+}
+void DrawVectorTile(void *context, int index)
+{
+	VectorTiles *tiles = context;
+	int first = index * tiles->tileColumns;
+	int last = first + tiles->tileColumns < tiles->columnC ? first + tiles->tileColumns : tiles->columnC;
+
+	tiles->images[index].data = NULL;
+	tiles->lefts[index] = 0;
+	if (_arrows.sprites)
+	{
+		StampVectorTile(tiles, first, last);
+		return;
+	}
+
+	//Vectors reach at most VECTOR_LENGTH past their column, circles UNDEF_RADIUS pixels
+	int left = TToPx(tiles->ts[first] - VECTOR_LENGTH) - (int)UNDEF_RADIUS - 1;
+	int right = TToPx(tiles->ts[last - 1] + VECTOR_LENGTH) + (int)UNDEF_RADIUS + 1;
+	if (left < 0) left = 0;
+	if (right >= tiles->width) right = tiles->width - 1;
+
+	tiles->lefts[index] = left;
+	if (left > right) return;
+
+	double *vs = malloc(tiles->rowC * sizeof(double)), *keptYs = malloc(tiles->rowC * sizeof(double));
+	bool *valid = malloc(tiles->rowC * sizeof(bool));
+	int *rows = malloc(tiles->rowC * sizeof(int));
+	Image tile = GenImageColor(right - left + 1, tiles->height, BLANK);
+	if (!vs || !keptYs || !valid || !rows || !tile.data)
+	{
+		fprintf(stderr, "Failed to allocate vector tile.\n");
+		free(vs); free(keptYs); free(valid); free(rows); UnloadImage(tile);
+		return;
+	}
+
+	for (int column = first; column < last; column++)
+	{
+		double t = tiles->ts[column];
+		EvaluateVectorColumn(tiles, t, vs, valid, keptYs, rows);
+
+		for (int i = 0; i < tiles->rowC; i++)
+		{
+			double a, x, y = tiles->ys[i], v = valid[i] ? vs[i] : 0;
+			a = atan(v);
+			x = cos(a) * VECTOR_LENGTH;
+			v = sin(a) * VECTOR_LENGTH;
+
+			int cornerX = TToPx(t-x/2) - left;
+			int cornerY = VToPx(y-v/2);
+			int tipX = TToPx(t+x) - left;
+			int tipY = VToPx(y+v);
+
+			if (_antialias)
+			{
+				if (valid[i]) DrawSmoothLine(&tile, TToSubPx(t-x/2) - left, VToSubPx(y-v/2), TToSubPx(t+x) - left, VToSubPx(y+v), fabs(a) < FLAT_MARGIN ? RED : GREEN);
+				else DrawSmoothDisc(&tile, TToSubPx(t-x/2) - left, VToSubPx(y-v/2), UNDEF_RADIUS, RED);
+			}
+			else if (valid[i])
+			{
+				v *= VECTOR_LENGTH; x *= VECTOR_LENGTH;
+				ImageDrawLine(&tile, cornerX, cornerY, tipX, tipY, fabs(a) < FLAT_MARGIN ? RED : GREEN);
+			}
+			else
+			{
+				ImageDrawCircle(&tile, cornerX, cornerY, UNDEF_RADIUS, RED);
+			}
+		}
+	}
+
+	free(vs); free(valid); free(keptYs); free(rows);
+	tiles->images[index] = tile;
+}
+void StampVectorTile(VectorTiles *tiles, int first, int last)
+{
+	//Sprites go straight into the image, but a tile only writes the pixel columns it owns: from halfway between its
+	//first column and the one before, to halfway between its last and the one after. Marks of neighbouring columns
+	//that reach in are stamped as well, in column order, so the result is the same as stamping every column in turn
+	int ownLeft = first ? (int)ceil((TToSubPx(tiles->ts[first - 1]) + TToSubPx(tiles->ts[first])) / 2) : 0;
+	int ownRight = last < tiles->columnC ? (int)ceil((TToSubPx(tiles->ts[last - 1]) + TToSubPx(tiles->ts[last])) / 2) : tiles->width;
+	if (ownLeft < 0) ownLeft = 0;
+	if (ownRight > tiles->width) ownRight = tiles->width;
+	if (ownLeft >= ownRight) return;
+
+	int reach = _arrows.center;
+	while (first > 0 && TToPx(tiles->ts[first - 1]) + reach >= ownLeft) first--;
+	while (last < tiles->columnC && TToPx(tiles->ts[last]) - reach < ownRight) last++;
+
+	double flatSlope = tan(FLAT_MARGIN); //Same as the angle being within FLAT_MARGIN
+	double *vs = malloc(tiles->rowC * sizeof(double)), *keptYs = malloc(tiles->rowC * sizeof(double));
+	bool *valid = malloc(tiles->rowC * sizeof(bool));
+	int *rows = malloc(tiles->rowC * sizeof(int));
+	if (!vs || !keptYs || !valid || !rows)
+	{
+		fprintf(stderr, "Failed to allocate vector tile.\n");
+		free(vs); free(keptYs); free(valid); free(rows);
+		return;
+	}
+
+	for (int column = first; column < last; column++)
+	{
+		int x = TToPx(tiles->ts[column]);
+		if (x + reach < ownLeft || x - reach >= ownRight) continue;
+
+		EvaluateVectorColumn(tiles, tiles->ts[column], vs, valid, keptYs, rows);
+		for (int i = 0; i < tiles->rowC; i++)
+		{
+			const GlyphAtlas *atlas = !valid[i] ? &_undefinedMark : fabs(vs[i]) < flatSlope ? &_flatArrow : &_arrows;
+			StampGlyph(atlas, GetGlyph(atlas, vs[i]), tiles->image, x, VToPx(tiles->ys[i]), ownLeft, ownRight);
+		}
+	}
+
+	free(vs); free(valid); free(keptYs); free(rows);
+}
+void EvaluateVectorColumn(const VectorTiles *tiles, double t, double *vs, bool *valid, double *keptYs, int *rows)
+{
+	//Rows proven undefined are not evaluated, the others are packed to the front and spread back after
+	int keptC = 0;
+	for (int i = 0; i < tiles->rowC; i++)
+	{
+		if (_regions.classes && GetRegion(&_regions, t, tiles->ys[i], NULL, NULL) == FORMULA_UNDEFINED)
+			continue;
+		rows[keptC] = i;
+		keptYs[keptC++] = tiles->ys[i];
+	}
+
+	GetDerivativeColumn(t, keptYs, keptC, vs, valid);
+	for (int i = tiles->rowC - 1, j = keptC - 1; i >= 0; i--)
+	{
+		bool kept = j >= 0 && rows[j] == i;
+		vs[i] = kept ? vs[j] : 0;
+		valid[i] = kept && valid[j];
+		if (kept) j--;
+	}
+}
+void DrawLines(Image *img)
+{
+	double start = GetTimeMs();
+	LineSweep sweeps[4];
+	int sweepC = 0;
+	double bottom = -_dspRange - LINE_RANGE_EXTEND, top = _dspRange + LINE_RANGE_EXTEND;
+	double spacing = LINE_SPACING * _lineSpread * (_draft ? VIEW_DRAFT_LINE_SPACING : 1), lineStep = LINE_STEP * _stepSpread;
+	bool even = _layout == LAYOUT_EVEN && (_drawFlags & (DRAW_CENTRAL_LINES | DRAW_LEFT_EDGE_LINES | DRAW_RIGHT_EDGE_LINES));
+
+	//Evenly spaced lines never leave the display
+	if (even)
+	{
+		bottom = -_dspRange;
+		top = _dspRange;
+	}
+
+	//In drawing order, later sweeps paint over earlier ones
+	else if (_drawFlags & DRAW_CENTRAL_LINES)
+	{
+		sweeps[sweepC++] = (LineSweep){ bottom, top, spacing, lineStep, _dspRange + lineStep, lineStep, SKYBLUE };
+		sweeps[sweepC++] = (LineSweep){ bottom, top, spacing, 0, -_dspRange - lineStep, lineStep, SKYBLUE };
+	}
+	if (!even && _drawFlags & DRAW_RIGHT_EDGE_LINES)
+		sweeps[sweepC++] = (LineSweep){ bottom, top, spacing, _dspRange + lineStep, 0, lineStep, ORANGE };
+	if (!even && _drawFlags & DRAW_LEFT_EDGE_LINES)
+		sweeps[sweepC++] = (LineSweep){ bottom, top, spacing, -_dspRange - lineStep, 0, lineStep, VIOLET };
+
+	//Square cells over every seed, plus one column on each side for the steps taken past the display
+	if (_gridCells && (sweepC || even))
+	{
+		double step = 2 * _dspRange / _gridCells;
+		double gridStart = GetTimeMs();
+
+		if (!InitFieldGrid(&_grid, -_dspRange - step, bottom, step, _gridCells + 2, (int)ceil((top - bottom) / step)))
+			fprintf(stderr, "Failed to allocate slope grid, evaluating lines exactly.\n");
+		else
+		{
+			long gridEvaluations = FillFieldGrid(&_grid, GetDerivativeColumn, _tolerance);
+			if (printPerf) printf("Grid time elapsed: %.2fms, %ld derivatives evaluated, %d of %d cells exact.\n",
+				GetTimeMs() - gridStart, gridEvaluations, _grid.exactC, _grid.columnC * _grid.rowC);
+		}
+	}
+
+	long evaluations = even ? PlotEvenly(img) : sweepC ? PlotResult(img, sweeps, sweepC) : 0;
+	FreeFieldGrid(&_grid);
+
+	if (printPerf) printf("Lines time elapsed: %.2fms, %ld derivatives evaluated.\n", GetTimeMs() - start, evaluations);
+}
+
+
+
+long PlotResult(Image *img, const LineSweep *sweeps, int sweepC)
+{
+	LinePlot plot = { .sweeps = sweeps, .sweepC = sweepC, .evaluations = 0 };
+	Color colors[MAX_SWEEPS];
+	bool ok = _lineLog.lists || InitCoverage(&plot.coverage, img->width, img->height);
+
+	//Seeds are laid out up front, every bundle of LINE_BUNDLE of them is one task
+	plot.firstBundle[0] = 0;
+	for (int i = 0; i < sweepC; i++)
+	{
+		int seedC = 0;
+		for (double y = sweeps[i].bottom; y <= sweeps[i].top; y += sweeps[i].spacing) seedC++;
+
+		plot.seeds[i] = malloc(seedC * sizeof(double));
+		plot.seedC[i] = seedC;
+		plot.firstBundle[i + 1] = plot.firstBundle[i] + (seedC + LINE_BUNDLE - 1) / LINE_BUNDLE;
+		colors[i] = sweeps[i].color;
+		ok &= plot.seeds[i] != NULL;
+		GetLineCulling(&sweeps[i], &plot.goneAbove[i], &plot.goneBelow[i]);
+
+		seedC = 0;
+		if (plot.seeds[i])
+			for (double y = sweeps[i].bottom; y <= sweeps[i].top; y += sweeps[i].spacing) plot.seeds[i][seedC++] = y;
+	}
+
+	if (!ok) fprintf(stderr, "Failed to allocate line buffers.\n");
+	else
+	{
+		//Streamlines end at very different times, stealing evens that out
+		RunParallel(plot.firstBundle[sweepC], PlotBundle, &plot);
+		if (_lineLog.lists) memcpy(_lineLog.colors, colors, sizeof(colors));
+		else CompositeCoverage(&plot.coverage, img, colors);
+	}
+
+	for (int i = 0; i < sweepC; i++) free(plot.seeds[i]);
+	FreeCoverage(&plot.coverage);
+
+	return plot.evaluations;
+}
+void PlotBundle(void *context, int index)
+{
+	LinePlot *plot = context;
+	if (IsRenderCancelled())
+		return;
+
+	int sweep = 0;
+	while (index >= plot->firstBundle[sweep + 1]) sweep++;
+
+	int first = (index - plot->firstBundle[sweep]) * LINE_BUNDLE;
+	int alive = plot->seedC[sweep] - first < LINE_BUNDLE ? plot->seedC[sweep] - first : LINE_BUNDLE;
+	double curV[LINE_BUNDLE];
+	PointList runs[LINE_BUNDLE] = { 0 };
+	long evaluations;
+	memcpy(curV, plot->seeds[sweep] + first, alive * sizeof(double));
+
+	if (_integrator == INTEGRATOR_RK4) evaluations = PlotRk4(plot, sweep, curV, runs, alive);
+	else if (_integrator == INTEGRATOR_RK45) evaluations = PlotRk45(plot, sweep, curV, runs, alive);
+	else if (_integrator == INTEGRATOR_STIFF) evaluations = PlotStiff(plot, sweep, curV, runs, alive);
+	else evaluations = PlotEuler(plot, sweep, curV, runs, alive);
+
+	//Lines that ended on the way still hold their last run
+	for (int i = 0; i < LINE_BUNDLE; i++)
+	{
+		FlushRun(plot, sweep, &runs[i]);
+		free(runs[i].ts); free(runs[i].ys);
+	}
+
+	__atomic_fetch_add(&plot->evaluations, evaluations, __ATOMIC_RELAXED);
+}
+long PlotEuler(LinePlot *plot, int sweep, double *curV, PointList *runs, int alive)
+{
+	const LineSweep *lines = &plot->sweeps[sweep];
+	bool leftToRight = lines->start < lines->end;
+	double s = lines->step * (leftToRight ? 1 : -1) / _sampleMult;
+	double nextV[LINE_BUNDLE];
+	bool valid[LINE_BUNDLE];
+	int lanes[LINE_BUNDLE];	//Run of each line, lines move down as others end
+	long evaluations = 0;
+	for (int i = 0; i < alive; i++) lanes[i] = i;
+
+	//All seeds in the bundle advance together, one step of t at a time
+	for (double t = lines->start; alive && (leftToRight ? t <= lines->end : t >= lines->end); t += s)
+	{
+		evaluations += GetLineDerivatives(NULL, t - s, curV, alive, nextV, NULL, valid);
+
+		//Advance surviving lines and compact them to the front
+		int kept = 0;
+		for (int i = 0; i < alive; i++)
+		{
+			if (!valid[i])
+				continue;
+
+			//derivative limiter
+			if (fabs(nextV[i]) > MAX_DERIV)
+				continue;
+			nextV[i] = nextV[i] * s + curV[i];
+
+			PlotSegment(plot, sweep, &runs[lanes[i]], t - s, curV[i], t, nextV[i]);
+			if (IsLineGone(plot, sweep, t, nextV[i]))
+				continue;
+
+			lanes[kept] = lanes[i];
+			curV[kept++] = nextV[i];
+		}
+		alive = kept;
+	}
+
+	return evaluations;
+}
+long PlotRk4(LinePlot *plot, int sweep, double *curV, PointList *runs, int alive)
+{
+	const LineSweep *lines = &plot->sweeps[sweep];
+	bool leftToRight = lines->start < lines->end;
+	double s = lines->step * (leftToRight ? 1 : -1) / _sampleMult;
+	double k[4][LINE_BUNDLE], stage[LINE_BUNDLE];
+	bool valid[4][LINE_BUNDLE];
+	int lanes[LINE_BUNDLE];
+	long evaluations = 0;
+	for (int i = 0; i < alive; i++) lanes[i] = i;
+
+	//Starts from the point the Euler loop samples first, every line shares t
+	for (double t = lines->start - s; alive && (leftToRight ? t < lines->end : t > lines->end); )
+	{
+		double h = s * LINE_RK4_STRIDE;
+		if (leftToRight ? t + h > lines->end : t + h < lines->end) h = lines->end - t;
+
+		evaluations += GetLineDerivatives(NULL, t, curV, alive, k[0], NULL, valid[0]);
+		for (int i = 0; i < alive; i++) stage[i] = curV[i] + h / 2 * k[0][i];
+		evaluations += GetLineDerivatives(NULL, t + h / 2, stage, alive, k[1], NULL, valid[1]);
+		for (int i = 0; i < alive; i++) stage[i] = curV[i] + h / 2 * k[1][i];
+		evaluations += GetLineDerivatives(NULL, t + h / 2, stage, alive, k[2], NULL, valid[2]);
+		for (int i = 0; i < alive; i++) stage[i] = curV[i] + h * k[2][i];
+		evaluations += GetLineDerivatives(NULL, t + h, stage, alive, k[3], NULL, valid[3]);
+
+		int kept = 0;
+		for (int i = 0; i < alive; i++)
+		{
+			if (!valid[0][i] || !valid[1][i] || !valid[2][i] || !valid[3][i])
+				continue;
+
+			//derivative limiter, same as Euler
+			if (fabs(k[0][i]) > MAX_DERIV)
+				continue;
+			double next = curV[i] + h / 6 * (k[0][i] + 2 * k[1][i] + 2 * k[2][i] + k[3][i]);
+
+			PlotSegment(plot, sweep, &runs[lanes[i]], t, curV[i], t + h, next);
+			if (IsLineGone(plot, sweep, t + h, next))
+				continue;
+
+			lanes[kept] = lanes[i];
+			curV[kept++] = next;
+		}
+		alive = kept;
+		t += h;
+	}
+
+	return evaluations;
+}
+long PlotRk45(LinePlot *plot, int sweep, double *curV, PointList *runs, int alive)
+{
+	//Dormand-Prince 5(4). The last stage is taken at the 5th order solution, so it is the next first stage
+	static const double c[7] = { 0, 1.0 / 5, 3.0 / 10, 4.0 / 5, 8.0 / 9, 1, 1 };
+	static const double a[7][6] = {
+		{ 0 },
+		{ 1.0 / 5 },
+		{ 3.0 / 40, 9.0 / 40 },
+		{ 44.0 / 45, -56.0 / 15, 32.0 / 9 },
+		{ 19372.0 / 6561, -25360.0 / 2187, 64448.0 / 6561, -212.0 / 729 },
+		{ 9017.0 / 3168, -355.0 / 33, 46732.0 / 5247, 49.0 / 176, -5103.0 / 18656 },
+		{ 35.0 / 384, 0, 500.0 / 1113, 125.0 / 192, -2187.0 / 6784, 11.0 / 84 },
+	};
+	//5th minus 4th order weights
+	static const double e[7] = { 71.0 / 57600, 0, -71.0 / 16695, 71.0 / 1920, -17253.0 / 339200, 22.0 / 525, -1.0 / 40 };
+
+	const LineSweep *lines = &plot->sweeps[sweep];
+	bool leftToRight = lines->start < lines->end;
+	double s = lines->step * (leftToRight ? 1 : -1) / _sampleMult;
+	double scale = _canvasWidth * 0.5 / _dspRange; //Pixels per unit, as in TToPx
+	double hMax = LINE_MAX_STEP * lines->step, hMin = lines->step / _sampleMult / LINE_MIN_STEP_DIV;
+	double t[LINE_BUNDLE], h[LINE_BUNDLE], k[7][LINE_BUNDLE], stageT[LINE_BUNDLE], stageV[LINE_BUNDLE];
+	bool valid[LINE_BUNDLE], ok[LINE_BUNDLE], last[LINE_BUNDLE];
+	int lanes[LINE_BUNDLE];
+	long evaluations = 0;
+
+	//Starts from the point the Euler loop samples first, then every line keeps its own t and step
+	evaluations += GetLineDerivatives(NULL, lines->start - s, curV, alive, k[0], NULL, valid);
+
+	int kept = 0;
+	for (int i = 0; i < alive; i++)
+	{
+		if (!valid[i] || fabs(k[0][i]) > MAX_DERIV)
+			continue;
+
+		t[kept] = lines->start - s;
+		h[kept] = leftToRight ? hMax : -hMax;
+		lanes[kept] = i;
+		curV[kept] = curV[i];
+		k[0][kept++] = k[0][i];
+	}
+	alive = kept;
+
+	while (alive)
+	{
+		for (int i = 0; i < alive; i++)
+		{
+			last[i] = leftToRight ? t[i] + h[i] >= lines->end : t[i] + h[i] <= lines->end;
+			if (last[i]) h[i] = lines->end - t[i];
+			ok[i] = true;
+		}
+
+		for (int j = 1; j < 7; j++)
+		{
+			for (int i = 0; i < alive; i++)
+			{
+				double sum = 0;
+				for (int m = 0; m < j; m++) sum += a[j][m] * k[m][i];
+				stageT[i] = t[i] + c[j] * h[i];
+				stageV[i] = curV[i] + h[i] * sum;
+			}
+			evaluations += GetLineDerivatives(stageT, 0, stageV, alive, k[j], NULL, valid);
+			for (int i = 0; i < alive; i++) ok[i] &= valid[i];
+		}
+
+		//stageV now holds the 5th order solution at t + h
+		kept = 0;
+		for (int i = 0; i < alive; i++)
+		{
+			double factor = 0.5, step = h[i];
+			bool accepted = false;
+
+			if (ok[i])
+			{
+				double err = 0, length = hypot(step, stageV[i] - curV[i]) * scale;
+				for (int j = 0; j < 7; j++) err += e[j] * k[j][i];
+				err = fabs(step * err);
+
+				factor = err > 0 ? 0.9 * pow(_tolerance / err, 0.2) : 5;
+				if (factor > 5) factor = 5;
+				if (factor < 0.2) factor = 0.2;
+				//Long visible chords would show as corners, so they are shortened like errors
+				if (fabs(curV[i]) > _dspRange && fabs(stageV[i]) > _dspRange) length = 0;
+				if (length > LINE_MAX_SEGMENT && factor > 0.9 * LINE_MAX_SEGMENT / length)
+					factor = 0.9 * LINE_MAX_SEGMENT / length;
+
+				accepted = err <= _tolerance && length <= LINE_MAX_SEGMENT;
+			}
+
+			if (accepted)
+			{
+				PlotSegment(plot, sweep, &runs[lanes[i]], t[i], curV[i], t[i] + step, stageV[i]);
+
+				//derivative limiter, same as Euler
+				if (last[i] || fabs(k[6][i]) > MAX_DERIV || IsLineGone(plot, sweep, t[i] + step, stageV[i]))
+					continue;
+				t[i] += step;
+				curV[i] = stageV[i];
+				k[0][i] = k[6][i];
+			}
+
+			//Rejected steps shrink, lines stuck on tiny steps are stiff or undefined and are dropped
+			step *= factor;
+			if (fabs(step) > hMax) step = step > 0 ? hMax : -hMax;
+			if (fabs(step) < hMin)
+				continue;
+
+			t[kept] = t[i];
+			h[kept] = step;
+			lanes[kept] = lanes[i];
+			curV[kept] = curV[i];
+			k[0][kept++] = k[0][i];
+		}
+		alive = kept;
+	}
+
+	return evaluations;
+}
+long PlotStiff(LinePlot *plot, int sweep, double *curV, PointList *runs, int alive)
+{
+	const LineSweep *lines = &plot->sweeps[sweep];
+	bool leftToRight = lines->start < lines->end;
+	double s = lines->step * (leftToRight ? 1 : -1) / _sampleMult;
+	double scale = _canvasWidth * 0.5 / _dspRange; //Pixels per unit, as in TToPx
+	double hMax = LINE_MAX_STEP * lines->step, hMin = lines->step / _sampleMult / LINE_MIN_STEP_DIV;
+	//Lanes handed to GetLineDerivatives start zeroed, only the first alive of them are ever filled
+	double t[LINE_BUNDLE] = { 0 }, stageT[LINE_BUNDLE] = { 0 }, nextV[LINE_BUNDLE] = { 0 };
+	double h[LINE_BUNDLE], k[LINE_BUNDLE], dk[LINE_BUNDLE], predicted[LINE_BUNDLE];
+	bool valid[LINE_BUNDLE], ok[LINE_BUNDLE], converged[LINE_BUNDLE], last[LINE_BUNDLE];
+	int lanes[LINE_BUNDLE];
+	long evaluations = 0;
+
+	//Starts from the point the Euler loop samples first, then every line keeps its own t and step
+	for (int i = 0; i < alive; i++)
+	{
+		t[i] = lines->start - s;
+		h[i] = leftToRight ? hMax : -hMax;
+		lanes[i] = i;
+	}
+
+	//Backward Euler, y1 = y0 + h f(t1, y1), solved by Newton with df/dy from dual numbers.
+	//Stability no longer depends on the step, so instead of the derivative limiter lines end
+	//once they leave the band the seeds started in
+	while (alive)
+	{
+		for (int i = 0; i < alive; i++)
+		{
+			last[i] = leftToRight ? t[i] + h[i] >= lines->end : t[i] + h[i] <= lines->end;
+			if (last[i]) h[i] = lines->end - t[i];
+			stageT[i] = t[i] + h[i];
+		}
+
+		//Forward Euler predictor, its distance to the corrector estimates the error
+		evaluations += GetLineDerivatives(t, 0, curV, alive, k, NULL, ok);
+		for (int i = 0; i < alive; i++)
+		{
+			predicted[i] = nextV[i] = curV[i] + h[i] * k[i];
+			converged[i] = false;
+		}
+
+		for (int iteration = 0; iteration < LINE_NEWTON_ITERATIONS; iteration++)
+		{
+			bool done = true;
+
+			evaluations += GetLineDerivatives(stageT, 0, nextV, alive, k, dk, valid);
+
+			for (int i = 0; i < alive; i++)
+			{
+				if (converged[i]) continue;
+				ok[i] &= valid[i];
+
+				double delta = (nextV[i] - curV[i] - h[i] * k[i]) / (1 - h[i] * dk[i]);
+				nextV[i] -= delta;
+				converged[i] = fabs(delta) <= _tolerance * 0.01;
+				done &= converged[i];
+			}
+
+			if (done) break;
+		}
+
+		int kept = 0;
+		for (int i = 0; i < alive; i++)
+		{
+			double factor = 0.5, step = h[i];
+			bool accepted = false;
+
+			if (ok[i] && converged[i] && isfinite(nextV[i]))
+			{
+				//Filtered through the Newton matrix, otherwise it would measure the unstable predictor.
+				//Lines far off screen only need to come back in the right place, so they get more slack
+				double err = fabs(nextV[i] - predicted[i]) / 2 / fabs(1 - step * dk[i]);
+				double tolerance = _tolerance * fmax(1, fabs(curV[i]) / _dspRange);
+				double length = hypot(step, nextV[i] - curV[i]) * scale;
+
+				factor = err > 0 ? 0.9 * sqrt(tolerance / err) : 5;
+				if (factor > 5) factor = 5;
+				if (factor < 0.2) factor = 0.2;
+				//Long visible chords would show as corners, so they are shortened like errors
+				if (fabs(curV[i]) > _dspRange && fabs(nextV[i]) > _dspRange) length = 0;
+				if (length > LINE_MAX_SEGMENT && factor > 0.9 * LINE_MAX_SEGMENT / length)
+					factor = 0.9 * LINE_MAX_SEGMENT / length;
+
+				accepted = err <= tolerance && length <= LINE_MAX_SEGMENT;
+			}
+
+			if (accepted)
+			{
+				PlotSegment(plot, sweep, &runs[lanes[i]], t[i], curV[i], t[i] + step, nextV[i]);
+
+				if (last[i] || nextV[i] < lines->bottom || nextV[i] > lines->top || IsLineGone(plot, sweep, t[i] + step, nextV[i]))
+					continue;
+				t[i] += step;
+				curV[i] = nextV[i];
+			}
+
+			//Undefined regions and failed solves shrink the step until the line is dropped
+			step *= factor;
+			if (fabs(step) > hMax) step = step > 0 ? hMax : -hMax;
+			if (fabs(step) < hMin)
+				continue;
+
+			t[kept] = t[i];
+			h[kept] = step;
+			lanes[kept] = lanes[i];
+			curV[kept++] = curV[i];
+		}
+		alive = kept;
+	}
+
+	return evaluations;
+}
+void PlotSegment(LinePlot *plot, int sweep, PointList *run, double fromT, double fromV, double toT, double toV)
+{
+	//Runs only hold visible steps, anything else ends them
+	if (fabs(fromV) > _dspRange || fabs(toV) > _dspRange)
+	{
+		if (run->pointC) FlushRun(plot, sweep, run);
+		return;
+	}
+
+	//Steps follow on from each other, so a run only starts with its first step's start
+	bool ok = run->pointC || AppendPoint(run, fromT, fromV);
+	if (!ok || !AppendPoint(run, toT, toV))
+	{
+		FlushRun(plot, sweep, run);
+		DrawSegment(plot, sweep, fromT, fromV, toT, toV);
+		return;
+	}
+
+	if (run->pointC >= LINE_RUN_POINTS)
+	{
+		FlushRun(plot, sweep, run);
+		AppendPoint(run, toT, toV);
+	}
+}
+void FlushRun(LinePlot *plot, int sweep, PointList *run)
+{
+	if (!run->pointC)
+		return;
+
+	//Square pixels, so one tolerance in display units holds along both axes
+	double tolerance = LINE_SIMPLIFY * 2 * _dspRange / _canvasWidth;
+	int pointC = SimplifyPolyline(run->ts, run->ys, run->pointC, tolerance);
+
+	for (int i = 1; i < pointC; i++) DrawSegment(plot, sweep, run->ts[i - 1], run->ys[i - 1], run->ts[i], run->ys[i]);
+	run->pointC = 0;
+}
+void DrawSegment(LinePlot *plot, int sweep, double fromT, double fromV, double toT, double toV)
+{
+	if (_lineLog.lists) AppendSegment(&_lineLog.lists[GetThreadIndex()], fromT, fromV, toT, toV, sweep + 1);
+	else CoverSegment(&plot->coverage, fromT, fromV, toT, toV, sweep + 1);
+}
+void CoverSegment(Coverage *coverage, double fromT, double fromV, double toT, double toV, uint8_t layer)
+{
+	if (_antialias) CoverSmoothLine(coverage, TToSubPx(fromT), VToSubPx(fromV), TToSubPx(toT), VToSubPx(toV), layer);
+	else CoverLine(coverage, TToPx(fromT), VToPx(fromV), TToPx(toT), VToPx(toV), layer);
+}
+void GetLineCulling(const LineSweep *lines, double *above, double *below)
+{
+	bool forward = lines->start < lines->end;
+	double first = fmin(lines->start, lines->end) - lines->step, last = fmax(lines->start, lines->end) + lines->step;
+	bool aboveOk = true, belowOk = true;
+
+	*above = *below = forward ? INFINITY : -INFINITY;
+
+	//Every t the sweep is evaluated at has to be on the map
+	if (!_regions.classes || first < _regions.left || last >= _regions.left + _regions.columnC * _regions.leafSize)
+		return;
+
+	//Walks back from the end of the sweep while every leaf off the display, or straddling its edge,
+	//sends lines further out or ends them. Moving up means a positive slope forwards, a negative one backwards
+	for (int c = 0; c < _regions.columnC && (aboveOk || belowOk); c++)
+	{
+		int column = forward ? _regions.columnC - 1 - c : c;
+
+		for (int row = 0; row < _regions.rowC; row++)
+		{
+			size_t leaf = (size_t)column * _regions.rowC + row;
+			double bottom = _regions.bottom + row * _regions.leafSize, top = bottom + _regions.leafSize;
+			double lo = _regions.los[leaf], hi = _regions.his[leaf];
+			bool undefined = _regions.classes[leaf] == FORMULA_UNDEFINED;
+
+			if (top > _dspRange) aboveOk &= undefined || (forward ? lo >= 0 : hi <= 0);
+			if (bottom < -_dspRange) belowOk &= undefined || (forward ? hi <= 0 : lo >= 0);
+		}
+
+		double edge = _regions.left + (forward ? column : column + 1) * _regions.leafSize;
+		if (aboveOk) *above = edge;
+		if (belowOk) *below = edge;
+	}
+}
+bool IsLineGone(const LinePlot *plot, int sweep, double t, double y)
+{
+	bool forward = plot->sweeps[sweep].start < plot->sweeps[sweep].end;
+
+	//Beyond the map a single step could bring a line back from anywhere
+	if (!_regions.classes || y < _regions.bottom || y >= _regions.bottom + _regions.rowC * _regions.leafSize)
+		return false;
+
+	if (y > _dspRange) return forward ? t >= plot->goneAbove[sweep] : t <= plot->goneAbove[sweep];
+	if (y < -_dspRange) return forward ? t >= plot->goneBelow[sweep] : t <= plot->goneBelow[sweep];
+	return false;
+}
+
+
+
+long PlotEvenly(Image *img)
+{
+	//Jobard-Lefer placement: every line is traced until it runs into another, and the next ones
+	//start one separation to either side of it, wherever that is still empty
+	LineSweep sweep = { .color = SKYBLUE };
+	LinePlot plot = { .sweeps = &sweep, .sweepC = 1, .evaluations = 0 };
+	Occupancy occupancy;
+	PointList curve = { 0 }, seeds = { 0 };
+	double spacing = EVEN_SEPARATION * _lineSpread * (_draft ? VIEW_DRAFT_LINE_SPACING : 1), separation = spacing * _dspRange;
+	int latticeC = (int)ceil(2 / spacing), lattice = 0, nextSeed = 0;
+
+	bool ok = _lineLog.lists || InitCoverage(&plot.coverage, img->width, img->height);
+	ok &= InitOccupancy(&occupancy, -_dspRange, -_dspRange, 2 * _dspRange, separation);
+	ok &= AppendPoint(&seeds, 0, 0);
+
+	while (ok && !IsRenderCancelled())
+	{
+		double t, y;
+
+		//Seeds offered by earlier lines first, then a lattice catches areas none of them reached
+		if (nextSeed < seeds.pointC)
+		{
+			t = seeds.ts[nextSeed];
+			y = seeds.ys[nextSeed++];
+		}
+		else if (lattice < latticeC * latticeC)
+		{
+			t = -_dspRange + (lattice % latticeC + 0.5) * separation;
+			y = -_dspRange + (lattice / latticeC + 0.5) * separation;
+			lattice++;
+		}
+		else break;
+
+		if (fabs(t) > _dspRange || fabs(y) > _dspRange || IsOccupied(&occupancy, t, y, separation))
+			continue;
+
+		//Traced back first and flipped, so the points run in increasing t
+		curve.pointC = 0;
+		plot.evaluations += TraceEven(&occupancy, t, y, -1, &curve);
+		for (int i = 0; i < curve.pointC / 2; i++)
+		{
+			int j = curve.pointC - 1 - i;
+			double swapT = curve.ts[i], swapY = curve.ys[i];
+			curve.ts[i] = curve.ts[j]; curve.ys[i] = curve.ys[j];
+			curve.ts[j] = swapT; curve.ys[j] = swapY;
+		}
+		ok &= AppendPoint(&curve, t, y);
+		plot.evaluations += TraceEven(&occupancy, t, y, 1, &curve);
+
+		//A lone point is undefined or boxed in, it is not worth keeping out others
+		if (curve.pointC < 2)
+			continue;
+
+		for (int i = 0; ok && i < curve.pointC; i++)
+		{
+			ok &= AddOccupancy(&occupancy, curve.ts[i], curve.ys[i]);
+			if (i % EVEN_SEED_STRIDE) continue;
+
+			//Seeds sit one separation away along the normal, on both sides
+			int j = i + 1 < curve.pointC ? i + 1 : i - 1;
+			double dt = curve.ts[j] - curve.ts[i], dy = curve.ys[j] - curve.ys[i];
+			double length = hypot(dt, dy);
+			double normalT = -dy / length * separation, normalY = dt / length * separation;
+
+			ok &= AppendPoint(&seeds, curve.ts[i] + normalT, curve.ys[i] + normalY);
+			ok &= AppendPoint(&seeds, curve.ts[i] - normalT, curve.ys[i] - normalY);
+		}
+
+		//The whole curve is on the display, it is drawn as one run
+		if (ok) FlushRun(&plot, 0, &curve);
+	}
+
+	if (!ok) fprintf(stderr, "Failed to allocate line buffers.\n");
+	if (plot.coverage.layers) CompositeCoverage(&plot.coverage, img, &sweep.color);
+	_lineLog.colors[0] = sweep.color;
+
+	FreeCoverage(&plot.coverage);
+	FreeOccupancy(&occupancy);
+	free(curve.ts); free(curve.ys);
+	free(seeds.ts); free(seeds.ys);
+
+	return plot.evaluations;
+}
+long TraceEven(const Occupancy *occupancy, double t, double y, double direction, PointList *curve)
+{
+	double step = EVEN_STEP * _dspRange, distance = EVEN_SEPARATION * _lineSpread * (_draft ? VIEW_DRAFT_LINE_SPACING : 1) * EVEN_TEST_RATIO * _dspRange;
+	double previousK = 0;
+	long evaluations = 0;
+
+	//Appends the points after (t, y), until the line leaves the display, is undefined or nears another
+	for (int i = 0; i < EVEN_MAX_POINTS; i++)
+	{
+		double k;
+		bool valid;
+
+		//One point at a time, specializing on t would cost more than it saves
+		evaluations += GetLineDerivatives(&t, 0, &y, 1, &k, NULL, &valid);
+		if (!valid || !isfinite(k))
+			break;
+		//Turning back on itself within one step means a singularity, the line would zigzag across it
+		if (i && 1 + k * previousK < 0)
+			break;
+		previousK = k;
+
+		//Steps of equal arc length, so steep stretches get as many points as flat ones
+		double dt = direction * step / sqrt(1 + k * k);
+		t += dt;
+		y += k * dt;
+
+		if (fabs(t) > _dspRange || fabs(y) > _dspRange || IsOccupied(occupancy, t, y, distance))
+			break;
+		if (!AppendPoint(curve, t, y))
+			break;
+	}
+
+	return evaluations;
+}
+bool AppendPoint(PointList *list, double t, double y)
+{
+	if (list->pointC == list->pointCapacity)
+	{
+		int capacity = list->pointCapacity ? list->pointCapacity * 2 : 1024;
+		double *ts = realloc(list->ts, capacity * sizeof(double));
+		if (ts) list->ts = ts;
+		double *ys = realloc(list->ys, capacity * sizeof(double));
+		if (ys) list->ys = ys;
+
+		if (!ts || !ys) return false;
+		list->pointCapacity = capacity;
+	}
+
+	list->ts[list->pointC] = t;
+	list->ys[list->pointC++] = y;
+	return true;
 }
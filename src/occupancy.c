@@ -0,0 +1,108 @@
+//occupancy.c -
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "occupancy.h"
+
+
+
+static bool GetCell(const Occupancy *occupancy, double t, double y, int *column, int *row)
+{
+	double u = (t - occupancy->left) / occupancy->cellSize, v = (y - occupancy->bottom) / occupancy->cellSize;
+
+	//Also rejects NaN
+	if (!(u >= 0 && v >= 0 && u < occupancy->cellC && v < occupancy->cellC))
+		return false;
+
+	*column = (int)u;
+	*row = (int)v;
+	return true;
+}
+
+
+
+bool InitOccupancy(Occupancy *occupancy, double left, double bottom, double size, double cellSize)
+{
+	int cellC = (int)ceil(size / cellSize);
+	if (cellC < 1) cellC = 1;
+
+	occupancy->heads = malloc((size_t)cellC * cellC * sizeof(int));
+	occupancy->ts = occupancy->ys = NULL;
+	occupancy->nexts = NULL;
+	occupancy->pointC = occupancy->pointCapacity = 0;
+	occupancy->left = left;
+	occupancy->bottom = bottom;
+	occupancy->cellSize = cellSize;
+	occupancy->cellC = cellC;
+
+	if (!occupancy->heads) return false;
+
+	for (size_t i = 0; i < (size_t)cellC * cellC; i++) occupancy->heads[i] = -1;
+	return true;
+}
+
+void FreeOccupancy(Occupancy *occupancy)
+{
+	free(occupancy->heads);
+	free(occupancy->ts);
+	free(occupancy->ys);
+	free(occupancy->nexts);
+	occupancy->heads = occupancy->nexts = NULL;
+	occupancy->ts = occupancy->ys = NULL;
+	occupancy->pointC = occupancy->pointCapacity = 0;
+}
+
+bool AddOccupancy(Occupancy *occupancy, double t, double y)
+{
+	int column, row;
+	if (!GetCell(occupancy, t, y, &column, &row))
+		return true;
+
+	if (occupancy->pointC == occupancy->pointCapacity)
+	{
+		int capacity = occupancy->pointCapacity ? occupancy->pointCapacity * 2 : 1024;
+		double *ts = realloc(occupancy->ts, capacity * sizeof(double));
+		if (ts) occupancy->ts = ts;
+		double *ys = realloc(occupancy->ys, capacity * sizeof(double));
+		if (ys) occupancy->ys = ys;
+		int *nexts = realloc(occupancy->nexts, capacity * sizeof(int));
+		if (nexts) occupancy->nexts = nexts;
+
+		if (!ts || !ys || !nexts) return false;
+		occupancy->pointCapacity = capacity;
+	}
+
+	int cell = row * occupancy->cellC + column, point = occupancy->pointC++;
+	occupancy->ts[point] = t;
+	occupancy->ys[point] = y;
+	occupancy->nexts[point] = occupancy->heads[cell];
+	occupancy->heads[cell] = point;
+	return true;
+}
+
+bool IsOccupied(const Occupancy *occupancy, double t, double y, double distance)
+{
+	int column, row;
+	if (!GetCell(occupancy, t, y, &column, &row))
+		return false;
+
+	//Anything within distance is in this cell or one of its neighbours
+	for (int v = row - 1; v <= row + 1; v++)
+	{
+		if (v < 0 || v >= occupancy->cellC) continue;
+
+		for (int u = column - 1; u <= column + 1; u++)
+		{
+			if (u < 0 || u >= occupancy->cellC) continue;
+
+			for (int point = occupancy->heads[v * occupancy->cellC + u]; point != -1; point = occupancy->nexts[point])
+			{
+				double dt = occupancy->ts[point] - t, dy = occupancy->ys[point] - y;
+				if (dt * dt + dy * dy < distance * distance) return true;
+			}
+		}
+	}
+
+	return false;
+}
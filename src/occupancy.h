@@ -0,0 +1,29 @@
+//occupancy.h - Points bucketed into square cells, to tell how close a curve runs to earlier ones
+
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include <stdbool.h>
+
+//Cells cover [left, left + size) x [bottom, bottom + size), each holds a linked list of its points
+typedef struct
+{
+	int *heads;		//First point of each cell, -1 when empty
+	double *ts, *ys;
+	int *nexts;
+	int pointC, pointCapacity;
+	double left, bottom, cellSize;
+	int cellC;		//Cells along each side
+} Occupancy;
+
+
+bool InitOccupancy(Occupancy *occupancy, double left, double bottom, double size, double cellSize);
+void FreeOccupancy(Occupancy *occupancy);
+
+//Points outside the covered square are ignored
+bool AddOccupancy(Occupancy *occupancy, double t, double y);
+
+//True when a point lies closer than distance to (t, y). Distance must not exceed the cell size
+bool IsOccupied(const Occupancy *occupancy, double t, double y, double distance);
+
+#endif
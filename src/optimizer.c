@@ -0,0 +1,253 @@
+//optimizer.c -
+
+#include <string.h>
+
+#include "formulas.h"
+#include "kernels.h"
+
+//Cells are tracked symbolically. Pending values (constants and variable loads) are
+//only written to the runtime buffers when something actually reads them there.
+#define CELL_RUNTIME	0
+#define CELL_CONSTANT	1
+#define CELL_VARIABLE	2
+
+typedef struct
+{
+	int kind;
+	double value;
+	int slot;
+} Cell;
+
+typedef struct
+{
+	Formula *formula;	//Program being written
+	int bufferHead;		//Runtime BufferHead of the emitted code
+	bool overflow;
+} Emitter;
+
+
+
+static void Emit(Emitter *out, uint8_t byte)
+{
+	if (!AppendFormula(out->formula, byte)) out->overflow = true;
+}
+static void EmitValue(Emitter *out, double value)
+{
+	int index = AddFormulaConstant(out->formula, value);
+	if (index == -1) out->overflow = true;
+	else Emit(out, index);
+}
+
+static void SeekTo(Emitter *out, int bufferHead)
+{
+	while (out->bufferHead < bufferHead) { Emit(out, FORMULA_SEEK_RIGHT); out->bufferHead++; }
+	while (out->bufferHead > bufferHead) { Emit(out, FORMULA_SEEK_LEFT); out->bufferHead--; }
+}
+
+static void Materialize(Emitter *out, Cell *cells, int index)
+{
+	if (cells[index].kind == CELL_RUNTIME) return;
+
+	SeekTo(out, index);
+	if (cells[index].kind == CELL_CONSTANT)
+	{
+		Emit(out, FORMULA_LITERAL);
+		EmitValue(out, cells[index].value);
+	}
+	else Emit(out, FORMULA_VAR_BASE + cells[index].slot);
+
+	cells[index].kind = CELL_RUNTIME;
+}
+
+static double Fold(const FormulaKernels *kernels, uint8_t instruction, double b, double a)
+{
+	if (FORMULA_IS_BINARY(instruction)) kernels->binary[instruction](&a, &b, 1);
+	else kernels->unary[instruction](&a, 1);
+
+	return a;
+}
+
+
+
+static void LoadVariable(Cell *cell, int slot, int bound, double value)
+{
+	if (slot == bound)
+	{
+		cell->kind = CELL_CONSTANT;
+		cell->value = value;
+	}
+	else
+	{
+		cell->kind = CELL_VARIABLE;
+		cell->slot = slot;
+	}
+}
+
+//Rewrites formula into residual, treating the bound slot (if not -1) as a constant
+static bool Rewrite(const Formula *formula, int bound, double value, Formula *residual)
+{
+	static const Cell unknown = { .kind = CELL_RUNTIME };
+	const FormulaKernels *kernels = GetFormulaKernels();
+	const uint8_t *src = formula->code;
+	int srcHead = 0, bufferHead = 0;
+	uint8_t instruction;
+	Cell cells[MAX_BUFFERS], clip = { .kind = CELL_CONSTANT, .value = 0.0 };
+	Emitter out = { .formula = residual, .bufferHead = 0, .overflow = false };
+
+	if (!formula->verified || residual == formula) return false;
+
+	ResetFormula(residual);
+	memcpy(residual->slots, formula->slots, sizeof(formula->slots));
+	residual->slotC = formula->slotC;
+
+	for (int i = 0; i < MAX_BUFFERS; i++) cells[i] = unknown;
+
+	while ((instruction = src[srcHead++]) != FORMULA_RET)
+	{
+		Cell *a = &cells[bufferHead];
+
+		if (FORMULA_IS_VAR(instruction))
+		{
+			LoadVariable(a, instruction - FORMULA_VAR_BASE, bound, value);
+			continue;
+		}
+
+		if (FORMULA_IS_UNARY(instruction))
+		{
+			if (a->kind == CELL_CONSTANT)
+			{
+				a->value = Fold(kernels, instruction, 0.0, a->value);
+				continue;
+			}
+
+			Materialize(&out, cells, bufferHead);
+			SeekTo(&out, bufferHead);
+			Emit(&out, instruction);
+			continue;
+		}
+
+		if (FORMULA_IS_BINARY(instruction) || FORMULA_IS_FUSED(instruction))
+		{
+			Cell *b = &cells[bufferHead - 1];
+
+			//Existing superinstructions are split back into operand and operation
+			if (FORMULA_IS_FUSED(instruction))
+			{
+				if (instruction < FORMULA_ADD_VAR)
+				{
+					a->kind = CELL_CONSTANT;
+					a->value = formula->constants[src[srcHead]];
+				}
+				else LoadVariable(a, src[srcHead], bound, value);
+				srcHead++;
+				instruction = FORMULA_FUSED_BASE(instruction);
+			}
+
+			if (a->kind == CELL_CONSTANT && b->kind == CELL_CONSTANT)
+			{
+				a->value = Fold(kernels, instruction, b->value, a->value);
+				continue;
+			}
+
+			Materialize(&out, cells, bufferHead - 1);
+			SeekTo(&out, bufferHead);
+
+			if (a->kind == CELL_CONSTANT)
+			{
+				Emit(&out, FORMULA_ADD_LITERAL + instruction - FORMULA_ADD);
+				EmitValue(&out, a->value);
+			}
+			else if (a->kind == CELL_VARIABLE)
+			{
+				Emit(&out, FORMULA_ADD_VAR + instruction - FORMULA_ADD);
+				Emit(&out, a->slot);
+			}
+			else Emit(&out, instruction);
+
+			a->kind = CELL_RUNTIME;
+			continue;
+		}
+
+		switch (instruction)
+		{
+			case FORMULA_CONSTANT:
+			case FORMULA_LITERAL:
+				a->kind = CELL_CONSTANT;
+				a->value = formula->constants[src[srcHead++]];
+				break;
+
+			case FORMULA_CLIP_WRITE:
+				if (a->kind == CELL_RUNTIME)
+				{
+					SeekTo(&out, bufferHead);
+					Emit(&out, FORMULA_CLIP_WRITE);
+				}
+				clip = *a;
+				break;
+
+			case FORMULA_CLIP_READ:
+				if (clip.kind == CELL_RUNTIME)
+				{
+					SeekTo(&out, bufferHead);
+					Emit(&out, FORMULA_CLIP_READ);
+				}
+				*a = clip;
+				break;
+
+			case FORMULA_SEEK_LEFT:
+				bufferHead--;
+				break;
+
+			case FORMULA_SEEK_RIGHT:
+				bufferHead++;
+				break;
+
+			case FORMULA_COPY_LEFT:
+			case FORMULA_COPY_RIGHT:
+			{
+				int target = bufferHead + (instruction == FORMULA_COPY_LEFT ? -1 : 1);
+				if (a->kind == CELL_RUNTIME)
+				{
+					SeekTo(&out, bufferHead);
+					Emit(&out, instruction);
+					out.bufferHead = target;
+				}
+				cells[target] = *a;
+				bufferHead = target;
+				break;
+			}
+		}
+	}
+
+	//The result has to live in the final buffer
+	Materialize(&out, cells, bufferHead);
+	SeekTo(&out, bufferHead);
+
+	Emit(&out, FORMULA_RET);
+
+	if (out.overflow) return false;
+
+	return VerifyFormula(residual);
+}
+
+
+
+bool OptimizeFormula(Formula *formula)
+{
+	Formula optimized = { 0 };
+
+	if (!Rewrite(formula, -1, 0.0, &optimized))
+	{
+		FreeFormula(&optimized);
+		return false;
+	}
+
+	FreeFormula(formula);
+	*formula = optimized;
+	return true;
+}
+
+bool SpecializeFormula(const Formula *formula, int slot, double value, Formula *residual)
+{
+	return Rewrite(formula, slot, value, residual);
+}
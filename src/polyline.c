@@ -0,0 +1,94 @@
+//polyline.c -
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "polyline.h"
+
+
+
+//Squared, to the segment rather than the infinite line, so curves doubling back are not flattened onto themselves
+static double GetDistance2(double x, double y, double fromX, double fromY, double toX, double toY)
+{
+	double dx = toX - fromX, dy = toY - fromY, length = dx * dx + dy * dy;
+	double along = length > 0 ? ((x - fromX) * dx + (y - fromY) * dy) / length : 0;
+
+	if (along < 0) along = 0;
+	if (along > 1) along = 1;
+	double offX = x - fromX - along * dx, offY = y - fromY - along * dy;
+	return offX * offX + offY * offY;
+}
+
+
+
+int SimplifyPolyline(double *xs, double *ys, int pointC, double tolerance)
+{
+	//Half the tolerance each for merging runs of short steps and for Douglas-Peucker, their errors add up
+	double half = tolerance / 2, half2 = half * half;
+	if (pointC < 3)
+		return pointC;
+
+	//Steps shorter than that merge into the point they start from, most integration steps are
+	int keptC = 1;
+	for (int i = 1; i < pointC - 1; i++)
+	{
+		double dx = xs[i] - xs[keptC - 1], dy = ys[i] - ys[keptC - 1];
+		if (dx * dx + dy * dy <= half2) continue;
+		xs[keptC] = xs[i];
+		ys[keptC++] = ys[i];
+	}
+	xs[keptC] = xs[pointC - 1];
+	ys[keptC++] = ys[pointC - 1];
+	pointC = keptC;
+	if (pointC < 3)
+		return pointC;
+
+	//Douglas-Peucker with an explicit stack of [first, last] spans, every span pushed splits off a kept point
+	bool *keep = calloc(pointC, sizeof(bool));
+	int *spans = malloc(2 * (size_t)pointC * sizeof(int));
+	if (!keep || !spans)
+	{
+		free(keep); free(spans);
+		return pointC;
+	}
+
+	int spanC = 1;
+	keep[0] = keep[pointC - 1] = true;
+	spans[0] = 0;
+	spans[1] = pointC - 1;
+	while (spanC)
+	{
+		spanC--;
+		int first = spans[2 * spanC], last = spans[2 * spanC + 1], farthest = -1;
+		double distance = half2;
+
+		for (int i = first + 1; i < last; i++)
+		{
+			double d = GetDistance2(xs[i], ys[i], xs[first], ys[first], xs[last], ys[last]);
+			if (d > distance)
+			{
+				distance = d;
+				farthest = i;
+			}
+		}
+		if (farthest == -1) continue;
+
+		keep[farthest] = true;
+		spans[2 * spanC] = first;
+		spans[2 * spanC + 1] = farthest;
+		spans[2 * spanC + 2] = farthest;
+		spans[2 * spanC + 3] = last;
+		spanC += 2;
+	}
+
+	keptC = 0;
+	for (int i = 0; i < pointC; i++)
+	{
+		if (!keep[i]) continue;
+		xs[keptC] = xs[i];
+		ys[keptC++] = ys[i];
+	}
+
+	free(keep); free(spans);
+	return keptC;
+}
@@ -0,0 +1,10 @@
+//polyline.h - Curves thinned to the fewest points that stay within a tolerance of them
+
+#ifndef POLYLINE_H
+#define POLYLINE_H
+
+//Drops points of the curve in place, keeping both ends, so that every dropped point lies within tolerance
+//of the segment that replaces it. Returns the new point count, left unchanged if scratch memory runs out
+int SimplifyPolyline(double *xs, double *ys, int pointC, double tolerance);
+
+#endif
@@ -0,0 +1,105 @@
+//raster.c -
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "raster.h"
+
+
+
+typedef struct
+{
+	Image *img;
+	Color color;
+} RasterTarget;
+
+static void DrawPixel(void *context, int x, int y, uint8_t alpha)
+{
+	RasterTarget *target = context;
+	BlendPixel(target->img, x, y, target->color, alpha);
+}
+
+
+
+void WalkSmoothLine(double startX, double startY, double endX, double endY, int width, int height, RasterPixel pixel, void *context)
+{
+	if (!isfinite(startX) || !isfinite(startY) || !isfinite(endX) || !isfinite(endY))
+		return;
+
+	//Steps one pixel at a time along the major axis, splitting each step between the two pixels it falls across
+	bool alongX = fabs(endX - startX) >= fabs(endY - startY);
+	double startU = alongX ? startX : startY, startV = alongX ? startY : startX;
+	double endU = alongX ? endX : endY, endV = alongX ? endY : endX;
+	int majorC = alongX ? width : height, minorC = alongX ? height : width;
+
+	if (startU > endU)
+	{
+		double swap = startU; startU = endU; endU = swap;
+		swap = startV; startV = endV; endV = swap;
+	}
+	double slope = endU > startU ? (endV - startV) / (endU - startU) : 0;
+
+	double first = fmax(round(startU), 0), last = fmin(round(endU), majorC - 1);
+	for (int u = (int)first; u <= last; u++)
+	{
+		//Clamped, so the end pixels take the height of the endpoints instead of overshooting them
+		double v = startV + (fmin(fmax(u, startU), endU) - startU) * slope;
+		double below = floor(v);
+		uint8_t far = (uint8_t)round((v - below) * 255), near = 255 - far;
+
+		for (int i = 0; i < 2; i++)
+		{
+			int w = (int)below + i;
+			uint8_t alpha = i ? far : near;
+			if (!alpha || below + i < 0 || below + i >= minorC) continue;
+
+			if (alongX) pixel(context, u, w, alpha);
+			else pixel(context, w, u, alpha);
+		}
+	}
+}
+
+void BlendPixel(Image *img, int x, int y, Color color, uint8_t alpha)
+{
+	if (x < 0 || y < 0 || x >= img->width || y >= img->height) return;
+
+	Color *dst = &((Color *)img->data)[(size_t)y * img->width + x];
+	int a = alpha * color.a / 255;
+	if (a == 255)
+	{
+		*dst = color;
+		return;
+	}
+
+	//Source over, neither side premultiplied, so transparent tiles composite correctly later
+	int under = dst->a * (255 - a) / 255, total = a + under;
+	if (!total) return;
+	dst->r = (color.r * a + dst->r * under) / total;
+	dst->g = (color.g * a + dst->g * under) / total;
+	dst->b = (color.b * a + dst->b * under) / total;
+	dst->a = total;
+}
+
+void DrawSmoothLine(Image *img, double startX, double startY, double endX, double endY, Color color)
+{
+	RasterTarget target = { img, color };
+	WalkSmoothLine(startX, startY, endX, endY, img->width, img->height, DrawPixel, &target);
+}
+
+void DrawSmoothDisc(Image *img, double centerX, double centerY, double radius, Color color)
+{
+	int left = (int)floor(centerX - radius - 1), right = (int)ceil(centerX + radius + 1);
+	int top = (int)floor(centerY - radius - 1), bottom = (int)ceil(centerY + radius + 1);
+
+	//A pixel is a unit square, its coverage falls off linearly over the pixel straddling the edge
+	for (int y = top < 0 ? 0 : top; y <= bottom && y < img->height; y++)
+	{
+		for (int x = left < 0 ? 0 : left; x <= right && x < img->width; x++)
+		{
+			double coverage = radius + 0.5 - hypot(x - centerX, y - centerY);
+			if (coverage <= 0) continue;
+			BlendPixel(img, x, y, color, coverage >= 1 ? 255 : (uint8_t)round(coverage * 255));
+		}
+	}
+}
@@ -0,0 +1,26 @@
+//raster.h - Anti-aliased lines and discs drawn straight into images at their own resolution
+
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <stdint.h>
+
+#include "raylib.h"
+
+//Receives every pixel a smooth line touches, alpha is how much of it the line covers
+typedef void (*RasterPixel)(void *context, int x, int y, uint8_t alpha);
+
+
+//Wu line between sub-pixel endpoints, pixel (x, y) is centered on (x, y). Both ends are drawn at full
+//strength, so segments chained end to end join without dim spots. Pixels outside width x height are skipped
+void WalkSmoothLine(double startX, double startY, double endX, double endY, int width, int height, RasterPixel pixel, void *context);
+
+//Blends color over the pixel, weighted by alpha. Images must be R8G8B8A8, as GenImageColor makes them
+void BlendPixel(Image *img, int x, int y, Color color, uint8_t alpha);
+
+void DrawSmoothLine(Image *img, double startX, double startY, double endX, double endY, Color color);
+
+//Filled, with its edge pixels weighted by how much of them it covers
+void DrawSmoothDisc(Image *img, double centerX, double centerY, double radius, Color color);
+
+#endif
@@ -0,0 +1,129 @@
+//region.c -
+
+#include <stdlib.h>
+
+#include "region.h"
+#include "threads.h"
+
+//Roots are split this many levels before their boxes become tasks, so a few roots still spread
+#define REGION_TASK_LEVELS 2
+
+
+
+typedef struct
+{
+	RegionMap *map;
+	RegionBound bound;
+	int taskLevels;
+} RegionBuild;
+
+static void Fill(RegionMap *map, int column, int row, int size, int class, double lo, double hi)
+{
+	for (int i = column; i < column + size; i++)
+	{
+		for (int j = row; j < row + size; j++)
+		{
+			size_t leaf = (size_t)i * map->rowC + j;
+			map->classes[leaf] = class;
+			map->los[leaf] = lo;
+			map->his[leaf] = hi;
+		}
+	}
+}
+
+static void Split(RegionBuild *build, int column, int row, int size)
+{
+	RegionMap *map = build->map;
+	FormulaInterval slope;
+	double t = map->left + column * map->leafSize, y = map->bottom + row * map->leafSize, side = size * map->leafSize;
+	int class = build->bound(t, t + side, y, y + side, &slope);
+
+	__atomic_fetch_add(&map->boxC, 1, __ATOMIC_RELAXED);
+
+	//Nothing left to prove once undefined, or defined and of one sign
+	bool settled = class == FORMULA_UNDEFINED || (class == FORMULA_DEFINED && (slope.lo >= 0 || slope.hi <= 0));
+	if (settled || size == 1)
+	{
+		Fill(map, column, row, size, class, slope.lo, slope.hi);
+		return;
+	}
+
+	size /= 2;
+	Split(build, column, row, size);
+	Split(build, column + size, row, size);
+	Split(build, column, row + size, size);
+	Split(build, column + size, row + size, size);
+}
+
+static void SplitTask(void *context, int index)
+{
+	RegionBuild *build = context;
+	RegionMap *map = build->map;
+	int side = 1 << build->taskLevels, size = (1 << map->depth) >> build->taskLevels;
+	int root = index / (side * side), box = index % (side * side);
+	int rootRows = map->rowC >> map->depth;
+
+	int column = (root / rootRows << map->depth) + box / side * size;
+	int row = (root % rootRows << map->depth) + box % side * size;
+	Split(build, column, row, size);
+}
+
+
+
+bool InitRegionMap(RegionMap *map, double left, double bottom, double rootSize, int rootColumns, int rootRows, int depth)
+{
+	size_t leafC = ((size_t)rootColumns << depth) * ((size_t)rootRows << depth);
+
+	map->classes = malloc(leafC * sizeof(uint8_t));
+	map->los = malloc(leafC * sizeof(double));
+	map->his = malloc(leafC * sizeof(double));
+	map->left = left;
+	map->bottom = bottom;
+	map->leafSize = rootSize / (1 << depth);
+	map->columnC = rootColumns << depth;
+	map->rowC = rootRows << depth;
+	map->depth = depth;
+	map->boxC = 0;
+
+	if (!map->classes || !map->los || !map->his)
+	{
+		FreeRegionMap(map);
+		return false;
+	}
+
+	return true;
+}
+
+void FreeRegionMap(RegionMap *map)
+{
+	free(map->classes);
+	free(map->los);
+	free(map->his);
+	map->classes = NULL;
+	map->los = map->his = NULL;
+}
+
+void BuildRegionMap(RegionMap *map, RegionBound bound)
+{
+	RegionBuild build = { .map = map, .bound = bound };
+	int roots = (map->columnC >> map->depth) * (map->rowC >> map->depth);
+
+	//Levels above the tasks are never bounded, a root that would settle whole costs a few boxes more
+	build.taskLevels = map->depth < REGION_TASK_LEVELS ? map->depth : REGION_TASK_LEVELS;
+	map->boxC = 0;
+	RunParallel(roots << 2 * build.taskLevels, SplitTask, &build);
+}
+
+int GetRegion(const RegionMap *map, double t, double y, double *lo, double *hi)
+{
+	double u = (t - map->left) / map->leafSize, v = (y - map->bottom) / map->leafSize;
+
+	//Also rejects NaN
+	if (!(u >= 0 && v >= 0 && u < map->columnC && v < map->rowC))
+		return FORMULA_PARTLY_DEFINED;
+
+	size_t leaf = (size_t)(int)u * map->rowC + (int)v;
+	if (lo) *lo = map->los[leaf];
+	if (hi) *hi = map->his[leaf];
+	return map->classes[leaf];
+}
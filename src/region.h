@@ -0,0 +1,36 @@
+//region.h - Quadtree over the plane, proving where slopes are undefined or keep one sign
+
+#ifndef REGION_H
+#define REGION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "formulas.h"
+
+//Bounds the slope over [tLo, tHi] x [yLo, yHi], same contract as EvaluateFormulaInterval
+typedef int (*RegionBound)(double tLo, double tHi, double yLo, double yHi, FormulaInterval *ret);
+
+//Square roots of 1 << depth leaves a side, laid out in a grid. Leaf (i, j) covers
+//[left + i * leafSize, left + (i + 1) * leafSize) x [bottom + j * leafSize, bottom + (j + 1) * leafSize)
+typedef struct
+{
+	uint8_t *classes;	//Column major, as returned by the bound of the box the leaf ended up in
+	double *los, *his;	//Slope bounds over the defined part of each leaf
+	double left, bottom, leafSize;
+	int columnC, rowC, depth;
+	long boxC;			//Boxes bounded while building
+} RegionMap;
+
+
+bool InitRegionMap(RegionMap *map, double left, double bottom, double rootSize, int rootColumns, int rootRows, int depth);
+void FreeRegionMap(RegionMap *map);
+
+//Splits boxes until they are undefined or defined with a slope of one sign, or are leaves.
+//Splitting runs in parallel
+void BuildRegionMap(RegionMap *map, RegionBound bound);
+
+//Class of the leaf holding (t, y), FORMULA_PARTLY_DEFINED outside the map. lo and hi may be NULL
+int GetRegion(const RegionMap *map, double t, double y, double *lo, double *hi);
+
+#endif
@@ -0,0 +1,137 @@
+//server.c -
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "server.h"
+
+//Clients waiting to be accepted
+#define SERVER_BACKLOG 16
+
+
+
+int OpenServer(const char *path)
+{
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(address.sun_path)) return -1;
+	strcpy(address.sun_path, path);
+
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server < 0) return -1;
+
+	//Only a socket is replaced, never a file that happens to share the path
+	struct stat info;
+	if (!stat(path, &info) && S_ISSOCK(info.st_mode)) unlink(path);
+
+	if (bind(server, (struct sockaddr *)&address, sizeof(address)) || listen(server, SERVER_BACKLOG))
+	{
+		close(server);
+		return -1;
+	}
+	return server;
+}
+
+void CloseServer(int server, const char *path)
+{
+	close(server);
+	unlink(path);
+}
+
+bool AcceptConnection(int server, Connection *connection, int lineSize)
+{
+	connection->fd = accept(server, NULL, NULL);
+	if (connection->fd < 0) return false;
+
+	connection->start = connection->end = connection->length = 0;
+	connection->tooLong = false;
+	connection->lineSize = lineSize;
+	connection->line = malloc(lineSize);
+	if (!connection->line)
+	{
+		close(connection->fd);
+		connection->fd = -1;
+		return false;
+	}
+
+	//A blocked reply would hold up every other client
+	struct timeval timeout = { .tv_sec = SERVER_SEND_TIMEOUT };
+	setsockopt(connection->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	return true;
+}
+
+void CloseConnection(Connection *connection)
+{
+	close(connection->fd);
+	free(connection->line);
+	connection->fd = -1;
+	connection->line = NULL;
+}
+
+bool ReceiveBytes(Connection *connection)
+{
+	ssize_t got = read(connection->fd, connection->buffer, SERVER_BUFFER);
+	if (got < 0) return errno == EINTR || errno == EAGAIN;
+	if (!got) return false;
+
+	connection->start = 0;
+	connection->end = got;
+	return true;
+}
+
+bool HasBytes(const Connection *connection)
+{
+	return connection->start < connection->end;
+}
+
+int TakeLine(Connection *connection)
+{
+	while (connection->start < connection->end)
+	{
+		char *from = connection->buffer + connection->start;
+		int available = connection->end - connection->start;
+		char *lineEnd = memchr(from, '\n', available);
+		int take = lineEnd ? lineEnd - from : available;
+
+		if (!connection->tooLong && connection->length + take < connection->lineSize)
+		{
+			memcpy(connection->line + connection->length, from, take);
+			connection->length += take;
+		}
+		else connection->tooLong = true;
+
+		connection->start += lineEnd ? take + 1 : take;
+		if (!lineEnd) continue;
+
+		//The next line starts empty
+		int length = connection->tooLong ? -2 : connection->length;
+		connection->length = 0;
+		connection->tooLong = false;
+		if (length < 0) return length;
+
+		if (length && connection->line[length - 1] == '\r') length--;
+		connection->line[length] = '\0';
+		return length;
+	}
+	return -1;
+}
+
+bool WriteBytes(Connection *connection, const void *data, size_t size)
+{
+	const char *bytes = data;
+	while (size)
+	{
+		ssize_t sent = send(connection->fd, bytes, size, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0) return false;
+
+		bytes += sent;
+		size -= sent;
+	}
+	return true;
+}
@@ -0,0 +1,46 @@
+//server.h - Line based requests over a local Unix domain socket
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+//Bytes read from a client ahead of the line being parsed
+#define SERVER_BUFFER 4096
+//Seconds a reply may wait on a client that stopped reading
+#define SERVER_SEND_TIMEOUT 10
+
+typedef struct
+{
+	int fd;
+	char buffer[SERVER_BUFFER];
+	int start, end;		//Read bytes not handed out yet
+	char *line;			//Gathered until its line break arrives, lineSize bytes with the terminator
+	int lineSize, length;
+	bool tooLong;		//The rest of the line is skipped
+} Connection;
+
+
+//Listens on path, replacing a stale socket left there. Returns the listening socket, or -1
+int OpenServer(const char *path);
+void CloseServer(int server, const char *path);
+
+//Takes the next client, gathering lines of at most lineSize - 1 bytes. Fails when interrupted by a signal,
+//so a handler can stop the server. Clients that stop reading replies are dropped after SERVER_SEND_TIMEOUT
+bool AcceptConnection(int server, Connection *connection, int lineSize);
+void CloseConnection(Connection *connection);
+
+//Reads what the client sent, without blocking once poll reports it readable. Fails once the client is gone
+bool ReceiveBytes(Connection *connection);
+//Received bytes are waiting to be gathered into lines
+bool HasBytes(const Connection *connection);
+
+//Gathers received bytes into connection->line, which ends up without its line break. Returns its length once
+//the line break arrives, -1 while it has not, and -2 for a longer line, which is skipped
+int TakeLine(Connection *connection);
+
+//Fails if the client is gone, never raises SIGPIPE
+bool WriteBytes(Connection *connection, const void *data, size_t size);
+
+#endif
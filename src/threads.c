@@ -0,0 +1,201 @@
+//threads.c -
+
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "threads.h"
+
+
+
+//Indices [lo, hi) a thread still has to run, packed as hi << 32 | lo so one CAS moves both.
+//The owner takes from lo, thieves take the upper half. Padded to a cache line
+typedef struct
+{
+	uint64_t range;
+	char padding[56];
+} WorkRange;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake, done;
+	pthread_t workers[MAX_THREADS];
+	int workerC;			//Threads besides the caller
+	bool started, stopping;
+
+	//Current job, replaced under lock once every worker left it
+	ParallelTask task;
+	void *context;
+	WorkRange ranges[MAX_THREADS];	//Caller is 0, workers start at 1
+	unsigned generation;	//Bumped for every job so workers notice it
+	int busy;				//Workers still inside the current job
+} ThreadPool;
+
+static ThreadPool _pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+static __thread int _threadIndex;	//Same as the range a worker starts with
+
+
+
+static uint64_t PackRange(uint32_t lo, uint32_t hi) { return (uint64_t)hi << 32 | lo; }
+
+static bool TakeOwn(int self, int *index)
+{
+	uint64_t range = __atomic_load_n(&_pool.ranges[self].range, __ATOMIC_RELAXED);
+	uint32_t lo, hi;
+
+	do
+	{
+		lo = (uint32_t)range;
+		hi = range >> 32;
+		if (lo >= hi) return false;
+	} while (!__atomic_compare_exchange_n(&_pool.ranges[self].range, &range, PackRange(lo + 1, hi),
+		true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	*index = lo;
+	return true;
+}
+
+//Moves the upper half of the first non-empty range after self into self's, which is empty
+static bool Steal(int self)
+{
+	int threadC = _pool.workerC + 1;
+
+	for (int i = 1; i < threadC; i++)
+	{
+		WorkRange *victim = &_pool.ranges[(self + i) % threadC];
+		uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_RELAXED);
+		uint32_t lo, hi, mid;
+
+		do
+		{
+			lo = (uint32_t)range;
+			hi = range >> 32;
+			if (lo >= hi) break;
+			mid = hi - (hi - lo + 1) / 2;
+		} while (!__atomic_compare_exchange_n(&victim->range, &range, PackRange(lo, mid),
+			true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+		if (lo < hi)
+		{
+			__atomic_store_n(&_pool.ranges[self].range, PackRange(mid, hi), __ATOMIC_RELAXED);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+//Every index lives in exactly one range until it is taken, so leaving once nothing is left
+//to steal never drops work, at worst some of it finishes on fewer threads
+static void RunIndices(int self, ParallelTask task, void *context)
+{
+	int index;
+
+	while (true)
+	{
+		if (TakeOwn(self, &index)) task(context, index);
+		else if (!Steal(self)) break;
+	}
+}
+
+static void *WorkerMain(void *arg)
+{
+	int self = (int)(intptr_t)arg;
+	unsigned seen = 0;
+
+	_threadIndex = self;
+
+	pthread_mutex_lock(&_pool.lock);
+	while (true)
+	{
+		while (!_pool.stopping && _pool.generation == seen) pthread_cond_wait(&_pool.wake, &_pool.lock);
+		if (_pool.stopping) break;
+
+		seen = _pool.generation;
+		ParallelTask task = _pool.task;
+		void *context = _pool.context;
+		pthread_mutex_unlock(&_pool.lock);
+
+		RunIndices(self, task, context);
+
+		pthread_mutex_lock(&_pool.lock);
+		if (!--_pool.busy) pthread_cond_signal(&_pool.done);
+	}
+	pthread_mutex_unlock(&_pool.lock);
+
+	return NULL;
+}
+
+static void StartPool()
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	_pool.started = true;
+	if (cores < 1) cores = 1;
+	if (cores > MAX_THREADS) cores = MAX_THREADS;
+
+	//Failing to start some threads only leaves fewer of them
+	for (int i = 0; i < cores - 1; i++)
+	{
+		if (pthread_create(&_pool.workers[_pool.workerC], NULL, WorkerMain, (void *)(intptr_t)(_pool.workerC + 1))) break;
+		_pool.workerC++;
+	}
+}
+
+
+
+int GetThreadCount()
+{
+	if (!_pool.started) StartPool();
+	return _pool.workerC + 1;
+}
+
+int GetThreadIndex()
+{
+	return _threadIndex;
+}
+
+void RunParallel(int count, ParallelTask task, void *context)
+{
+	if (!_pool.started) StartPool();
+
+	if (count <= 1 || !_pool.workerC)
+	{
+		for (int i = 0; i < count; i++) task(context, i);
+		return;
+	}
+
+	int threadC = _pool.workerC + 1;
+
+	pthread_mutex_lock(&_pool.lock);
+	_pool.task = task;
+	_pool.context = context;
+	//Contiguous shares keep neighbouring indices on one thread until stealing kicks in
+	for (int i = 0; i < threadC; i++)
+		_pool.ranges[i].range = PackRange((int64_t)count * i / threadC, (int64_t)count * (i + 1) / threadC);
+	_pool.busy = _pool.workerC;
+	_pool.generation++;
+	pthread_cond_broadcast(&_pool.wake);
+	pthread_mutex_unlock(&_pool.lock);
+
+	RunIndices(0, task, context);
+
+	pthread_mutex_lock(&_pool.lock);
+	while (_pool.busy) pthread_cond_wait(&_pool.done, &_pool.lock);
+	pthread_mutex_unlock(&_pool.lock);
+}
+
+void FreeThreads()
+{
+	pthread_mutex_lock(&_pool.lock);
+	_pool.stopping = true;
+	pthread_cond_broadcast(&_pool.wake);
+	pthread_mutex_unlock(&_pool.lock);
+
+	for (int i = 0; i < _pool.workerC; i++) pthread_join(_pool.workers[i], NULL);
+
+	_pool.workerC = 0;
+	_pool.stopping = false;
+	_pool.started = false;
+}
@@ -0,0 +1,27 @@
+//threads.h - Pool of worker threads sized to the machine
+
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <stdbool.h>
+
+//Hard cap on pool size, regardless of the core count
+#define MAX_THREADS 256
+
+typedef void (*ParallelTask)(void *context, int index);
+
+
+//Threads tasks are spread across, the caller included. Starts the pool on first call
+int GetThreadCount();
+
+//Index of the calling thread in [0, GetThreadCount()), 0 for the thread that calls RunParallel
+int GetThreadIndex();
+
+//Runs task(context, i) for every i in [0, count) and returns once all of them finished.
+//Each thread, the caller included, starts on a contiguous share of the indices and steals
+//half of another thread's remaining share once its own runs out
+void RunParallel(int count, ParallelTask task, void *context);
+
+void FreeThreads();
+
+#endif
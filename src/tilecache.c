@@ -0,0 +1,65 @@
+//tilecache.c -
+
+#include <stdlib.h>
+
+#include "tilecache.h"
+
+
+
+bool InitTileCache(TileCache *cache, int capacity)
+{
+	cache->tiles = calloc(capacity, sizeof(CachedTile));
+	cache->capacity = cache->tiles ? capacity : 0;
+	cache->uses = 0;
+	return cache->tiles != NULL;
+}
+
+void FreeTileCache(TileCache *cache)
+{
+	for (int i = 0; i < cache->capacity; i++)
+		if (cache->tiles[i].lastUse) UnloadTexture(cache->tiles[i].texture);
+
+	free(cache->tiles);
+	cache->tiles = NULL;
+	cache->capacity = 0;
+}
+
+const CachedTile *FindTile(TileCache *cache, int level, int x, int y)
+{
+	//Only a few hundred tiles fit on the GPU anyway, a scan is cheaper than keeping a hash in step
+	for (int i = 0; i < cache->capacity; i++)
+	{
+		CachedTile *tile = &cache->tiles[i];
+		if (!tile->lastUse || tile->level != level || tile->x != x || tile->y != y) continue;
+
+		tile->lastUse = ++cache->uses;
+		return tile;
+	}
+	return NULL;
+}
+
+void StoreTile(TileCache *cache, int level, int x, int y, Texture texture, bool draft)
+{
+	if (!cache->capacity)
+	{
+		UnloadTexture(texture);
+		return;
+	}
+
+	//A tile rendered again takes its own slot, otherwise empty slots have the oldest use of all
+	int oldest = 0;
+	for (int i = 0; i < cache->capacity; i++)
+	{
+		CachedTile *tile = &cache->tiles[i];
+		if (tile->lastUse && tile->level == level && tile->x == x && tile->y == y)
+		{
+			oldest = i;
+			break;
+		}
+		if (tile->lastUse < cache->tiles[oldest].lastUse) oldest = i;
+	}
+
+	CachedTile *tile = &cache->tiles[oldest];
+	if (tile->lastUse) UnloadTexture(tile->texture);
+	*tile = (CachedTile){ .level = level, .x = x, .y = y, .texture = texture, .draft = draft, .lastUse = ++cache->uses };
+}
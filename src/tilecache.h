@@ -0,0 +1,37 @@
+//tilecache.h - Textures of rendered view tiles, kept by zoom level and tile index until the least recently used goes
+
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include <stdbool.h>
+
+#include "raylib.h"
+
+typedef struct
+{
+	int level, x, y;
+	Texture texture;
+	bool draft;			//Quick first pass, replaced once the tile is rendered in full
+	long lastUse;		//0 for an empty slot
+} CachedTile;
+
+typedef struct
+{
+	CachedTile *tiles;
+	int capacity;
+	long uses;
+} TileCache;
+
+
+bool InitTileCache(TileCache *cache, int capacity);
+
+//Unloads every texture still held
+void FreeTileCache(TileCache *cache);
+
+//The tile, or NULL if it is not cached. Marks it as used
+const CachedTile *FindTile(TileCache *cache, int level, int x, int y);
+
+//Takes ownership of the texture, unloading the one it replaces or the one evicted to make room
+void StoreTile(TileCache *cache, int level, int x, int y, Texture texture, bool draft);
+
+#endif